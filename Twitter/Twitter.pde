@@ -28,12 +28,21 @@
 #include <DallasTemperature.h>
 #include <sha1.h>
 #include <Time.h>
+#include <Clock.h>
+#include <HttpDate.h>
 #include <EEPROM.h>
+#include <Codec.h>
+#include <GetPut.h>
+#include <Entropy.h>
 #include <Twitter.h>
+#include <HomeWeather.h>
 
 /* OneWire bus pin. */
 #define ONE_WIRE_BUS 4
 
+/* An unconnected analog input for the entropy pool. */
+#define ENTROPY_PIN 0
+
 OneWire one_wire(ONE_WIRE_BUS);
 DallasTemperature sensors(&one_wire);
 
@@ -48,10 +57,25 @@ IPAddress subnet(255, 255, 255, 0);
 IPAddress twitter_ip(199, 59, 149, 232);
 uint16_t twitter_port = 80;
 
+/* The legacy EEPROM slots of the OAuth access token and token
+   secret, and the CRC-checked account record that replaces them.  The
+   EEPROM map is in HomeWeather.h. */
+#define EEPROM_ADDR_ACCESS_TOKEN	HOMEWEATHER_EEPROM_ACCESS_TOKEN
+#define EEPROM_ADDR_TOKEN_SECRET	HOMEWEATHER_EEPROM_TOKEN_SECRET
+#define EEPROM_ADDR_ACCOUNT		HOMEWEATHER_EEPROM_ACCOUNT
+
+#if TWITTER_ACCOUNT_LEN(TWITTER_TOKEN_LEN) > HOMEWEATHER_EEPROM_ACCOUNT_LEN
+#error "The Twitter account record does not fit its EEPROM area"
+#endif
+
 unsigned long last_tweet = 0;
 
 #define TWEET_DELTA (60L * 60L)
 
+/* The status queue tag of the temperature reports.  A new report
+   replaces an unsent older one. */
+#define TAG_TEMPERATURE 1
+
 /* Work buffer for twitter client.  This shold be fine for normal
    operations, the biggest items that are stored into the working
    buffer are URL encoded consumer and token secrets and HTTP response
@@ -72,6 +96,8 @@ setup()
 
   sensors.begin();
 
+  Entropy.begin(ENTROPY_PIN);
+
 #if 1
   if (Ethernet.begin(mac))
     {
@@ -91,8 +117,18 @@ setup()
   twitter.set_client_id(consumer_key, consumer_secret);
 
 #if 1
-  /* Read OAuth account identification from EEPROM. */
-  twitter.set_account_id(256, 384);
+  /* Read OAuth account identification from EEPROM.  The account
+     record is created from the legacy slots on the first boot. */
+  if (!twitter.load_account(EEPROM_ADDR_ACCOUNT))
+    {
+      if (twitter.migrate_account(EEPROM_ADDR_ACCOUNT,
+                                  EEPROM_ADDR_ACCESS_TOKEN,
+                                  EEPROM_ADDR_TOKEN_SECRET)
+          && twitter.load_account(EEPROM_ADDR_ACCOUNT))
+        Serial.println("Account record created");
+      else
+        Serial.println("No valid account record");
+    }
 #else
   /* Set OAuth account identification from program memory. */
   twitter.set_account_id(PSTR("*** set account access token here ***"),
@@ -134,15 +170,19 @@ loop()
           sprintf(msg, "Office temperature is %ld.%02ld\302\260C",
                   val / 100L, val % 100L);
 
-          Serial.print("Posting to Twitter: ");
+          Serial.print("Queueing for Twitter: ");
           Serial.println(msg);
 
           last_tweet = now;
 
-          if (twitter.post_status(msg))
+          if (!twitter.queue_status(TAG_TEMPERATURE, msg))
+            Serial.println("Status queue full");
+        }
+
+      if (twitter.queued() > 0)
+        {
+          if (twitter.post_queued())
             Serial.println("Status updated");
-          else
-            Serial.println("Update failed");
         }
     }
 
@@ -30,8 +30,13 @@
 #include <SoftwareSerial.h>
 #include <SerialPacket.h>
 #include <CommandLine.h>
+#include <Codec.h>
 #include <GetPut.h>
+#include <Config.h>
+#include <KVLog.h>
 #include <HomeWeather.h>
+#include <TxScheduler.h>
+#include <sha1.h>
 
 /* Temperature sensor data wire is plugged into port 2 on the
    Arduino. */
@@ -44,19 +49,61 @@
 #define ID_LEN 8
 #define SECRET_LEN 8
 
-/* EEPROM addresses. */
+/* The maximum number of sensors reported.  The readings of the
+   sensors beyond this are not sent. */
+#define MAX_SENSORS 4
+
+/* The minimum time between transmissions in milliseconds. */
+#define TX_INTERVAL 2000L
+
+/* Default deadband in 1/100 degrees Celsius. */
+#define DEFAULT_DEADBAND 10
+
+/* Default heartbeat interval in seconds. */
+#define DEFAULT_HEARTBEAT 60
+
+/* Temperature conversion time in milliseconds (12-bit
+   resolution). */
+#define CONVERSION_TIME 750
+
+/* The number of bytes to transmit between other work. */
+#define TX_CHUNK 4
+
+/* The configuration area of two record slots and the current
+   version of the record.  The EEPROM map is in HomeWeather.h. */
+#define EEPROM_ADDR_CONFIG	HOMEWEATHER_EEPROM_CONFIG
+#define CONFIG_SLOT_LEN		HOMEWEATHER_EEPROM_CONFIG_SLOT_LEN
+#define CONFIG_VERSION		1
+
+/* The legacy EEPROM layout.  It is migrated to the configuration
+   record on the first boot. */
 #define EEPROM_ADDR_CONFIGURED	0
 #define EEPROM_ADDR_ID		(EEPROM_ADDR_CONFIGURED + 1)
 #define EEPROM_ADDR_SECRET	(EEPROM_ADDR_ID + ID_LEN)
 #define EEPROM_ADDR_VERBOSE	(EEPROM_ADDR_SECRET + SECRET_LEN)
+#define EEPROM_ADDR_DEADBAND	(EEPROM_ADDR_VERBOSE + 1)
+#define EEPROM_ADDR_HEARTBEAT	(EEPROM_ADDR_DEADBAND + 2)
+#define EEPROM_ADDR_BOOTS	(EEPROM_ADDR_HEARTBEAT + 2)
 
 #define OAUTH_ITEM_MAX_LENGTH	128
 
-#define EEPROM_ADDR_ACCESS_TOKEN	256
-#define EEPROM_ADDR_TOKEN_SECRET	384
+#define EEPROM_ADDR_ACCESS_TOKEN	HOMEWEATHER_EEPROM_ACCESS_TOKEN
+#define EEPROM_ADDR_TOKEN_SECRET	HOMEWEATHER_EEPROM_TOKEN_SECRET
+
+/* The wear-levelled log of the frequently updated state. */
+#define EEPROM_ADDR_KVLOG	HOMEWEATHER_EEPROM_KVLOG
+#define KVLOG_LEN		HOMEWEATHER_EEPROM_KVLOG_LEN
+
+/* The keys of the log. */
+#define KV_BOOTS		0	/* The boot count */
 
 SoftwareSerial rf_serial = SoftwareSerial(RF_RX_PIN, RF_TX_PIN);
-SerialPacket serial_packet = SerialPacket(&rf_serial);
+/* The client only transmits RF packets.  A packet of MAX_SENSORS
+   values and the MAC takes 86 bytes. */
+#define RF_TX_BUFFER_LEN 96
+uint8_t rf_tx_buffers[2 * RF_TX_BUFFER_LEN];
+SerialPacket serial_packet = SerialPacket(&rf_serial, 0, 0, rf_tx_buffers,
+                                          RF_TX_BUFFER_LEN);
 
 /* Setup a OneWire instance to communicate with any OneWire devices
    (not just Maxim/Dallas temperature ICs). */
@@ -72,8 +119,53 @@ uint8_t secret[SECRET_LEN];
 
 uint8_t verbose = 0;
 
+/* The packet sequence number.  The high byte is the boot count so
+   that the sequence numbers grow over restarts and the server can
+   reject replayed packets. */
 uint32_t msg_seqnum;
 
+/* Do we authenticate our packets?  The packets are authenticated
+   when the secret is set. */
+bool authenticate = false;
+
+/* The precomputed HMAC key state of our secret. */
+uint8_t key_state[HMAC_STATE_LENGTH];
+
+/* Readings are sent when they differ from the last sent values by
+   more than `deadband' (1/100 degrees Celsius) or when `heartbeat'
+   seconds have passed since the last transmission. */
+uint16_t deadband;
+uint16_t heartbeat;
+
+/* The boot count.  Its low byte is the high byte of the packet
+   sequence numbers. */
+uint32_t boots = 0;
+
+KVLog kvlog(EEPROM_ADDR_KVLOG, KVLOG_LEN);
+
+/* The fields of the configuration record.  New fields must be
+   appended to the end. */
+const ConfigField config_fields[] PROGMEM =
+{
+  CONFIG_FIELD(id),
+  CONFIG_FIELD(secret),
+  CONFIG_FIELD(verbose),
+  CONFIG_FIELD(deadband),
+  CONFIG_FIELD(heartbeat),
+};
+
+#define CONFIG_FIELDS (sizeof(config_fields) / sizeof(config_fields[0]))
+
+TxScheduler scheduler = TxScheduler(TX_INTERVAL, DEFAULT_HEARTBEAT * 1000L);
+
+/* The sensor values of the last transmission. */
+int32_t sent_values[MAX_SENSORS];
+int num_sent = 0;
+
+/* Does the bus have more than MAX_SENSORS devices?  This is reported
+   when it changes, not on every pass. */
+bool too_many_sensors = false;
+
 const char bannerstr[] PROGMEM = "\
 WeatherClient <http://www.iki.fi/mtr/HomeWeather/>\n\
 Copyright (c) 2011 Markku Rossi <mtr@iki.fi>\n\
@@ -84,23 +176,97 @@ Available commands are:\n\
   help          print this help\n\
   set VAR VAL   sets the EEPROM variable VAR to the value VAL.  Possible\n\
                 variables are:\n\
-                  `id', `secret', and `verbose'\n\
+                  `id', `secret', `verbose', `deadband',\n\
+                  and `heartbeat'\n\
   access-token  read OAuth access token from input\n\
   token-secret  read OAuth token secret from input\n\
   info          show current weather information\n";
 
 const char err_cmd_invalid_args[] PROGMEM = "Invalid amount of arguments\n";
 
+/* Read the legacy EEPROM layout.  The method returns false if the
+   EEPROM does not hold it.  The legacy client never writes the
+   `configured' byte but the configuration record that replaces the
+   layout starts with CONFIG_MAGIC there. */
+static bool
+read_legacy_config(void)
+{
+  uint8_t buf[2];
+
+  if (EEPROM.read(EEPROM_ADDR_CONFIGURED) == CONFIG_MAGIC)
+    return false;
+
+  GetPut::eeprom_read_data(id, sizeof(id), EEPROM_ADDR_ID);
+  GetPut::eeprom_read_data(secret, sizeof(secret), EEPROM_ADDR_SECRET);
+
+  verbose = EEPROM.read(EEPROM_ADDR_VERBOSE);
+
+  GetPut::eeprom_read_data(buf, sizeof(buf), EEPROM_ADDR_DEADBAND);
+  deadband = GetPut::get_16bit(buf);
+  if (deadband == 0xffff)
+    deadband = DEFAULT_DEADBAND;
+
+  GetPut::eeprom_read_data(buf, sizeof(buf), EEPROM_ADDR_HEARTBEAT);
+  heartbeat = GetPut::get_16bit(buf);
+  if (heartbeat == 0xffff)
+    heartbeat = DEFAULT_HEARTBEAT;
+
+  boots = EEPROM.read(EEPROM_ADDR_BOOTS);
+
+  return true;
+}
+
+/* Set the configuration of an unconfigured client: no ID and no
+   secret, as on an erased EEPROM, and the default schedule. */
+static void
+default_config(void)
+{
+  memset(id, 0xff, sizeof(id));
+  memset(secret, 0xff, sizeof(secret));
+  verbose = 0;
+  deadband = DEFAULT_DEADBAND;
+  heartbeat = DEFAULT_HEARTBEAT;
+}
+
+static void
+save_config(void)
+{
+  Config::store(EEPROM_ADDR_CONFIG, CONFIG_SLOT_LEN, CONFIG_VERSION,
+                config_fields, CONFIG_FIELDS);
+}
+
+static void
+set_schedule(void)
+{
+  scheduler.set_heartbeat(heartbeat * 1000L);
+}
+
+static void
+set_key(void)
+{
+  int i;
+
+  authenticate = false;
+  for (i = 0; i < sizeof(secret); i++)
+    if (secret[i] != 0xff)
+      authenticate = true;
+
+  if (authenticate)
+    Sha1.computeHmacState(secret, sizeof(secret), key_state);
+}
+
 void
 setup(void)
 {
-  int i;
+  uint8_t version;
 
   Serial.begin(9600);
   HomeWeather::print(bannerstr);
 
-  /* Start temperature sensors. */
+  /* Start temperature sensors.  The conversion is not waited in
+     requestTemperatures() so that we can transmit meanwhile. */
   sensors.begin();
+  sensors.setWaitForConversion(false);
 
   /* Start RF transmitter. */
   pinMode(RF_RX_PIN, INPUT);
@@ -108,14 +274,47 @@ setup(void)
 
   rf_serial.begin(2400);
 
-  msg_seqnum = 0;
+  /* Protect our packets with FEC.  The server decodes both coded and
+     uncoded packets. */
+  serial_packet.set_fec(true);
+
+  /* Read configuration parameters.  The legacy layout is migrated to
+     the configuration record on the first boot and older records are
+     upgraded to the current version.  Without a valid record or the
+     legacy layout we start unconfigured. */
+  version = Config::load(EEPROM_ADDR_CONFIG, CONFIG_SLOT_LEN, config_fields,
+                         CONFIG_FIELDS);
+  if (version == 0)
+    {
+      if (read_legacy_config())
+        {
+          save_config();
+        }
+      else
+        {
+          HomeWeather::println(PSTR("No configuration"));
+          default_config();
+        }
+    }
+  else if (version != CONFIG_VERSION)
+    {
+      save_config();
+    }
 
-  /* Read configuration parameters.*/
+  /* Start a new sequence number epoch.  On the first boot the count
+     continues from the legacy layout. */
+  kvlog.begin();
+  kvlog.get(KV_BOOTS, &boots);
+  boots++;
+  kvlog.set(KV_BOOTS, boots);
+  msg_seqnum = (boots & 0xff) << 24;
 
-  GetPut::eeprom_read_data(id, sizeof(id), EEPROM_ADDR_ID);
-  GetPut::eeprom_read_data(secret, sizeof(secret), EEPROM_ADDR_SECRET);
+  set_key();
+  set_schedule();
 
-  verbose = EEPROM.read(EEPROM_ADDR_VERBOSE);
+  /* Seed the transmit jitter so that clients powered up together do
+     not transmit in sync. */
+  randomSeed(GetPut::get_32bit(id + 4) ^ analogRead(0));
 
   HomeWeather::print_data(7,       PSTR("id"), id, sizeof(id));
   HomeWeather::print_data(3,   PSTR("secret"), secret, sizeof(secret));
@@ -130,127 +329,202 @@ setup(void)
 
   HomeWeather::print_label(2, PSTR("verbose"));
   Serial.println((int) verbose);
+
+  HomeWeather::print_label(1, PSTR("deadband"));
+  Serial.println(deadband);
+
+  HomeWeather::print_label(0, PSTR("heartbeat"));
+  Serial.println(heartbeat);
 }
 
-void
-process_command(void)
+static void
+cmd_help(int argc, char **argv)
 {
-  int argc;
-  char **argv = cmdline.get_arguments(&argc);
-  int i;
+  HomeWeather::print(usagestr);
+}
 
-  if (argc < 1)
-    return;
+static void
+cmd_set(int argc, char **argv)
+{
+  if (argc != 3)
+    {
+      HomeWeather::print(err_cmd_invalid_args);
+      return;
+    }
 
-  if (strcmp_P(argv[0], PSTR("help")) == 0)
+  if (strcmp_P(argv[1], PSTR("id")) == 0)
     {
-      HomeWeather::print(usagestr);
+      memset(id, 0, sizeof(id));
+      GetPut::hex_decode(argv[2], id, sizeof(id));
     }
-  else if (strcmp_P(argv[0], PSTR("set")) == 0)
+  else if (strcmp_P(argv[1], PSTR("secret")) == 0)
     {
-      if (argc != 3)
-        {
-          HomeWeather::print(err_cmd_invalid_args);
-          return;
-        }
-
-      if (strcmp_P(argv[1], PSTR("id")) == 0)
-        {
-          GetPut::eeprom_parse_data(argv[2], id, sizeof(id), EEPROM_ADDR_ID);
-        }
-      else if (strcmp_P(argv[1], PSTR("secret")) == 0)
-        {
-          GetPut::eeprom_parse_data(argv[2], secret, sizeof(secret),
-                                    EEPROM_ADDR_SECRET);
-        }
-      else if (strcmp_P(argv[1], PSTR("verbose")) == 0)
-        {
-          verbose = (uint8_t) atoi(argv[2]);
-          EEPROM.write(EEPROM_ADDR_VERBOSE, verbose);
-        }
-      else
-        {
-          HomeWeather::print(PSTR("Unknown variable `"));
-          Serial.print(argv[1]);
-          HomeWeather::println(PSTR("'"));
-        }
+      memset(secret, 0, sizeof(secret));
+      GetPut::hex_decode(argv[2], secret, sizeof(secret));
+      set_key();
     }
-  else if (strcmp_P(argv[0], PSTR("info")) == 0)
+  else if (strcmp_P(argv[1], PSTR("verbose")) == 0)
     {
+      verbose = (uint8_t) atoi(argv[2]);
     }
-  else if (strcmp_P(argv[0], PSTR("access-token")) == 0)
+  else if (strcmp_P(argv[1], PSTR("deadband")) == 0)
     {
-      HomeWeather::println(PSTR("Type Oauth access token followed by newline"));
-      for (i = 0; i < OAUTH_ITEM_MAX_LENGTH - 1; i++)
-        {
-          while (Serial.available() <= 0)
-            delay(100);
+      deadband = (uint16_t) atoi(argv[2]);
+    }
+  else if (strcmp_P(argv[1], PSTR("heartbeat")) == 0)
+    {
+      heartbeat = (uint16_t) atoi(argv[2]);
+      set_schedule();
+    }
+  else
+    {
+      HomeWeather::print(PSTR("Unknown variable `"));
+      Serial.print(argv[1]);
+      HomeWeather::println(PSTR("'"));
+      return;
+    }
 
-          uint8_t byte = Serial.read();
-          if (byte == '\r' || byte == '\n')
-            break;
+  save_config();
+}
 
-          EEPROM.write(EEPROM_ADDR_ACCESS_TOKEN + i, byte);
-        }
-      EEPROM.write(EEPROM_ADDR_ACCESS_TOKEN + i, 0);
+static void
+cmd_info(int argc, char **argv)
+{
+}
 
-      HomeWeather::print(PSTR("Read "));
-      Serial.print(i);
-      HomeWeather::println(PSTR(" bytes"));
-    }
-  else if (strcmp_P(argv[0], PSTR("token-secret")) == 0)
-    {
-      HomeWeather::println(PSTR("Type Oauth token secret followed by newline"));
-      for (i = 0; i < OAUTH_ITEM_MAX_LENGTH - 1; i++)
-        {
-          while (Serial.available() <= 0)
-            delay(100);
+static EEPROMWriter oauth_writer;
 
-          uint8_t byte = Serial.read();
-          if (byte == '\r' || byte == '\n')
-            break;
+static void
+oauth_item_read(void *context, size_t len)
+{
+  oauth_writer.end();
 
-          EEPROM.write(EEPROM_ADDR_TOKEN_SECRET + i, byte);
-        }
-      EEPROM.write(EEPROM_ADDR_TOKEN_SECRET + i, 0);
+  HomeWeather::print(PSTR("Read "));
+  Serial.print(len);
+  HomeWeather::println(PSTR(" bytes"));
+}
 
-      HomeWeather::print(PSTR("Read "));
-      Serial.print(i);
-      HomeWeather::println(PSTR(" bytes"));
-    }
-  else
+/* Read an OAuth item to the EEPROM address `eeprom_addr'.  The item
+   is streamed from the command line while the sketch keeps running. */
+static void
+read_oauth_item(const prog_char prompt[], int eeprom_addr)
+{
+  HomeWeather::println(prompt);
+
+  oauth_writer.begin(eeprom_addr, OAUTH_ITEM_MAX_LENGTH - 1);
+  cmdline.stream(&oauth_writer, false, oauth_item_read, 0);
+}
+
+static void
+cmd_access_token(int argc, char **argv)
+{
+  read_oauth_item(PSTR("Type Oauth access token followed by newline"),
+                  EEPROM_ADDR_ACCESS_TOKEN);
+}
+
+static void
+cmd_token_secret(int argc, char **argv)
+{
+  read_oauth_item(PSTR("Type Oauth token secret followed by newline"),
+                  EEPROM_ADDR_TOKEN_SECRET);
+}
+
+/* The command names and the commands by their name hash. */
+const static char cmd_help_name[] PROGMEM = "help";
+const static char cmd_set_name[] PROGMEM = "set";
+const static char cmd_info_name[] PROGMEM = "info";
+const static char cmd_access_token_name[] PROGMEM = "access-token";
+const static char cmd_token_secret_name[] PROGMEM = "token-secret";
+
+const static CommandLineCommand commands[] PROGMEM =
+{
+  COMMAND_LINE_COMMAND(0x5c94, cmd_help_name, cmd_help),
+  COMMAND_LINE_COMMAND(0x8f27, cmd_set_name, cmd_set),
+  COMMAND_LINE_COMMAND(0xb3eb, cmd_info_name, cmd_info),
+  COMMAND_LINE_COMMAND(0xa0d7, cmd_access_token_name, cmd_access_token),
+  COMMAND_LINE_COMMAND(0x1845, cmd_token_secret_name, cmd_token_secret),
+};
+
+#define NUM_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+void
+process_command(void)
+{
+  int argc;
+  char **argv = cmdline.get_arguments(&argc);
+  CommandLineHandler handler;
+  const prog_char *name;
+
+  if (argc < 1)
+    return;
+
+  handler = CommandLine::lookup(commands, NUM_COMMANDS, argv[0]);
+  if (handler == 0)
     {
       HomeWeather::print(PSTR("Unknown command `"));
       Serial.print(argv[0]);
       HomeWeather::println(PSTR("'"));
+
+      /* A command with a wrong hash is never found. */
+      name = CommandLine::check(commands, NUM_COMMANDS);
+      if (name)
+        {
+          HomeWeather::print(PSTR("Bad command table entry `"));
+          HomeWeather::print(name);
+          HomeWeather::println(PSTR("'"));
+        }
+      return;
     }
+
+  handler(argc, argv);
+}
+
+/* Keep transmitting the queued packet for `ms' milliseconds. */
+static void
+idle(unsigned long ms)
+{
+  unsigned long start = millis();
+
+  while (millis() - start < ms)
+    serial_packet.transmit(TX_CHUNK);
 }
 
 void
 loop(void)
 {
+  DeviceAddress addr[MAX_SENSORS];
+  int32_t values[MAX_SENSORS];
+  bool changed = false;
+  int count;
+  int i, n;
+
   if (cmdline.read())
     process_command();
 
   sensors.requestTemperatures();
+  idle(CONVERSION_TIME);
 
-  /* Construct message containing all sensor readings. */
-
-  DeviceAddress addr;
-  int count = sensors.getDeviceCount();
-  int i;
+  /* Read all sensors and check if any of them has changed more than
+     the deadband since our last transmission. */
 
-  serial_packet.clear();
+  count = sensors.getDeviceCount();
 
-  serial_packet.add_message(MSG_CLIENT_ID, id, sizeof(id));
-  serial_packet.add_message(MSG_SEQNUM, msg_seqnum++);
+  if ((count > MAX_SENSORS) != too_many_sensors)
+    {
+      too_many_sensors = !too_many_sensors;
+      if (too_many_sensors)
+        HomeWeather::println(PSTR("Too many sensors"));
+    }
 
-  for (i = 0; i < count; i++)
+  for (i = 0, n = 0; i < count; i++)
     {
-      if (!sensors.getAddress(addr, i))
+      if (n >= MAX_SENSORS)
+        break;
+
+      if (!sensors.getAddress(addr[n], i))
         continue;
 
-      float temp = sensors.getTempC(addr);
+      float temp = sensors.getTempC(addr[n]);
 
       if (temp == DEVICE_DISCONNECTED)
         continue;
@@ -263,11 +537,58 @@ loop(void)
           Serial.println(temp);
         }
 
-      serial_packet.add_message(MSG_SENSOR_ID, addr, sizeof(addr));
-      serial_packet.add_message(MSG_SENSOR_VALUE, (uint32_t) (temp * 100));
+      values[n] = (int32_t) (temp * 100);
+
+      if (n >= num_sent
+          || TxScheduler::exceeds(values[n], sent_values[n], deadband))
+        changed = true;
+
+      n++;
     }
 
-  serial_packet.send();
+  if (n != num_sent)
+    changed = true;
+
+  if (scheduler.should_send(changed))
+    {
+      if (rf_serial.available() > 0)
+        {
+          /* We have heard other traffic since our last round.  Drop
+             it and back off. */
+          while (rf_serial.available() > 0)
+            rf_serial.read();
+
+          scheduler.busy();
+        }
+      else
+        {
+          /* Construct message containing all sensor readings. */
+
+          serial_packet.clear();
+
+          serial_packet.add_message(MSG_CLIENT_ID, id, sizeof(id));
+          serial_packet.add_message(MSG_SEQNUM, msg_seqnum++);
+
+          for (i = 0; i < n; i++)
+            {
+              serial_packet.add_message(MSG_SENSOR_ID, addr[i],
+                                        sizeof(addr[i]));
+              serial_packet.add_message(MSG_SENSOR_VALUE,
+                                        (uint32_t) values[i]);
+            }
+
+          if (authenticate)
+            serial_packet.add_mac(MSG_MAC, key_state);
+
+          /* Queue the packet.  It is sent from idle() while we
+             sample the sensors on the next rounds. */
+          serial_packet.send();
+          scheduler.sent();
+
+          memcpy(sent_values, values, n * sizeof(values[0]));
+          num_sent = n;
+        }
+    }
 
-  delay(500);
+  idle(500);
 }
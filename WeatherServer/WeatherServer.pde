@@ -30,11 +30,16 @@
 #include <SoftwareSerial.h>
 #include <SerialPacket.h>
 #include <CommandLine.h>
+#include <Codec.h>
 #include <GetPut.h>
+#include <Config.h>
+#include <KVLog.h>
 #include <HomeWeather.h>
 #include <ClientInfo.h>
 #include <JSON.h>
+#include <JSONParser.h>
 #include <sha1.h>
+#include <Clock.h>
 
 /* RF pins. */
 #define RF_RX_PIN 2
@@ -46,9 +51,24 @@
 #define ID_LEN 8
 #define SECRET_LEN 8
 
+/* Accept only RF packets that carry a valid MAC.  The MAC key of
+   each client is derived from our secret and the client ID, see the
+   `client-secret' command.  A client without a secret sends its
+   packets without a MAC so enable this only after all clients have
+   their secrets set.  This is set with CLIENT_INFO_AUTH in
+   ClientInfo.h which also keeps the clients' key states. */
+#define RF_AUTH CLIENT_INFO_AUTH
+
 #define HTTP_SERVER_LEN 32
 
-/* EEPROM addresses. */
+/* The configuration area of two record slots and the current
+   version of the record.  The EEPROM map is in HomeWeather.h. */
+#define EEPROM_ADDR_CONFIG	HOMEWEATHER_EEPROM_CONFIG
+#define CONFIG_SLOT_LEN		HOMEWEATHER_EEPROM_CONFIG_SLOT_LEN
+#define CONFIG_VERSION		1
+
+/* The legacy EEPROM layout.  It is migrated to the configuration
+   record on the first boot. */
 #define EEPROM_ADDR_CONFIGURED	0
 #define EEPROM_ADDR_ID		(EEPROM_ADDR_CONFIGURED + 1)
 #define EEPROM_ADDR_SECRET	(EEPROM_ADDR_ID + ID_LEN)
@@ -66,15 +86,32 @@
 
 #define OAUTH_ITEM_MAX_LENGTH	128
 
-#define EEPROM_ADDR_ACCESS_TOKEN	256
-#define EEPROM_ADDR_TOKEN_SECRET	384
+/* The OAuth access token and token secret as legacy EEPROM strings.
+   This sketch does not post to Twitter so they are not converted to
+   a Twitter account record: the Twitter sketch creates its record
+   from these strings when it boots on a provisioned board. */
+#define EEPROM_ADDR_ACCESS_TOKEN	HOMEWEATHER_EEPROM_ACCESS_TOKEN
+#define EEPROM_ADDR_TOKEN_SECRET	HOMEWEATHER_EEPROM_TOKEN_SECRET
+
+/* The wear-levelled log of the frequently updated state. */
+#define EEPROM_ADDR_KVLOG	HOMEWEATHER_EEPROM_KVLOG
+#define KVLOG_LEN		HOMEWEATHER_EEPROM_KVLOG_LEN
 
-/* Next free EEPROM address is 512 which is the end of EEPROM on
-   ATmega168.  The ATmega328 has additional 512 bytes of EEPROM left
-   (total of 1kB). */
+/* The keys of the log. */
+#define KV_SEQNUM		0	/* The reserved message seqnums */
+#define KV_LAST_SYNC		1	/* The time of the last clock sync */
+#define KV_PACKET_LOSS		2	/* The total lost RF packets */
+
+/* The number of message sequence numbers reserved with one log
+   update.  At most this many numbers are skipped over a reboot. */
+#define SEQNUM_RESERVE 32
 
 SoftwareSerial rf_serial = SoftwareSerial(RF_RX_PIN, RF_TX_PIN);
-SerialPacket serial_packet = SerialPacket(&rf_serial);
+/* The server only receives RF packets so it has no transmit
+   buffers. */
+uint8_t rf_rx_buffer[SERIAL_PACKET_MAX_LEN];
+SerialPacket serial_packet = SerialPacket(&rf_serial, rf_rx_buffer,
+                                          sizeof(rf_rx_buffer), 0, 0);
 
 /* Setup a OneWire instance to communicate with any OneWire devices
    (not just Maxim/Dallas temperature ICs). */
@@ -90,6 +127,9 @@ uint8_t secret[SECRET_LEN];
 
 uint8_t verbose = 0;
 
+/* Is the device configured? */
+uint8_t configured = 0;
+
 /* Initial device configuration missing. */
 #define RUNLEVEL_CONFIG	0
 
@@ -124,15 +164,53 @@ uint8_t proxy_server[4];
 /* HTTP proxy server port number. */
 uint16_t proxy_port;
 
+/* The fields of the configuration record.  New fields must be
+   appended to the end. */
+const ConfigField config_fields[] PROGMEM =
+{
+  CONFIG_FIELD(configured),
+  CONFIG_FIELD(id),
+  CONFIG_FIELD(secret),
+  CONFIG_FIELD(verbose),
+  CONFIG_FIELD(mac),
+  CONFIG_FIELD(ip),
+  CONFIG_FIELD(gateway),
+  CONFIG_FIELD(subnet),
+  CONFIG_FIELD(http_server),
+  CONFIG_FIELD(http_port),
+  CONFIG_FIELD(proxy_server),
+  CONFIG_FIELD(proxy_port),
+};
+
+#define CONFIG_FIELDS (sizeof(config_fields) / sizeof(config_fields[0]))
+
 uint32_t msg_seqnum = 0;
-unsigned long basetime = 0;
+
+/* The sequence numbers below this are reserved in the log. */
+uint32_t seqnum_reserved = 0;
+
+/* The total number of lost RF packets. */
+uint32_t total_packetloss = 0;
+
+KVLog kvlog(EEPROM_ADDR_KVLOG, KVLOG_LEN);
+
+/* The UTC clock, synced from the data server's parameters.  The
+   parameters are fetched when the clock is due a sync. */
+Clock utc_clock;
+
+/* The UTC time of the data upload being encoded or 0 if the clock is
+   not set.  It is sampled once per upload so that all encoding passes
+   see the same time. */
+unsigned long upload_time = 0;
 
 #define MAX_CLIENTS 2
 
 ClientInfo clients[MAX_CLIENTS];
 
-char json_buffer[512];
-JSON json = JSON(json_buffer, sizeof(json_buffer));
+/* The buffer for HTTP response status and header lines.  The requests
+   are encoded directly to the connection and the response content is
+   streamed to a JSON parser. */
+char response_buffer[64];
 
 const prog_char bannerstr[] PROGMEM = "\
 WeatherServer <http://www.iki.fi/mtr/HomeWeather/>\n\
@@ -148,26 +226,24 @@ Available commands are:\n\
                   `mac', `ip', `gw', `subnet'\n\
   access-token  read OAuth access token from input\n\
   token-secret  read OAuth token secret from input\n\
+  client-secret ID\n\
+                print the RF secret of the client ID\n\
   info          show current weather information\n";
 
-void
-setup(void)
+/* Read the legacy EEPROM layout.  The method returns false if the
+   EEPROM does not hold it: the legacy `configured' flag is 0 or 1
+   but the configuration record that replaces the layout starts with
+   CONFIG_MAGIC, and an erased EEPROM reads 0xff. */
+static bool
+read_legacy_config(void)
 {
-  int i;
   uint8_t buf[2];
+  uint8_t flag = EEPROM.read(EEPROM_ADDR_CONFIGURED);
 
-  Serial.begin(9600);
-  HomeWeather::print(bannerstr);
+  if (flag != 0 && flag != 1)
+    return false;
 
-  /* Start temperature sensors. */
-  sensors.begin();
-
-  pinMode(RF_RX_PIN, INPUT);
-  pinMode(RF_TX_PIN, OUTPUT);
-
-  rf_serial.begin(2400);
-
-  /* Read configuration parameters. */
+  configured = flag;
 
   GetPut::eeprom_read_data(id, sizeof(id), EEPROM_ADDR_ID);
   GetPut::eeprom_read_data(secret, sizeof(secret), EEPROM_ADDR_SECRET);
@@ -192,6 +268,62 @@ setup(void)
   GetPut::eeprom_read_data(buf, sizeof(buf), EEPROM_ADDR_PROXY_PORT);
   proxy_port = GetPut::get_16bit(buf);
 
+  return true;
+}
+
+static void
+save_config(void)
+{
+  Config::store(EEPROM_ADDR_CONFIG, CONFIG_SLOT_LEN, CONFIG_VERSION,
+                config_fields, CONFIG_FIELDS);
+}
+
+static void
+parse_config(const char *val, uint8_t *buf, size_t buflen)
+{
+  memset(buf, 0, buflen);
+  GetPut::hex_decode(val, buf, buflen);
+}
+
+void
+setup(void)
+{
+  uint8_t version;
+  uint32_t last_sync;
+
+  Serial.begin(9600);
+  HomeWeather::print(bannerstr);
+
+  /* Start temperature sensors. */
+  sensors.begin();
+
+  pinMode(RF_RX_PIN, INPUT);
+  pinMode(RF_TX_PIN, OUTPUT);
+
+  rf_serial.begin(2400);
+
+  /* Read configuration parameters.  The legacy layout is migrated to
+     the configuration record on the first boot and older records are
+     upgraded to the current version.  Without a valid record or the
+     legacy layout we start unconfigured. */
+  version = Config::load(EEPROM_ADDR_CONFIG, CONFIG_SLOT_LEN, config_fields,
+                         CONFIG_FIELDS);
+  if (version == 0)
+    {
+      if (read_legacy_config())
+        save_config();
+      else
+        HomeWeather::println(PSTR("No configuration"));
+    }
+  else if (version != CONFIG_VERSION)
+    save_config();
+
+  /* Restore the state that survives reboots. */
+  kvlog.begin();
+  if (kvlog.get(KV_SEQNUM, &seqnum_reserved))
+    msg_seqnum = seqnum_reserved;
+  kvlog.get(KV_PACKET_LOSS, &total_packetloss);
+
   HomeWeather::print_data(12,      PSTR("id"), id, sizeof(id));
   HomeWeather::print_data(8,   PSTR("secret"), secret, sizeof(secret));
   HomeWeather::print_data(11,     PSTR("mac"), mac, sizeof(mac));
@@ -220,7 +352,19 @@ setup(void)
   HomeWeather::print_label(7, PSTR("verbose"));
   Serial.println((int) verbose);
 
-  if (EEPROM.read(EEPROM_ADDR_CONFIGURED) != 1)
+  HomeWeather::print_label(8, PSTR("seqnum"));
+  Serial.println(msg_seqnum);
+
+  if (kvlog.get(KV_LAST_SYNC, &last_sync))
+    {
+      HomeWeather::print_label(5, PSTR("last-sync"));
+      Serial.println(last_sync);
+    }
+
+  HomeWeather::print_label(3, PSTR("packet-loss"));
+  Serial.println(total_packetloss);
+
+  if (!configured)
     runlevel = RUNLEVEL_CONFIG;
   else
     runlevel = RUNLEVEL_DNS;
@@ -229,156 +373,203 @@ setup(void)
   Serial.println((int) runlevel);
 }
 
-void
-process_command(void)
+static void
+cmd_help(int argc, char **argv)
+{
+  HomeWeather::print(usagestr);
+}
+
+static void
+cmd_set(int argc, char **argv)
 {
-  int argc;
-  char **argv = cmdline.get_arguments(&argc);
   int i;
-  uint8_t buf[2];
 
-  if (argc < 1)
-    return;
+  if (argc != 3)
+    {
+      HomeWeather::println(PSTR("Invalid amount of arguments"));
+      return;
+    }
 
-  if (strcmp_P(argv[0], PSTR("help")) == 0)
+  if (strcmp_P(argv[1], PSTR("id")) == 0)
     {
-      HomeWeather::print(usagestr);
+      parse_config(argv[2], id, sizeof(id));
     }
-  else if (strcmp_P(argv[0], PSTR("set")) == 0)
+  else if (strcmp_P(argv[1], PSTR("secret")) == 0)
     {
-      if (argc != 3)
-        {
-          HomeWeather::println(PSTR("Invalid amount of arguments"));
-          return;
-        }
-
-      if (strcmp_P(argv[1], PSTR("id")) == 0)
-        {
-          GetPut::eeprom_parse_data(argv[2], id, sizeof(id), EEPROM_ADDR_ID);
-        }
-      else if (strcmp_P(argv[1], PSTR("secret")) == 0)
-        {
-          GetPut::eeprom_parse_data(argv[2], secret, sizeof(secret),
-                                    EEPROM_ADDR_SECRET);
-        }
-      else if (strcmp_P(argv[1], PSTR("verbose")) == 0)
-        {
-          verbose = (uint8_t) atoi(argv[2]);
-          EEPROM.write(EEPROM_ADDR_VERBOSE, verbose);
-        }
-      else if (strcmp_P(argv[1], PSTR("configured")) == 0)
-        {
-          int val = atoi(argv[2]);
-
-          if (val)
-            runlevel = RUNLEVEL_DNS;
-          else
-            runlevel = RUNLEVEL_CONFIG;
-
-          EEPROM.write(EEPROM_ADDR_CONFIGURED, val ? 1 : 0);
-        }
-      else if (strcmp_P(argv[1], PSTR("mac")) == 0)
-        {
-          GetPut::eeprom_parse_data(argv[2], mac, sizeof(mac), EEPROM_ADDR_MAC);
-        }
-      else if (strcmp_P(argv[1], PSTR("ip")) == 0)
-        {
-          GetPut::eeprom_parse_data(argv[2], ip, sizeof(ip), EEPROM_ADDR_IP);
-        }
-      else if (strcmp_P(argv[1], PSTR("gw")) == 0)
-        {
-          GetPut::eeprom_parse_data(argv[2], gateway, sizeof(gateway),
-                                    EEPROM_ADDR_GATEWAY);
-        }
-      else if (strcmp_P(argv[1], PSTR("subnet")) == 0)
-        {
-          GetPut::eeprom_parse_data(argv[2], subnet, sizeof(subnet),
-                                    EEPROM_ADDR_SUBNET);
-        }
-      else if (strcmp_P(argv[1], PSTR("http-server")) == 0)
-        {
-          for (i = 0; argv[2][i] && i < HTTP_SERVER_LEN - 1; i++)
-            http_server[i] = argv[2][i];
-          http_server[i] = '\0';
-
-          GetPut::eeprom_write_data(http_server, sizeof(http_server),
-                                    EEPROM_ADDR_HTTP_SERVER);
-        }
-      else if (strcmp_P(argv[1], PSTR("http-port")) == 0)
-        {
-          http_port = atoi(argv[2]);
-
-          GetPut::put_16bit(buf, http_port);
-          GetPut::eeprom_write_data(buf, sizeof(buf), EEPROM_ADDR_HTTP_PORT);
-        }
-      else if (strcmp_P(argv[1], PSTR("proxy-server")) == 0)
-        {
-          GetPut::eeprom_parse_data(argv[2], proxy_server, sizeof(proxy_server),
-                                    EEPROM_ADDR_PROXY_SERVER);
-        }
-      else if (strcmp_P(argv[1], PSTR("proxy-port")) == 0)
-        {
-          proxy_port = atoi(argv[2]);
+      parse_config(argv[2], secret, sizeof(secret));
+    }
+  else if (strcmp_P(argv[1], PSTR("verbose")) == 0)
+    {
+      verbose = (uint8_t) atoi(argv[2]);
+    }
+  else if (strcmp_P(argv[1], PSTR("configured")) == 0)
+    {
+      int val = atoi(argv[2]);
 
-          GetPut::put_16bit(buf, proxy_port);
-          GetPut::eeprom_write_data(buf, sizeof(buf), EEPROM_ADDR_PROXY_PORT);
-        }
+      if (val)
+        runlevel = RUNLEVEL_DNS;
       else
-        {
-          HomeWeather::print(PSTR("Unknown variable `"));
-          Serial.print(argv[1]);
-          HomeWeather::println(PSTR("'"));
-        }
+        runlevel = RUNLEVEL_CONFIG;
+
+      configured = val ? 1 : 0;
     }
-  else if (strcmp_P(argv[0], PSTR("info")) == 0)
+  else if (strcmp_P(argv[1], PSTR("mac")) == 0)
     {
+      parse_config(argv[2], mac, sizeof(mac));
     }
-  else if (strcmp_P(argv[0], PSTR("access-token")) == 0)
+  else if (strcmp_P(argv[1], PSTR("ip")) == 0)
     {
-      HomeWeather::println(PSTR("Type Oauth access token followed by newline"));
-      for (i = 0; i < OAUTH_ITEM_MAX_LENGTH - 1; i++)
-        {
-          while (Serial.available() <= 0)
-            delay(100);
+      parse_config(argv[2], ip, sizeof(ip));
+    }
+  else if (strcmp_P(argv[1], PSTR("gw")) == 0)
+    {
+      parse_config(argv[2], gateway, sizeof(gateway));
+    }
+  else if (strcmp_P(argv[1], PSTR("subnet")) == 0)
+    {
+      parse_config(argv[2], subnet, sizeof(subnet));
+    }
+  else if (strcmp_P(argv[1], PSTR("http-server")) == 0)
+    {
+      for (i = 0; argv[2][i] && i < HTTP_SERVER_LEN - 1; i++)
+        http_server[i] = argv[2][i];
+      http_server[i] = '\0';
+    }
+  else if (strcmp_P(argv[1], PSTR("http-port")) == 0)
+    {
+      http_port = atoi(argv[2]);
+    }
+  else if (strcmp_P(argv[1], PSTR("proxy-server")) == 0)
+    {
+      parse_config(argv[2], proxy_server, sizeof(proxy_server));
+    }
+  else if (strcmp_P(argv[1], PSTR("proxy-port")) == 0)
+    {
+      proxy_port = atoi(argv[2]);
+    }
+  else
+    {
+      HomeWeather::print(PSTR("Unknown variable `"));
+      Serial.print(argv[1]);
+      HomeWeather::println(PSTR("'"));
+      return;
+    }
 
-          uint8_t byte = Serial.read();
-          if (byte == '\r' || byte == '\n')
-            break;
+  save_config();
+}
 
-          EEPROM.write(EEPROM_ADDR_ACCESS_TOKEN + i, byte);
-        }
-      EEPROM.write(EEPROM_ADDR_ACCESS_TOKEN + i, 0);
+static void
+cmd_client_secret(int argc, char **argv)
+{
+  uint8_t client_id[ID_LEN];
+  uint8_t key[SECRET_LEN];
 
-      HomeWeather::print(PSTR("Read "));
-      Serial.print(i);
-      HomeWeather::println(PSTR(" bytes"));
-    }
-  else if (strcmp_P(argv[0], PSTR("token-secret")) == 0)
+  if (argc != 2
+      || GetPut::hex_decode(argv[1], client_id, sizeof(client_id))
+      != sizeof(client_id))
     {
-      HomeWeather::println(PSTR("Type Oauth token secret followed by newline"));
-      for (i = 0; i < OAUTH_ITEM_MAX_LENGTH - 1; i++)
-        {
-          while (Serial.available() <= 0)
-            delay(100);
+      HomeWeather::println(PSTR("Invalid client ID"));
+      return;
+    }
 
-          uint8_t byte = Serial.read();
-          if (byte == '\r' || byte == '\n')
-            break;
+  HomeWeather::client_secret(secret, sizeof(secret),
+                             client_id, sizeof(client_id),
+                             key, sizeof(key));
+  HomeWeather::print_data(0, PSTR("secret"), key, sizeof(key));
+}
 
-          EEPROM.write(EEPROM_ADDR_TOKEN_SECRET + i, byte);
-        }
-      EEPROM.write(EEPROM_ADDR_TOKEN_SECRET + i, 0);
+static void
+cmd_info(int argc, char **argv)
+{
+}
 
-      HomeWeather::print(PSTR("Read "));
-      Serial.print(i);
-      HomeWeather::println(PSTR(" bytes"));
-    }
-  else
+static EEPROMWriter oauth_writer;
+
+static void
+oauth_item_read(void *context, size_t len)
+{
+  oauth_writer.end();
+
+  HomeWeather::print(PSTR("Read "));
+  Serial.print(len);
+  HomeWeather::println(PSTR(" bytes"));
+}
+
+/* Read an OAuth item to the EEPROM address `eeprom_addr'.  The item
+   is streamed from the command line while the sketch keeps running. */
+static void
+read_oauth_item(const prog_char prompt[], int eeprom_addr)
+{
+  HomeWeather::println(prompt);
+
+  oauth_writer.begin(eeprom_addr, OAUTH_ITEM_MAX_LENGTH - 1);
+  cmdline.stream(&oauth_writer, false, oauth_item_read, 0);
+}
+
+static void
+cmd_access_token(int argc, char **argv)
+{
+  read_oauth_item(PSTR("Type Oauth access token followed by newline"),
+                  EEPROM_ADDR_ACCESS_TOKEN);
+}
+
+static void
+cmd_token_secret(int argc, char **argv)
+{
+  read_oauth_item(PSTR("Type Oauth token secret followed by newline"),
+                  EEPROM_ADDR_TOKEN_SECRET);
+}
+
+/* The command names and the commands by their name hash. */
+const static char cmd_help_name[] PROGMEM = "help";
+const static char cmd_set_name[] PROGMEM = "set";
+const static char cmd_client_secret_name[] PROGMEM = "client-secret";
+const static char cmd_info_name[] PROGMEM = "info";
+const static char cmd_access_token_name[] PROGMEM = "access-token";
+const static char cmd_token_secret_name[] PROGMEM = "token-secret";
+
+const static CommandLineCommand commands[] PROGMEM =
+{
+  COMMAND_LINE_COMMAND(0x5c94, cmd_help_name, cmd_help),
+  COMMAND_LINE_COMMAND(0x8f27, cmd_set_name, cmd_set),
+  COMMAND_LINE_COMMAND(0x12c7, cmd_client_secret_name, cmd_client_secret),
+  COMMAND_LINE_COMMAND(0xb3eb, cmd_info_name, cmd_info),
+  COMMAND_LINE_COMMAND(0xa0d7, cmd_access_token_name, cmd_access_token),
+  COMMAND_LINE_COMMAND(0x1845, cmd_token_secret_name, cmd_token_secret),
+};
+
+#define NUM_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+void
+process_command(void)
+{
+  int argc;
+  char **argv = cmdline.get_arguments(&argc);
+  CommandLineHandler handler;
+  const prog_char *name;
+
+  if (argc < 1)
+    return;
+
+  handler = CommandLine::lookup(commands, NUM_COMMANDS, argv[0]);
+  if (handler == 0)
     {
       HomeWeather::print(PSTR("Unknown command `"));
       Serial.print(argv[0]);
       HomeWeather::println(PSTR("'"));
+
+      /* A command with a wrong hash is never found. */
+      name = CommandLine::check(commands, NUM_COMMANDS);
+      if (name)
+        {
+          HomeWeather::print(PSTR("Bad command table entry `"));
+          HomeWeather::print(name);
+          HomeWeather::println(PSTR("'"));
+        }
+      return;
     }
+
+  handler(argc, argv);
 }
 
 static bool
@@ -420,23 +611,50 @@ read_line(Client *client, uint8_t *buffer, size_t buflen)
   return false;
 }
 
-/* Does a HTTP request with the server.  The argument `method'
-   specifies the HTTP method and `uri' the URI at the server.  The
-   argument `content_json' specifies the content JSON data.  The HTTP
-   status code is returned in `http_code_return' and the content data
-   is stored into `buffer', `buflen'.  The function returns true if
-   the HTTP operation was successful and false on error. */
+/* Send HTTP request `method', `uri' with the JSON content that the
+   function `content' encodes.  The content is encoded twice: first to
+   compute its length and HMAC, and then to the connection.  The
+   method returns the HTTP status code in `http_code_return' and
+   streams the JSON response content to `parser'.  If `parser' is 0,
+   the response content is discarded. */
 static bool
 http_json_request(const prog_char method[], const prog_char uri[],
-                  const char *content_json, int32_t *http_code_return,
-                  uint8_t *buffer, size_t buflen)
+                  void (*content)(JSON *json), int32_t *http_code_return,
+                  JSONParser *parser)
 {
   int i;
   char buf[8];
-  size_t pos;
+  uint8_t *buffer = (uint8_t *) response_buffer;
+  size_t buflen = sizeof(response_buffer);
+  bool result = true;
+  size_t content_length;
+  uint8_t digest[HASH_LENGTH];
 
+  /* Sizing pass. */
   Sha1.initHmac(secret, sizeof(secret));
-  Sha1.print(content_json);
+
+  JSON sizing(&Sha1);
+  content(&sizing);
+
+  content_length = sizing.length();
+  memcpy(digest, Sha1.resultHmac(), sizeof(digest));
+
+  if (sizing.error() != JSON_OK)
+    {
+      if (verbose)
+        {
+          HomeWeather::print(PSTR("Failed to encode request: error "));
+          Serial.println(sizing.error());
+        }
+      return false;
+    }
+
+  if (verbose > 1)
+    {
+      JSON debug(&Serial);
+      content(&debug);
+      HomeWeather::newline();
+    }
 
   uint8_t *server = proxy_server;
   uint16_t port = proxy_port;
@@ -467,7 +685,7 @@ http_json_request(const prog_char method[], const prog_char uri[],
   HomeWeather::println(&http_client, PSTR("Content-Type: application/json"));
 
   HomeWeather::print(&http_client, PSTR("Content-Length: "));
-  snprintf(buf, sizeof(buf), "%d", strlen(content_json));
+  snprintf(buf, sizeof(buf), "%u", (unsigned int) content_length);
   http_client.write(buf);
   HomeWeather::newline(&http_client);
 
@@ -479,18 +697,21 @@ http_json_request(const prog_char method[], const prog_char uri[],
 
   HomeWeather::print(&http_client, PSTR("Authorization: HMAC-SHA-1 "));
 
-  uint8_t *digest = Sha1.resultHmac();
-  for (i = 0; i < HASH_LENGTH; i++)
-    {
-      snprintf(buf, sizeof(buf), "%02x", digest[i]);
-      http_client.write(buf);
-    }
+  Codec::hex_print(&http_client, digest, HASH_LENGTH, true);
   HomeWeather::newline(&http_client);
 
   /* Header-body separator. */
   HomeWeather::newline(&http_client);
 
-  http_client.write(content_json);
+  JSON body(&http_client);
+  content(&body);
+
+  if (body.error() != JSON_OK)
+    {
+      /* The server rejects the truncated content. */
+      http_client.stop();
+      return false;
+    }
 
   /* Read response status line. */
   if (!read_line(&http_client, buffer, buflen))
@@ -506,7 +727,10 @@ http_json_request(const prog_char method[], const prog_char uri[],
     }
   else
     {
-      *http_code_return = atol((char *) buffer);
+      /* HTTP/1.1 200 OK */
+      for (i = 0; buffer[i] && buffer[i] != ' '; i++)
+        ;
+      *http_code_return = atol((char *) buffer + i);
 
       /* Read until we find the header-body separator. */
       while (true)
@@ -522,101 +746,94 @@ http_json_request(const prog_char method[], const prog_char uri[],
         }
     }
 
-  /* Collect content data to buffer. */
-  pos = 0;
-  while (http_client.connected())
+  if (parser)
     {
-      while (http_client.available() > 0)
+      parser->reset();
+      result = parser->parse(&http_client);
+    }
+  else
+    {
+      while (http_client.connected())
         {
-          uint8_t byte = http_client.read();
-
-          if (pos < buflen)
-            buffer[pos++] = byte;
+          while (http_client.available() > 0)
+            http_client.read();
+          delay(100);
         }
-      delay(100);
     }
 
   http_client.stop();
 
-  if (pos < buflen)
+  return result;
+}
+
+static void
+encode_id(JSON *json)
+{
+  json->add_object();
+  json->add(PSTR("id"), id, sizeof(id));
+  json->close();
+}
+
+/* The parameters of the params response. */
+struct ServerParams
+{
+  bool has_seqnum;
+  uint32_t seqnum;
+  bool has_time;
+  unsigned long time;
+};
+
+static void
+server_param(void *context, const char *path, uint8_t type, const char *value)
+{
+  ServerParams *params = (ServerParams *) context;
+
+  if (type != JSON_NUMBER)
+    return;
+
+  if (strcmp_P(path, PSTR("s")) == 0)
     {
-      buffer[pos] = '\0';
-      return true;
+      params->seqnum = strtoul(value, 0, 10);
+      params->has_seqnum = true;
+    }
+  else if (strcmp_P(path, PSTR("t")) == 0)
+    {
+      params->time = strtoul(value, 0, 10);
+      params->has_time = true;
     }
-
-  return false;
 }
 
 static bool
 get_parameters_from_server(void)
 {
-  char *json_data;
   int32_t code;
-  char *data;
-  char *end;
+  ServerParams params;
+  JSONParser parser(server_param, &params);
 
-  json.clear();
-  json.add_object();
+  memset(&params, 0, sizeof(params));
 
-  json.add(PSTR("id"), id, sizeof(id));
-
-  json_data = json.finish();
-  if (verbose > 1)
-    Serial.println(json_data);
-
-  if (!http_json_request(PSTR("GET"), PSTR("/data_api/params"), json_data,
-                         &code, (uint8_t *) json_buffer, sizeof(json_buffer))
+  if (!http_json_request(PSTR("GET"), PSTR("/data_api/params"), encode_id,
+                         &code, &parser)
       || code < 200 || code >= 300)
     {
-      HomeWeather::println("Failed to get parameters");
+      HomeWeather::println(PSTR("Failed to get parameters"));
+      utc_clock.sync_failed();
       return false;
     }
 
-  /* Parse response. */
-  data = json_buffer;
-  while (data[0])
-    {
-      switch (data[0])
-        {
-        case 's':
-          if (data[1] != ':')
-            return false;
-
-          data += 2;
-          msg_seqnum = strtoul(data, &end, 0);
-          if (end == data)
-            return false;
-
-          data = end;
-          break;
-
-        case 't':
-          if (data[1] != ':')
-            return false;
-
-          data += 2;
-          basetime = strtoul(data, &end, 0);
-          if (end == data)
-            return false;
+  if (params.has_seqnum)
+    msg_seqnum = params.seqnum;
 
-          data = end;
-
-          basetime -= millis() / 1000L;
-
-          /* Now basetime + millis() is approximately the current
-             time. */
-          break;
-
-        default:
-          if (isspace(data[0]))
-            data++;
-          else
-            return false;
-          break;
-        }
-
-      if (data[0] == ',')
-        data++;
+  /* The time is in seconds so the middle of the second is the best
+     estimate. */
+  if (params.has_time)
+    {
+      utc_clock.sync(params.time, 500);
+      kvlog.set(KV_LAST_SYNC, params.time);
+    }
+  else
+    {
+      utc_clock.sync_failed();
     }
 
   return true;
@@ -657,61 +874,100 @@ poll_rf_clients(void)
 {
   uint8_t *data;
   size_t data_len;
-  uint8_t msg_type;
-  uint8_t *msg_data;
-  size_t msg_len;
   uint32_t val;
   ClientInfo *client;
   SensorValue *sensor = 0;
+#if RF_AUTH
+  uint8_t key[SECRET_LEN];
+  uint8_t new_key_state[CLIENT_INFO_KEY_STATE_LEN];
+  const uint8_t *key_state;
+#endif /* RF_AUTH */
 
   data = serial_packet.receive(&data_len);
 
-  if (!SerialPacket::parse_message(&msg_type, &msg_data, &msg_len,
-                                   &data, &data_len)
-      || msg_type != MSG_CLIENT_ID)
+  SerialPacketIterator msg(data, data_len, MSG_VALUE_TYPES);
+
+  /* The packet must start with the client ID and sequence number. */
+  if (!msg.next() || msg.type != MSG_CLIENT_ID)
     {
       HomeWeather::println(PSTR("Malformed packet"));
       return;
     }
 
-  client = ClientInfo::lookup(clients, MAX_CLIENTS, msg_data, msg_len);
-  if (!client)
+  client = ClientInfo::find(clients, MAX_CLIENTS, msg.data, msg.len);
+
+#if RF_AUTH
+  /* Authenticate the packet before touching the client state.  The
+     key state of the known clients is cached in their client
+     info. */
+  if (client)
     {
-      HomeWeather::println(PSTR("Too many clients"));
+      key_state = client->key_state;
+    }
+  else
+    {
+      HomeWeather::client_secret(secret, sizeof(secret), msg.data, msg.len,
+                                 key, sizeof(key));
+      Sha1.computeHmacState(key, sizeof(key), new_key_state);
+      key_state = new_key_state;
+    }
+
+  if (!SerialPacket::verify_mac(data, data_len, MSG_MAC, key_state))
+    {
+      HomeWeather::println(PSTR("Invalid MAC"));
       return;
     }
+#endif /* RF_AUTH */
+
+  if (!client)
+    {
+      client = ClientInfo::lookup(clients, MAX_CLIENTS, msg.data, msg.len);
+      if (!client)
+        {
+          HomeWeather::println(PSTR("Too many clients"));
+          return;
+        }
+#if RF_AUTH
+      memcpy(client->key_state, new_key_state, sizeof(new_key_state));
+#endif /* RF_AUTH */
+    }
 
-  if (!SerialPacket::parse_message(&msg_type, &msg_data, &msg_len,
-                                   &data, &data_len)
-      || msg_type != MSG_SEQNUM
-      || msg_len != 4)
+  if (!msg.next() || msg.type != MSG_SEQNUM)
     {
       HomeWeather::println(PSTR("Malformed packet"));
       return;
     }
 
-  val = GetPut::get_32bit(msg_data);
+  val = msg.value();
+
+#if RF_AUTH
+  /* The MAC covers the sequence number so a packet with an old
+     sequence number is a replay.  The sequence numbers are compared
+     in serial number arithmetic so that the boot count in the high
+     byte can wrap around. */
+  if (client->last_seqnum != (uint32_t) -1
+      && (int32_t) (val - client->last_seqnum) <= 0)
+    {
+      HomeWeather::println(PSTR("Replayed packet"));
+      return;
+    }
+#endif /* RF_AUTH */
 
-  if (val > client->last_seqnum)
+  /* The high byte of the sequence number is the client's boot
+     count.  Packets are lost only within the same boot. */
+  if (val > client->last_seqnum && (val >> 24) == (client->last_seqnum >> 24))
     client->packetloss += val - client->last_seqnum - 1;
 
   client->last_seqnum = val;
   client->dirty = true;
 
   /* Process all info messages. */
-  while (data_len > 0)
+  while (msg.next())
     {
-      if (!SerialPacket::parse_message(&msg_type, &msg_data, &msg_len,
-                                       &data, &data_len))
-        {
-          HomeWeather::println(PSTR("Malformed packet"));
-          return;
-        }
-
-      switch (msg_type)
+      switch (msg.type)
         {
         case MSG_SENSOR_ID:
-          sensor = client->lookup(msg_data, msg_len);
+          sensor = client->lookup(msg.data, msg.len);
           if (!sensor)
             {
               HomeWeather::println(PSTR("Too many sensors"));
@@ -720,17 +976,23 @@ poll_rf_clients(void)
           break;
 
         case MSG_SENSOR_VALUE:
-          if (sensor == 0 || msg_len != 4)
+          if (sensor == 0)
             {
               HomeWeather::println(PSTR("Malformed packet"));
               return;
             }
 
-          sensor->value = (int32_t) GetPut::get_32bit(msg_data);
+          sensor->value = (int32_t) msg.value();
           sensor->dirty = true;
           sensor = 0;
           break;
 
+        case MSG_MAC:
+          /* Verified above with RF_AUTH.  Without it the MAC is
+             ignored unchecked: the clients with secrets keep sending
+             it. */
+          break;
+
         default:
           HomeWeather::println(PSTR("Malformed packet"));
           return;
@@ -781,24 +1043,32 @@ poll_local_sensors(void)
     }
 }
 
+/* The templates of the data upload document:
+   {"id":…,"sn":…,"t":…,"c":[{"id":…,"loss":…,"s":[{"id":…,"v":…}]}]}
+   The "t" field is the UTC time of the upload and it is omitted when
+   the clock is not set. */
+const prog_char upload_head[] PROGMEM = "{\"id\":\"%x\",\"sn\":%d";
+const prog_char upload_time_field[] PROGMEM = ",\"t\":%d";
+const prog_char upload_clients[] PROGMEM = ",\"c\":[";
+const prog_char upload_client[] PROGMEM = "%,{\"id\":\"%x\"";
+const prog_char upload_loss[] PROGMEM = ",\"loss\":%d";
+const prog_char upload_sensors[] PROGMEM = ",\"s\":[";
+const prog_char upload_sensor[] PROGMEM = "%,{\"id\":\"%x\",\"v\":%d}";
+const prog_char upload_end[] PROGMEM = "]}";
+
+/* Encode the modified client data.  The data is encoded more than
+   once per request so this must not modify the client state. */
 static void
-post_data_to_server(void)
+encode_client_data(JSON *json)
 {
   ClientInfo *client;
   SensorValue *sensor;
   int i, j;
-  char *json_data;
-  int32_t code;
-
-  /* Post data to server. */
-
-  json.clear();
-  json.add_object();
-
-  json.add(PSTR("id"), id, sizeof(id));
-  json.add(PSTR("sn"), msg_seqnum++);
 
-  json.add_array(PSTR("c"));
+  json->add_template(upload_head, id, (int) sizeof(id), (int32_t) msg_seqnum);
+  if (upload_time)
+    json->add_template(upload_time_field, (int32_t) upload_time);
+  json->add_template(upload_clients);
 
   for (i = 0; i < MAX_CLIENTS; i++)
     {
@@ -807,17 +1077,12 @@ post_data_to_server(void)
       if (client->id_len == 0 || !client->dirty)
         continue;
 
-      json.add_object();
-
-      json.add(PSTR("id"), client->id, client->id_len);
+      json->add_template(upload_client, client->id, (int) client->id_len);
 
       if (client->packetloss)
-        {
-          json.add(PSTR("loss"), client->packetloss);
-          client->packetloss = 0;
-        }
+        json->add_template(upload_loss, (int32_t) client->packetloss);
 
-      json.add_array(PSTR("s"));
+      json->add_template(upload_sensors);
 
       for (j = 0; j < CLIENT_INFO_MAX_SENSORS; j++)
         {
@@ -826,33 +1091,73 @@ post_data_to_server(void)
           if (sensor->id_len == 0 || !sensor->dirty)
             continue;
 
-          json.add_object();
+          json->add_template(upload_sensor, sensor->id, (int) sensor->id_len,
+                             sensor->value);
+        }
+
+      /* Finish sensors array and client object. */
+      json->add_template(upload_end);
+    }
 
-          json.add(PSTR("id"), sensor->id, sensor->id_len);
-          json.add(PSTR("v"), sensor->value);
+  /* Finish clients array and the document. */
+  json->add_template(upload_end);
 
-          json.pop();
+  json->close();
+}
 
-          sensor->dirty = false;
-        }
+static void
+post_data_to_server(void)
+{
+  ClientInfo *client;
+  uint32_t loss = 0;
+  int i, j;
+  int32_t code;
+  bool sent;
+
+  /* Reserve sequence numbers ahead so that they are not reused after
+     a reboot. */
+  if (msg_seqnum >= seqnum_reserved)
+    {
+      seqnum_reserved = msg_seqnum + SEQNUM_RESERVE;
+      kvlog.set(KV_SEQNUM, seqnum_reserved);
+    }
 
-      /* Finish sensors array. */
-      json.pop();
+  /* Post data to server. */
+  upload_time = utc_clock.now();
 
-      /* Finish client object. */
-      json.pop();
+  sent = (http_json_request(PSTR("POST"), PSTR("/data_api/add"),
+                            encode_client_data, &code, 0)
+          && code >= 200 && code < 300);
+  msg_seqnum++;
 
-      client->dirty = false;
+  if (!sent)
+    {
+      /* Keep the data dirty so it is sent again in the next round. */
+      HomeWeather::println(PSTR("Data sending failed"));
+      return;
     }
 
-  json_data = json.finish();
-  if (verbose > 1)
-    Serial.println(json_data);
+  /* The data was delivered. */
+  for (i = 0; i < MAX_CLIENTS; i++)
+    {
+      client = &clients[i];
 
-  if (!http_json_request(PSTR("POST"), PSTR("/data_api/add"), json_data,
-                         &code, (uint8_t *) json_buffer, sizeof(json_buffer))
-      || code < 200 || code >= 300)
-    HomeWeather::println(PSTR("Data sending failed"));
+      if (!client->dirty)
+        continue;
+
+      loss += client->packetloss;
+      client->packetloss = 0;
+      for (j = 0; j < CLIENT_INFO_MAX_SENSORS; j++)
+        client->sensors[j].dirty = false;
+
+      client->dirty = false;
+    }
+
+  if (loss)
+    {
+      total_packetloss += loss;
+      kvlog.set(KV_PACKET_LOSS, total_packetloss);
+    }
 }
 
 void
@@ -873,6 +1178,8 @@ loop(void)
 
     case RUNLEVEL_RUN:
       // poll_rf_clients();
+      if (utc_clock.sync_due())
+        get_parameters_from_server();
       poll_local_sensors();
       post_data_to_server();
       break;
@@ -66,6 +66,27 @@ ClientInfo::lookup(const uint8_t *id, size_t id_len)
   return value;
 }
 
+ClientInfo *
+ClientInfo::find(ClientInfo *clients, int num_clients,
+                 const uint8_t *id, size_t id_len)
+{
+  int i;
+  ClientInfo *client;
+
+  for (i = 0; i < num_clients; i++)
+    {
+      client = &clients[i];
+
+      if (client->id_len == 0)
+        break;
+
+      if (client->id_len == id_len && memcmp(client->id, id, id_len) == 0)
+        return client;
+    }
+
+  return 0;
+}
+
 ClientInfo *
 ClientInfo::lookup(ClientInfo *clients, int num_clients,
                    const uint8_t *id, size_t id_len)
@@ -34,6 +34,16 @@
 /* The maximum sensors per client. */
 #define CLIENT_INFO_MAX_SENSORS 4
 
+/* Keep the clients' HMAC key states for authenticating their RF
+   packets.  The library and the sketch must agree on this, so the
+   sketch takes its RF authentication switch from here. */
+#ifndef CLIENT_INFO_AUTH
+#define CLIENT_INFO_AUTH 0
+#endif
+
+/* The length of the client's precomputed HMAC key state. */
+#define CLIENT_INFO_KEY_STATE_LEN 40
+
 class SensorValue
 {
 public:
@@ -74,6 +84,11 @@ public:
   /* The number of packets lost. */
   uint32_t packetloss;
 
+#if CLIENT_INFO_AUTH
+  /* The precomputed HMAC key state for the client's packet MACs. */
+  uint8_t key_state[CLIENT_INFO_KEY_STATE_LEN];
+#endif /* CLIENT_INFO_AUTH */
+
   /* The sensor values of this client. */
   SensorValue sensors[CLIENT_INFO_MAX_SENSORS];
 
@@ -82,6 +97,12 @@ public:
      no more space for the sensor value in the client. */
   SensorValue *lookup(const uint8_t *id, size_t id_len);
 
+  /* Find the client `id', `id_len'.  The method returns the client
+     or 0 if no such client is defined in the `clients' array.  Unlike
+     lookup(), this does not allocate a new client. */
+  static ClientInfo *find(ClientInfo *clients, int num_clients,
+                          const uint8_t *id, size_t id_len);
+
   /* Look up the client `id', `id_len'.  The method returns the client
      of 0 if no such client is defined for and there are no more space
      for the clients new clients in the `clients' array. */
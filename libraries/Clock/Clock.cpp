@@ -0,0 +1,277 @@
+/*
+ * Clock.cpp
+ *
+ * Author: Markku Rossi <mtr@iki.fi>
+ *
+ * Copyright (c) 2012 Markku Rossi
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "Clock.h"
+
+/* Local milliseconds processed in one step in advance().  This keeps
+   the frequency correction within 32 bits. */
+#define CLOCK_CHUNK 32768UL
+
+Clock::Clock()
+  : sec(0),
+    msec(0),
+    last_millis(0),
+    ppm(0),
+    ppm_frac(0),
+    slew(0),
+    slew_frac(0),
+    last_sync(0),
+    interval(CLOCK_MIN_INTERVAL),
+    last_offset(0),
+    freq_start(0),
+    drift(0),
+    set(false),
+    retry(false)
+{
+}
+
+bool
+Clock::is_set(void)
+{
+  return set;
+}
+
+unsigned long
+Clock::now(void)
+{
+  uint16_t ms;
+
+  return now(&ms);
+}
+
+unsigned long
+Clock::now(uint16_t *msec_return)
+{
+  if (!set)
+    {
+      *msec_return = 0;
+      return 0;
+    }
+
+  update();
+
+  *msec_return = msec;
+  return sec;
+}
+
+void
+Clock::sync(unsigned long time, uint16_t msec)
+{
+  long diff;
+  long ofs;
+  long span;
+  long err;
+  bool step_needed;
+
+  if (!set)
+    {
+      reset(time, msec);
+      return;
+    }
+
+  update();
+
+  diff = (long) (time - sec);
+  if (diff > CLOCK_RESET_LIMIT || diff < -CLOCK_RESET_LIMIT)
+    {
+      /* The clock is way off or the reference changed. */
+      last_offset = diff < 0 ? -CLOCK_RESET_LIMIT * 1000 : CLOCK_RESET_LIMIT * 1000;
+      reset(time, msec);
+      return;
+    }
+
+  ofs = diff * 1000 + msec - this->msec;
+  last_offset = ofs;
+
+  /* The part of the offset that the pending slew does not explain is
+     the drift since the last sync. */
+  drift += ofs - slew;
+
+  step_needed = ofs > CLOCK_STEP_LIMIT || ofs < -CLOCK_STEP_LIMIT;
+
+  span = (long) (time - freq_start);
+  if (span >= CLOCK_FREQ_SPAN)
+    {
+      /* Drift in milliseconds per second is in 1/1000 and we correct
+         half of the measured error. */
+      err = ppm + drift * 1000L / span / 2;
+      if (err > CLOCK_MAX_PPM)
+        err = CLOCK_MAX_PPM;
+      else if (err < -CLOCK_MAX_PPM)
+        err = -CLOCK_MAX_PPM;
+
+      ppm = (int16_t) err;
+      freq_start = time;
+      drift = 0;
+    }
+  else if (step_needed)
+    {
+      /* A step sized offset over a short span is not a frequency
+         error: the reference changed or the one second resolution of
+         the reference and the round trip time produced it.  Restart
+         the frequency measurement after the step. */
+      freq_start = time;
+      drift = 0;
+    }
+
+  if (step_needed)
+    /* Too far off for slewing. */
+    step(time, msec);
+  else
+    slew = ofs;
+
+  if (ofs <= CLOCK_GOOD_OFFSET && ofs >= -CLOCK_GOOD_OFFSET)
+    {
+      if (interval < CLOCK_MAX_INTERVAL)
+        interval *= 2;
+    }
+  else if (interval > CLOCK_MIN_INTERVAL)
+    {
+      interval /= 2;
+    }
+
+  last_sync = millis();
+}
+
+bool
+Clock::sync_due(void)
+{
+  if (!set && !retry)
+    return true;
+
+  return millis() - last_sync >= interval * 1000;
+}
+
+void
+Clock::sync_failed(void)
+{
+  last_sync = millis() - (interval - CLOCK_MIN_INTERVAL) * 1000;
+  if (!set)
+    retry = true;
+}
+
+unsigned long
+Clock::sync_interval(void)
+{
+  return interval;
+}
+
+int16_t
+Clock::frequency(void)
+{
+  return ppm;
+}
+
+long
+Clock::offset(void)
+{
+  return last_offset;
+}
+
+void
+Clock::update(void)
+{
+  unsigned long now = millis();
+  unsigned long elapsed = now - last_millis;
+
+  last_millis = now;
+
+  while (elapsed > CLOCK_CHUNK)
+    {
+      advance(CLOCK_CHUNK);
+      elapsed -= CLOCK_CHUNK;
+    }
+  advance(elapsed);
+}
+
+void
+Clock::advance(unsigned long elapsed)
+{
+  long adj;
+  long slewed;
+  unsigned long ms;
+
+  /* Frequency correction.  The remainder is carried to the next
+     round so no fraction is lost. */
+  ppm_frac += (long) elapsed * ppm;
+  adj = ppm_frac / 1000000L;
+  ppm_frac -= adj * 1000000L;
+
+  if (slew)
+    {
+      slewed = (elapsed + slew_frac) >> CLOCK_SLEW_SHIFT;
+      slew_frac = (elapsed + slew_frac) & ((1 << CLOCK_SLEW_SHIFT) - 1);
+
+      if (slew > 0)
+        {
+          if (slewed > slew)
+            slewed = slew;
+        }
+      else
+        {
+          if (slewed > -slew)
+            slewed = -slew;
+          slewed = -slewed;
+        }
+
+      slew -= slewed;
+      adj += slewed;
+    }
+
+  if ((long) elapsed + adj < 0)
+    {
+      /* Never run backwards. */
+      slew += (long) elapsed + adj;
+      adj = -(long) elapsed;
+    }
+
+  ms = msec + elapsed + adj;
+  sec += ms / 1000;
+  msec = ms % 1000;
+}
+
+void
+Clock::step(unsigned long time, uint16_t msec)
+{
+  this->sec = time;
+  this->msec = msec;
+  last_millis = millis();
+
+  slew = 0;
+  slew_frac = 0;
+}
+
+void
+Clock::reset(unsigned long time, uint16_t msec)
+{
+  step(time, msec);
+
+  last_sync = last_millis;
+  interval = CLOCK_MIN_INTERVAL;
+
+  freq_start = time;
+  drift = 0;
+
+  set = true;
+}
@@ -0,0 +1,160 @@
+/* -*- c++ -*-
+ *
+ * Clock.h
+ *
+ * Author: Markku Rossi <mtr@iki.fi>
+ *
+ * Copyright (c) 2012 Markku Rossi
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+/* Offsets larger than this, in milliseconds, are corrected by
+   stepping the clock.  Smaller offsets are slewed. */
+#define CLOCK_STEP_LIMIT 2000L
+
+/* Offsets larger than this, in seconds, are not measured but the
+   clock is reset to the reference time. */
+#define CLOCK_RESET_LIMIT 60L
+
+/* The slew rate: at most 1/2^n of the elapsed time is added or
+   removed while slewing. */
+#define CLOCK_SLEW_SHIFT 5
+
+/* The maximum frequency correction in parts per million.  The
+   ceramic resonators of the Arduino boards are within 0.5%. */
+#define CLOCK_MAX_PPM 8000
+
+/* The minimum time span in seconds over which the frequency error is
+   measured.  The HTTP Date header has one second resolution so short
+   spans would give noisy estimates.  Offsets larger than
+   CLOCK_STEP_LIMIT over shorter spans step the clock and restart the
+   measurement. */
+#define CLOCK_FREQ_SPAN 1024L
+
+/* The sync intervals in seconds.  The interval doubles after each
+   sync that finds the clock within CLOCK_GOOD_OFFSET milliseconds,
+   and is halved otherwise. */
+#define CLOCK_MIN_INTERVAL 64L
+#define CLOCK_MAX_INTERVAL 16384L
+#define CLOCK_GOOD_OFFSET 1000L
+
+/* Disciplined UTC clock.  The clock runs from millis() and it is
+   synchronized to a reference time source with sync().  The clock
+   estimates the frequency error of the local oscillator between the
+   syncs and corrects it, and corrects small offsets by slewing so
+   that the time does not jump.  The clock must be read at least once
+   in 49 days so that millis() does not wrap around twice between the
+   reads. */
+class Clock
+{
+public:
+
+  Clock();
+
+  /* Tests if the clock has been synchronized. */
+  bool is_set(void);
+
+  /* Returns the current UTC Unix time in seconds or 0 if the clock
+     has not been set. */
+  unsigned long now(void);
+
+  /* Returns the current UTC Unix time in seconds and the
+     milliseconds of the second in `msec_return'. */
+  unsigned long now(uint16_t *msec_return);
+
+  /* Synchronize the clock to the reference time `time' seconds and
+     `msec' milliseconds. */
+  void sync(unsigned long time, uint16_t msec);
+
+  /* Tests if it is time to synchronize the clock. */
+  bool sync_due(void);
+
+  /* Notify the clock that a synchronization attempt failed.  The
+     next attempt is due after the minimum sync interval. */
+  void sync_failed(void);
+
+  /* The current sync interval in seconds. */
+  unsigned long sync_interval(void);
+
+  /* The current frequency correction in parts per million. */
+  int16_t frequency(void);
+
+  /* The clock offset in milliseconds measured at the last sync. */
+  long offset(void);
+
+private:
+
+  /* Advance the clock to the current millis(). */
+  void update(void);
+
+  /* Advance the clock by `elapsed' local milliseconds. */
+  void advance(unsigned long elapsed);
+
+  /* Step the clock to `time', `msec'. */
+  void step(unsigned long time, uint16_t msec);
+
+  /* Reset the clock to `time', `msec' and restart the frequency
+     measurement. */
+  void reset(unsigned long time, uint16_t msec);
+
+  /* The current time. */
+  unsigned long sec;
+  uint16_t msec;
+
+  /* The millis() of the current time. */
+  unsigned long last_millis;
+
+  /* The frequency correction and its fractional part in millionths
+     of milliseconds. */
+  int16_t ppm;
+  long ppm_frac;
+
+  /* The offset to slew in milliseconds and the elapsed time not yet
+     accounted to the slew rate. */
+  long slew;
+  uint8_t slew_frac;
+
+  /* The millis() of the last sync and the sync interval in
+     seconds. */
+  unsigned long last_sync;
+  unsigned long interval;
+
+  /* The offset measured at the last sync. */
+  long last_offset;
+
+  /* The start of the current frequency measurement and the drift
+     accumulated since. */
+  unsigned long freq_start;
+  long drift;
+
+  /* Has the clock been set? */
+  bool set;
+
+  /* Did a sync attempt fail before the clock was set? */
+  bool retry;
+};
+
+#endif /* not CLOCK_H */
@@ -0,0 +1,290 @@
+/*
+ * Codec.cpp
+ *
+ * Author: Markku Rossi <mtr@iki.fi>
+ *
+ * Copyright (c) 2012 Markku Rossi
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "Codec.h"
+
+const static char hex_upper[] PROGMEM = "0123456789ABCDEF";
+const static char hex_lower[] PROGMEM = "0123456789abcdef";
+
+const static char base64_table[] PROGMEM
+= "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+const static char base64url_table[] PROGMEM
+= "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+/* The values of the hex digits from `0' to `f', 0xff for invalid
+   characters. */
+#define HEX_FIRST '0'
+#define HEX_LAST 'f'
+
+const static uint8_t hex_values[] PROGMEM =
+{
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+  0x08, 0x09, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+};
+
+/* The values of the base64 and base64url characters from `+' to
+   `z', 0xff for invalid characters. */
+#define BASE64_FIRST '+'
+#define BASE64_LAST 'z'
+
+const static uint8_t base64_values[] PROGMEM =
+{
+  0x3e, 0xff, 0x3e, 0xff, 0x3f, 0x34, 0x35, 0x36,
+  0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x01,
+  0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09,
+  0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11,
+  0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19,
+  0xff, 0xff, 0xff, 0xff, 0x3f, 0xff, 0x1a, 0x1b,
+  0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23,
+  0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b,
+  0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33,
+};
+
+/* The size of the output blocks of the Print encoders. */
+#define CODEC_PRINT_BLOCK 16
+
+static inline uint8_t
+hex_value(char ch)
+{
+  if (ch < HEX_FIRST || ch > HEX_LAST)
+    return 0xff;
+
+  return pgm_read_byte(hex_values + (ch - HEX_FIRST));
+}
+
+static inline uint8_t
+base64_value(char ch)
+{
+  if (ch < BASE64_FIRST || ch > BASE64_LAST)
+    return 0xff;
+
+  return pgm_read_byte(base64_values + (ch - BASE64_FIRST));
+}
+
+char *
+Codec::hex_encode(char *buffer, const uint8_t *data, size_t data_len,
+                  bool lowercase)
+{
+  size_t i;
+
+  for (i = 0; i < data_len; i++)
+    buffer = hex_byte(buffer, data[i], lowercase);
+
+  *buffer = '\0';
+
+  return buffer;
+}
+
+char *
+Codec::hex_byte(char *buffer, uint8_t byte, bool lowercase)
+{
+  const prog_char *table = lowercase ? hex_lower : hex_upper;
+
+  *buffer++ = (char) pgm_read_byte(table + (byte >> 4));
+  *buffer++ = (char) pgm_read_byte(table + (byte & 0x0f));
+
+  return buffer;
+}
+
+void
+Codec::hex_print(Print *out, const uint8_t *data, size_t data_len,
+                 bool lowercase)
+{
+  char buf[CODEC_PRINT_BLOCK + 1];
+  size_t n;
+
+  while (data_len > 0)
+    {
+      n = data_len < CODEC_PRINT_BLOCK / 2 ? data_len : CODEC_PRINT_BLOCK / 2;
+
+      hex_encode(buf, data, n, lowercase);
+      out->write((const uint8_t *) buf, 2 * n);
+
+      data += n;
+      data_len -= n;
+    }
+}
+
+size_t
+Codec::hex_decode(const char *input, size_t input_len, uint8_t *buffer,
+                  size_t buffer_len)
+{
+  size_t pos = 0;
+  uint8_t hi, lo;
+
+  if (input_len % 2)
+    {
+      lo = hex_value(input[0]);
+      input++;
+      input_len--;
+
+      if (lo == 0xff || pos >= buffer_len)
+        return pos;
+
+      buffer[pos++] = lo;
+    }
+
+  for (; input_len >= 2; input += 2, input_len -= 2)
+    {
+      hi = hex_value(input[0]);
+      lo = hex_value(input[1]);
+
+      if (hi == 0xff || lo == 0xff || pos >= buffer_len)
+        break;
+
+      buffer[pos++] = (hi << 4) | lo;
+    }
+
+  return pos;
+}
+
+size_t
+Codec::base64_length(size_t data_len, bool url)
+{
+  if (url)
+    return (data_len * 4 + 2) / 3;
+
+  return (data_len + 2) / 3 * 4;
+}
+
+uint8_t
+Codec::base64_group(char *buffer, const uint8_t *data, uint8_t len, bool url)
+{
+  const prog_char *table = url ? base64url_table : base64_table;
+  unsigned long val;
+
+  val = (unsigned long) data[0] << 16;
+  if (len > 1)
+    val |= (unsigned int) data[1] << 8;
+  if (len > 2)
+    val |= data[2];
+
+  buffer[0] = (char) pgm_read_byte(table + (val >> 18));
+  buffer[1] = (char) pgm_read_byte(table + ((val >> 12) & 0x3f));
+  buffer[2] = (char) pgm_read_byte(table + ((val >> 6) & 0x3f));
+  buffer[3] = (char) pgm_read_byte(table + (val & 0x3f));
+
+  if (len == 3)
+    return 4;
+
+  if (url)
+    return len + 1;
+
+  /* Padding. */
+  buffer[3] = '=';
+  if (len == 1)
+    buffer[2] = '=';
+
+  return 4;
+}
+
+char *
+Codec::base64_encode(char *buffer, const uint8_t *data, size_t data_len,
+                     bool url)
+{
+  uint8_t n;
+
+  for (; data_len > 0; data += n, data_len -= n)
+    {
+      n = data_len < 3 ? data_len : 3;
+      buffer += base64_group(buffer, data, n, url);
+    }
+
+  *buffer = '\0';
+
+  return buffer;
+}
+
+void
+Codec::base64_print(Print *out, const uint8_t *data, size_t data_len,
+                    bool url)
+{
+  char buf[CODEC_PRINT_BLOCK];
+  size_t pos = 0;
+  uint8_t n;
+
+  for (; data_len > 0; data += n, data_len -= n)
+    {
+      n = data_len < 3 ? data_len : 3;
+      pos += base64_group(buf + pos, data, n, url);
+
+      if (pos + 4 > sizeof(buf))
+        {
+          out->write((const uint8_t *) buf, pos);
+          pos = 0;
+        }
+    }
+
+  if (pos > 0)
+    out->write((const uint8_t *) buf, pos);
+}
+
+size_t
+Codec::base64_decode(const char *input, size_t input_len, uint8_t *buffer,
+                     size_t buffer_len)
+{
+  size_t pos = 0;
+  unsigned long val = 0;
+  uint8_t count = 0;
+  uint8_t v;
+
+  for (; input_len > 0; input++, input_len--)
+    {
+      v = base64_value(*input);
+      if (v == 0xff)
+        break;
+
+      val = (val << 6) | v;
+      if (++count < 4)
+        continue;
+
+      if (pos + 3 > buffer_len)
+        return pos;
+
+      buffer[pos++] = val >> 16;
+      buffer[pos++] = val >> 8;
+      buffer[pos++] = val;
+
+      val = 0;
+      count = 0;
+    }
+
+  /* The final partial group: 2 characters encode 1 byte and 3
+     characters 2 bytes. */
+  if (count >= 2 && pos < buffer_len)
+    {
+      val <<= 6 * (4 - count);
+
+      buffer[pos++] = val >> 16;
+      if (count == 3 && pos < buffer_len)
+        buffer[pos++] = val >> 8;
+    }
+
+  return pos;
+}
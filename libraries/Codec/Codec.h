@@ -0,0 +1,100 @@
+/* -*- c++ -*-
+ *
+ * Codec.h
+ *
+ * Author: Markku Rossi <mtr@iki.fi>
+ *
+ * Copyright (c) 2012 Markku Rossi
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include <avr/pgmspace.h>
+
+/* Hex and base64 codecs.  The encoders write a null-terminated string
+   to a buffer or stream the encoding to a Print, e.g. a Client or
+   Sha1.  The decoders accept both letter cases for hex and both the
+   base64 and base64url alphabets. */
+class Codec
+{
+public:
+
+  /* Hex encode the data `data', `data_len' into the buffer `buffer'
+     that must have space for 2 * `data_len' + 1 bytes.  The method
+     returns a pointer to the null terminator. */
+  static char *hex_encode(char *buffer, const uint8_t *data, size_t data_len,
+                          bool lowercase = false);
+
+  /* Store the two hex digits of the byte `byte' into `buffer'.  The
+     digits are not null-terminated.  The method returns a pointer
+     past the digits. */
+  static char *hex_byte(char *buffer, uint8_t byte, bool lowercase = false);
+
+  /* Write the hex encoding of `data', `data_len' to `out'. */
+  static void hex_print(Print *out, const uint8_t *data, size_t data_len,
+                        bool lowercase = false);
+
+  /* Decode the hex string `input', `input_len' into the buffer
+     `buffer' that has space for `buffer_len' bytes.  If the input
+     has an odd number of digits, its first digit is a byte of its
+     own.  The method stops at the first invalid character and returns
+     the number of bytes stored into the buffer. */
+  static size_t hex_decode(const char *input, size_t input_len,
+                           uint8_t *buffer, size_t buffer_len);
+
+  /* The length of the base64 encoding of `data_len' bytes.  The
+     base64url encoding, `url' true, has no padding. */
+  static size_t base64_length(size_t data_len, bool url = false);
+
+  /* Base64 encode the data `data', `data_len' into the buffer
+     `buffer' that must have space for base64_length() + 1 bytes.  If
+     `url' is true, the method uses the URL safe alphabet and no
+     padding.  The method returns a pointer to the null
+     terminator. */
+  static char *base64_encode(char *buffer, const uint8_t *data,
+                             size_t data_len, bool url = false);
+
+  /* Write the base64 encoding of `data', `data_len' to `out'. */
+  static void base64_print(Print *out, const uint8_t *data, size_t data_len,
+                           bool url = false);
+
+  /* Decode the base64 or base64url string `input', `input_len' into
+     the buffer `buffer' that has space for `buffer_len' bytes.  The
+     padding is optional.  The method stops at the padding or at the
+     first invalid character and returns the number of bytes stored
+     into the buffer. */
+  static size_t base64_decode(const char *input, size_t input_len,
+                              uint8_t *buffer, size_t buffer_len);
+
+private:
+
+  /* Encode the group of 1-3 bytes `data', `len' into 4 base64
+     characters in `buffer'.  The method returns the number of
+     characters stored. */
+  static uint8_t base64_group(char *buffer, const uint8_t *data, uint8_t len,
+                              bool url);
+};
+
+#endif /* not CODEC_H */
@@ -0,0 +1,85 @@
+#include "Codec.h"
+
+/* RFC 4648 test vectors. */
+const char *vectors[] = {"", "f", "fo", "foo", "foob", "fooba", "foobar"};
+
+uint8_t data[64];
+uint8_t decoded[64];
+char encoded[129];
+
+void check(const char *label, bool ok) {
+  Serial.print(label);
+  Serial.println(ok ? " ok" : " FAILED");
+}
+
+void setup() {
+  unsigned long us;
+  size_t i, len;
+
+  Serial.begin(9600);
+
+  for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+    len = strlen(vectors[i]);
+    Codec::base64_encode(encoded, (const uint8_t *) vectors[i], len);
+    Serial.print(vectors[i]);
+    Serial.print(" -> ");
+    Serial.println(encoded);
+    Codec::hex_encode(encoded, (const uint8_t *) vectors[i], len, true);
+    Serial.print(vectors[i]);
+    Serial.print(" -> ");
+    Serial.println(encoded);
+  }
+
+  for (i = 0; i < sizeof(data); i++)
+    data[i] = i * 37 + 11;
+
+  // Round trips.
+  len = Codec::base64_encode(encoded, data, sizeof(data)) - encoded;
+  check("base64",
+        Codec::base64_decode(encoded, len, decoded, sizeof(decoded))
+        == sizeof(data) && memcmp(data, decoded, sizeof(data)) == 0);
+
+  len = Codec::base64_encode(encoded, data, sizeof(data), true) - encoded;
+  check("base64url",
+        Codec::base64_decode(encoded, len, decoded, sizeof(decoded))
+        == sizeof(data) && memcmp(data, decoded, sizeof(data)) == 0);
+
+  len = Codec::hex_encode(encoded, data, sizeof(data)) - encoded;
+  check("hex",
+        Codec::hex_decode(encoded, len, decoded, sizeof(decoded))
+        == sizeof(data) && memcmp(data, decoded, sizeof(data)) == 0);
+
+  // Timings for 1000 rounds of 64 bytes.
+  us = micros();
+  for (i = 0; i < 1000; i++)
+    Codec::base64_encode(encoded, data, sizeof(data));
+  Serial.print("base64 encode: ");
+  Serial.print((micros() - us) / 1000);
+  Serial.println(" us");
+
+  len = strlen(encoded);
+  us = micros();
+  for (i = 0; i < 1000; i++)
+    Codec::base64_decode(encoded, len, decoded, sizeof(decoded));
+  Serial.print("base64 decode: ");
+  Serial.print((micros() - us) / 1000);
+  Serial.println(" us");
+
+  us = micros();
+  for (i = 0; i < 1000; i++)
+    Codec::hex_encode(encoded, data, sizeof(data));
+  Serial.print("hex encode: ");
+  Serial.print((micros() - us) / 1000);
+  Serial.println(" us");
+
+  len = strlen(encoded);
+  us = micros();
+  for (i = 0; i < 1000; i++)
+    Codec::hex_decode(encoded, len, decoded, sizeof(decoded));
+  Serial.print("hex decode: ");
+  Serial.print((micros() - us) / 1000);
+  Serial.println(" us");
+}
+
+void loop() {
+}
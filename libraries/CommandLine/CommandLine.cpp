@@ -29,7 +29,8 @@
 
 CommandLine::CommandLine()
   : buffer_pos(0),
-    argc(0)
+    argc(0),
+    sink(0)
 {
 }
 
@@ -40,10 +41,31 @@ CommandLine::read(void)
     {
       uint8_t byte = Serial.read();
 
+      if (byte == '\r')
+        continue;
+
+      if (sink)
+        {
+          stream_input(byte);
+          continue;
+        }
+
       if (byte == '\n')
         {
           buffer[buffer_pos] = '\0';
-          return split_arguments();
+          if (split_arguments())
+            return true;
+
+          /* An empty line. */
+          buffer_pos = 0;
+          continue;
+        }
+
+      if (byte == '\b' || byte == 0x7f)
+        {
+          if (buffer_pos > 0)
+            buffer_pos--;
+          continue;
         }
 
       /* Reserver space for the trailing null-character. */
@@ -54,6 +76,25 @@ CommandLine::read(void)
   return false;
 }
 
+void
+CommandLine::stream(Print *sink, bool multi_line,
+                    CommandLineStreamCallback callback, void *context)
+{
+  this->sink = sink;
+  stream_callback = callback;
+  stream_context = context;
+  stream_multi_line = multi_line;
+  stream_len = 0;
+  stream_line_len = 0;
+  stream_newline = false;
+}
+
+bool
+CommandLine::streaming(void)
+{
+  return sink != 0;
+}
+
 char **
 CommandLine::get_arguments(int *argc_return)
 {
@@ -66,6 +107,92 @@ CommandLine::get_arguments(int *argc_return)
   return argv;
 }
 
+uint16_t
+CommandLine::hash(const char *name)
+{
+  uint16_t h = COMMAND_LINE_HASH_INIT;
+
+  for (; *name; name++)
+    h = COMMAND_LINE_HASH(h, *name);
+
+  return h;
+}
+
+CommandLineHandler
+CommandLine::lookup(const CommandLineCommand table[], uint8_t count,
+                    const char *name)
+{
+  CommandLineCommand command;
+  uint16_t h = hash(name);
+  size_t len = strlen(name);
+  uint8_t i;
+
+  for (i = 0; i < count; i++)
+    if (pgm_read_word(&table[i].hash) == h
+        && pgm_read_byte(&table[i].len) == len)
+      {
+        /* Different names may have the same hash. */
+        memcpy_P(&command, &table[i], sizeof(command));
+        if (strcmp_P(name, command.name) == 0)
+          return command.handler;
+      }
+
+  return 0;
+}
+
+const prog_char *
+CommandLine::check(const CommandLineCommand table[], uint8_t count)
+{
+  CommandLineCommand command;
+  uint16_t h;
+  uint8_t len;
+  uint8_t i;
+  char ch;
+
+  for (i = 0; i < count; i++)
+    {
+      memcpy_P(&command, &table[i], sizeof(command));
+
+      h = COMMAND_LINE_HASH_INIT;
+      for (len = 0; (ch = pgm_read_byte(command.name + len)) != '\0'; len++)
+        h = COMMAND_LINE_HASH(h, ch);
+
+      if (h != command.hash || len != command.len)
+        return command.name;
+    }
+
+  return 0;
+}
+
+void
+CommandLine::stream_input(uint8_t byte)
+{
+  if (byte != '\n')
+    {
+      if (stream_newline)
+        {
+          stream_len += sink->write('\n');
+          stream_newline = false;
+        }
+
+      stream_len += sink->write(byte);
+      stream_line_len++;
+      return;
+    }
+
+  if (stream_multi_line && stream_line_len > 0)
+    {
+      /* The stream continues unless the next line is empty. */
+      stream_newline = true;
+      stream_line_len = 0;
+      return;
+    }
+
+  /* End of stream.  The callback can start a new stream. */
+  sink = 0;
+  stream_callback(stream_context, stream_len);
+}
+
 bool
 CommandLine::split_arguments(void)
 {
@@ -31,8 +31,40 @@
 #include "WProgram.h"
 #endif
 
+#include <avr/pgmspace.h>
+
 #define COMMAND_LINE_MAX_ARGS 4
 
+/* The hash of a command name: djb2 with xor, 16 bits. */
+#define COMMAND_LINE_HASH_INIT	5381U
+#define COMMAND_LINE_HASH(h, ch) ((uint16_t) (((h) * 33U) ^ (uint8_t) (ch)))
+
+/* Handler of a command.  The arguments `argc', `argv' are the
+   arguments of the command line, `argv[0]' being the command name. */
+typedef void (*CommandLineHandler)(int argc, char **argv);
+
+/* An entry of a command table in the program memory.  The commands
+   are found by the hash and the length of their names and the hit is
+   confirmed with the name in the program memory.  The hashes are
+   computed with COMMAND_LINE_HASH, starting from
+   COMMAND_LINE_HASH_INIT. */
+struct CommandLineCommand
+{
+  uint16_t hash;
+  uint8_t len;
+  const prog_char *name;
+  CommandLineHandler handler;
+};
+
+/* Initializer for the command table entry of the command `name' with
+   the name hash `hash'.  The name must be a PROGMEM array. */
+#define COMMAND_LINE_COMMAND(hash, name, handler) \
+  {(hash), sizeof(name) - 1, (name), (handler)}
+
+/* Callback for the end of a streamed input.  The argument `len' is
+   the number of bytes that the sink accepted. */
+typedef void (*CommandLineStreamCallback)(void *context, size_t len);
+
 class CommandLine
 {
 public:
@@ -41,16 +73,53 @@ public:
   CommandLine();
 
   /* Read more command line input from serial line.  Return true if a
-     new line has been read and false otherwise. */
+     new line has been read and false otherwise.  The method does not
+     block.  A backspace or a delete character removes the previous
+     character of the line and carriage returns are ignored.  In the
+     stream mode the input is passed to the stream sink and the method
+     returns false. */
   bool read(void);
 
+  /* Pass the following input to the sink `sink' instead of parsing
+     it as commands.  The input is not buffered so it can be longer
+     than the command line buffer.  The stream ends at the end of the
+     line or, if `multi_line' is true, at an empty line; the newlines
+     between the lines are passed to the sink but the terminating ones
+     are not.  Carriage returns are ignored and the streamed input can
+     not be edited.  At the end of the stream the callback `callback'
+     is called with the context `context'. */
+  void stream(Print *sink, bool multi_line,
+              CommandLineStreamCallback callback, void *context);
+
+  /* Tests if the input is being streamed. */
+  bool streaming(void);
+
   /* Get the command line arguments of the latest command.  The method
      returns a pointer to the argument array.  The number of arguments
      is returned in `argc_return'. */
   char **get_arguments(int *argc_return);
 
+  /* Compute the hash of the command name `name'. */
+  static uint16_t hash(const char *name);
+
+  /* Find the command `name' from the table `table', `count' that is
+     in the program memory.  The method returns the command handler
+     or 0 if the command is unknown. */
+  static CommandLineHandler lookup(const CommandLineCommand table[],
+                                   uint8_t count, const char *name);
+
+  /* Check the hashes and the lengths of the table `table', `count'
+     against the command names.  The method returns the name of the
+     first wrong entry or 0 if the table is valid.  A wrong entry can
+     not be looked up so this is useful when a command is unknown. */
+  static const prog_char *check(const CommandLineCommand table[],
+                                uint8_t count);
+
 private:
 
+  /* Process the byte `byte' of the streamed input. */
+  void stream_input(uint8_t byte);
+
   /* Split the current command line into argument array.  Return true
      if the command was split and false on error or if the input line
      was empty. */
@@ -63,6 +132,19 @@ private:
   /* Parsed command line arguments. */
   uint8_t argc;
   char *argv[COMMAND_LINE_MAX_ARGS];
+
+  /* The stream sink or 0 if the input is parsed as commands. */
+  Print *sink;
+  CommandLineStreamCallback stream_callback;
+  void *stream_context;
+  bool stream_multi_line;
+
+  /* The number of bytes the sink accepted, the length of the current
+     line of the stream, and is the newline of the previous line
+     pending until the next line starts? */
+  size_t stream_len;
+  size_t stream_line_len;
+  bool stream_newline;
 };
 
 #endif /* not COMMANDLINE_H */
@@ -0,0 +1,163 @@
+/*
+ * Config.cpp
+ *
+ * Author: Markku Rossi <mtr@iki.fi>
+ *
+ * Copyright (c) 2012 Markku Rossi
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "Config.h"
+
+uint8_t
+Config::load(int address, size_t slot_len, const ConfigField fields[],
+             uint8_t count)
+{
+  uint8_t header[CONFIG_HEADER_LEN];
+  size_t data_len;
+  ConfigField field;
+  int8_t slot;
+  uint8_t i;
+
+  slot = newest(address, slot_len, header);
+  if (slot < 0)
+    return 0;
+
+  data_len = header[3];
+
+  /* Read the fields that the stored version has. */
+  address += slot * slot_len + CONFIG_HEADER_LEN;
+  for (i = 0; i < count; i++)
+    {
+      memcpy_P(&field, &fields[i], sizeof(field));
+      if (field.len > data_len)
+        break;
+
+      GetPut::eeprom_read_data((uint8_t *) field.data, field.len, address);
+      address += field.len;
+      data_len -= field.len;
+    }
+
+  return header[1];
+}
+
+bool
+Config::store(int address, size_t slot_len, uint8_t version,
+              const ConfigField fields[], uint8_t count)
+{
+  uint8_t buf[CONFIG_HEADER_LEN];
+  size_t data_len = data_length(fields, count);
+  uint16_t crc;
+  ConfigField field;
+  int8_t slot;
+  uint8_t i;
+
+  if (data_len > 0xff || CONFIG_LEN(data_len) > slot_len || version == 0)
+    return false;
+
+  /* Overwrite the slot that does not hold the newest record. */
+  slot = newest(address, slot_len, buf);
+  if (slot < 0)
+    {
+      slot = 1;
+      buf[2] = 0;
+    }
+  else
+    {
+      slot ^= 1;
+      buf[2]++;
+    }
+
+  address += slot * slot_len;
+
+  buf[0] = CONFIG_MAGIC;
+  buf[1] = version;
+  buf[3] = data_len;
+
+  /* The CRC is computed from the RAM copy so the EEPROM is not read
+     back. */
+  crc = GetPut::crc16(GETPUT_CRC16_INIT, buf, sizeof(buf));
+  GetPut::eeprom_write_data(buf, sizeof(buf), address);
+  address += sizeof(buf);
+
+  for (i = 0; i < count; i++)
+    {
+      memcpy_P(&field, &fields[i], sizeof(field));
+
+      crc = GetPut::crc16(crc, (uint8_t *) field.data, field.len);
+      GetPut::eeprom_write_data((uint8_t *) field.data, field.len, address);
+      address += field.len;
+    }
+
+  GetPut::put_16bit(buf, crc);
+  GetPut::eeprom_write_data(buf, 2, address);
+
+  return true;
+}
+
+bool
+Config::read_header(int address, size_t slot_len,
+                    uint8_t header[CONFIG_HEADER_LEN])
+{
+  uint8_t buf[2];
+  size_t data_len;
+
+  GetPut::eeprom_read_data(header, CONFIG_HEADER_LEN, address);
+  data_len = header[3];
+
+  if (header[0] != CONFIG_MAGIC || header[1] == 0
+      || CONFIG_LEN(data_len) > slot_len)
+    return false;
+
+  GetPut::eeprom_read_data(buf, 2, address + CONFIG_HEADER_LEN + data_len);
+
+  return (GetPut::eeprom_crc16(address, CONFIG_HEADER_LEN + data_len)
+          == GetPut::get_16bit(buf));
+}
+
+int8_t
+Config::newest(int address, size_t slot_len,
+               uint8_t header[CONFIG_HEADER_LEN])
+{
+  uint8_t other[CONFIG_HEADER_LEN];
+  bool valid0, valid1;
+
+  valid0 = read_header(address, slot_len, header);
+  valid1 = read_header(address + slot_len, slot_len, other);
+
+  /* The generation wraps around so the newer slot is the one that is
+     ahead of the other by less than half the range. */
+  if (valid1 && (!valid0 || (int8_t) (other[2] - header[2]) > 0))
+    {
+      memcpy(header, other, CONFIG_HEADER_LEN);
+      return 1;
+    }
+
+  return valid0 ? 0 : -1;
+}
+
+size_t
+Config::data_length(const ConfigField fields[], uint8_t count)
+{
+  size_t len = 0;
+  uint8_t i;
+
+  for (i = 0; i < count; i++)
+    len += pgm_read_byte(&fields[i].len);
+
+  return len;
+}
@@ -0,0 +1,111 @@
+/* -*- c++ -*-
+ *
+ * Config.h
+ *
+ * Author: Markku Rossi <mtr@iki.fi>
+ *
+ * Copyright (c) 2012 Markku Rossi
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include <avr/pgmspace.h>
+#include <GetPut.h>
+
+/* The EEPROM configuration record: magic, version, generation, the
+   length of the data, the data, and the CRC-16 of the preceding
+   bytes. */
+#define CONFIG_MAGIC		0xc5
+#define CONFIG_HEADER_LEN	4
+#define CONFIG_LEN(data_len)	(CONFIG_HEADER_LEN + (data_len) + 2)
+
+/* The EEPROM length of the configuration with `slot_len' byte
+   slots. */
+#define CONFIG_AREA_LEN(slot_len)	(2 * (slot_len))
+
+/* A field of the configuration record: a variable and its size. */
+struct ConfigField
+{
+  void *data;
+  uint8_t len;
+};
+
+/* Initializer for the ConfigField of the variable `var'. */
+#define CONFIG_FIELD(var) {(void *) &(var), sizeof(var)}
+
+/* Typed, versioned configuration record in EEPROM.  The record is
+   described with a table of ConfigField in the program memory.  The
+   record data is the concatenation of the fields in the table order.
+   A new version of the record may only append fields to the table:
+   when an older record is loaded, the appended fields keep their
+   current values so that the sketch can initialize them with
+   defaults before loading.
+
+   The configuration area holds two record slots of `slot_len' bytes.
+   A store writes the slot that does not hold the newest record, with
+   the next generation, and a load picks the newest valid record.  An
+   interrupted store so leaves the previous record in place. */
+class Config
+{
+public:
+
+  /* Load the newest record of the configuration area at the address
+     `address' into the `count' fields `fields'.  The whole record is
+     verified before any field is modified.  The method returns the
+     version of the stored record or 0 if neither slot holds a valid
+     record.  If the version is older than the current version, the
+     sketch should store the record to upgrade it. */
+  static uint8_t load(int address, size_t slot_len,
+                      const ConfigField fields[], uint8_t count);
+
+  /* Store the `count' fields `fields' as the version `version' of
+     the record in the configuration area at the address `address'.
+     Only the bytes that differ from the overwritten slot are written.
+     When neither slot is valid, the second slot is written first so
+     that data at the start of the area, such as a legacy layout,
+     survives an interrupted store.  The method returns false if the
+     fields do not fit into a slot. */
+  static bool store(int address, size_t slot_len, uint8_t version,
+                    const ConfigField fields[], uint8_t count);
+
+private:
+
+  /* Read the header of the record in the slot at the address
+     `address' into `header'.  The method returns false if the slot
+     does not hold a valid record. */
+  static bool read_header(int address, size_t slot_len,
+                          uint8_t header[CONFIG_HEADER_LEN]);
+
+  /* Find the slot of the newest valid record and read its header
+     into `header'.  The method returns the slot index or -1 if
+     neither slot holds a valid record. */
+  static int8_t newest(int address, size_t slot_len,
+                       uint8_t header[CONFIG_HEADER_LEN]);
+
+  /* The total length of the `count' fields `fields'. */
+  static size_t data_length(const ConfigField fields[], uint8_t count);
+};
+
+#endif /* not CONFIG_H */
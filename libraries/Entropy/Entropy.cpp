@@ -0,0 +1,136 @@
+/*
+ * Entropy.cpp
+ *
+ * Author: Markku Rossi <mtr@iki.fi>
+ *
+ * Copyright (c) 2012 Markku Rossi
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <avr/interrupt.h>
+#include <avr/wdt.h>
+#include "Entropy.h"
+
+/* The micros() time of the last watchdog timer interrupt and the
+   number of interrupts. */
+static volatile unsigned long wdt_time;
+static volatile uint8_t wdt_count;
+
+ISR(WDT_vect)
+{
+  wdt_time = micros();
+  wdt_count++;
+}
+
+void
+EntropyClass::begin(uint8_t analog_pin)
+{
+  uint8_t samples[ENTROPY_ADC_SAMPLES];
+  uint8_t i;
+
+  /* The lowest bits of an unconnected input carry the most noise. */
+  for (i = 0; i < sizeof(samples); i++)
+    samples[i] = analogRead(analog_pin);
+
+  add(samples, sizeof(samples));
+
+  add_wdt_jitter(ENTROPY_WDT_SAMPLES);
+}
+
+void
+EntropyClass::add(const uint8_t *data, size_t data_len)
+{
+  unsigned long now = micros();
+
+  Sha1.init();
+  Sha1.write(pool, sizeof(pool));
+  Sha1.write((const uint8_t *) &now, sizeof(now));
+  Sha1.write(data, data_len);
+
+  memcpy(pool, Sha1.result(), sizeof(pool));
+}
+
+void
+EntropyClass::generate(uint8_t *buffer, size_t len)
+{
+  unsigned long now = micros();
+  size_t n;
+
+  while (len > 0)
+    {
+      Sha1.init();
+      Sha1.write(pool, sizeof(pool));
+      Sha1.write((const uint8_t *) &counter, sizeof(counter));
+      Sha1.write((uint8_t) 0);
+
+      n = len < HASH_LENGTH ? len : HASH_LENGTH;
+      memcpy(buffer, Sha1.result(), n);
+
+      counter++;
+      buffer += n;
+      len -= n;
+    }
+
+  /* Re-key the pool.  This also mixes in the time of the request. */
+  Sha1.init();
+  Sha1.write(pool, sizeof(pool));
+  Sha1.write((const uint8_t *) &counter, sizeof(counter));
+  Sha1.write((uint8_t) 1);
+  Sha1.write((const uint8_t *) &now, sizeof(now));
+
+  memcpy(pool, Sha1.result(), sizeof(pool));
+}
+
+void
+EntropyClass::add_wdt_jitter(uint8_t count)
+{
+  unsigned long times[ENTROPY_WDT_SAMPLES];
+  uint8_t seen;
+  uint8_t i;
+
+  if (count > ENTROPY_WDT_SAMPLES)
+    count = ENTROPY_WDT_SAMPLES;
+
+  /* Enable the watchdog timer interrupt with the 16 ms period. */
+  cli();
+  wdt_reset();
+  MCUSR &= ~_BV(WDRF);
+  WDTCSR |= _BV(WDCE) | _BV(WDE);
+  WDTCSR = _BV(WDIE);
+  sei();
+
+  seen = wdt_count;
+  for (i = 0; i < count; i++)
+    {
+      while (wdt_count == seen)
+        ;
+      seen = wdt_count;
+      times[i] = wdt_time;
+    }
+
+  /* Disable the watchdog timer. */
+  cli();
+  wdt_reset();
+  MCUSR &= ~_BV(WDRF);
+  WDTCSR |= _BV(WDCE) | _BV(WDE);
+  WDTCSR = 0;
+  sei();
+
+  add((const uint8_t *) times, count * sizeof(times[0]));
+}
+
+EntropyClass Entropy;
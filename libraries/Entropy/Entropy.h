@@ -0,0 +1,80 @@
+/* -*- c++ -*-
+ *
+ * Entropy.h
+ *
+ * Author: Markku Rossi <mtr@iki.fi>
+ *
+ * Copyright (c) 2012 Markku Rossi
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ENTROPY_H
+#define ENTROPY_H
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include <sha1.h>
+
+/* The number of analog samples collected by begin(). */
+#define ENTROPY_ADC_SAMPLES 32
+
+/* The number of watchdog timer periods timed by begin(). */
+#define ENTROPY_WDT_SAMPLES 8
+
+/* Entropy pool and random byte generator.  The pool collects the
+   noise of an unconnected analog input, the jitter between the
+   watchdog timer oscillator and the system clock, and the micros()
+   timing of the calls.  The random bytes are generated from the pool
+   with SHA-1 in counter mode, and the pool is re-keyed after each
+   request so the earlier output can not be recovered from the pool.
+   The generator uses the global Sha1 instance so it must not be
+   called while a hash computation is in progress. */
+class EntropyClass
+{
+public:
+
+  /* Fill the pool from the analog input pin `analog_pin' that should
+     be left unconnected, and from the watchdog timer jitter.  This
+     takes about ENTROPY_WDT_SAMPLES * 16 milliseconds.  The watchdog
+     timer must not be used otherwise when this is called. */
+  void begin(uint8_t analog_pin);
+
+  /* Mix the data `data', `data_len' into the pool. */
+  void add(const uint8_t *data, size_t data_len);
+
+  /* Generate `len' random bytes into the buffer `buffer'. */
+  void generate(uint8_t *buffer, size_t len);
+
+private:
+
+  /* Mix `count' watchdog timer periods into the pool. */
+  void add_wdt_jitter(uint8_t count);
+
+  /* The pool key. */
+  uint8_t pool[HASH_LENGTH];
+
+  /* The counter of the generated blocks. */
+  uint32_t counter;
+};
+
+extern EntropyClass Entropy;
+
+#endif /* not ENTROPY_H */
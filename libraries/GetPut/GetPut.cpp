@@ -23,6 +23,8 @@
 
 #include "GetPut.h"
 #include <EEPROM.h>
+#include <avr/eeprom.h>
+#include <Codec.h>
 
 uint16_t
 GetPut::get_16bit(uint8_t *buf)
@@ -68,6 +70,22 @@ GetPut::put_32bit(uint8_t *buf, uint32_t val)
   buf[3] = (val >> 0) & 0xff;
 }
 
+uint16_t
+GetPut::crc16(uint16_t crc, const uint8_t *data, size_t data_len)
+{
+  size_t i;
+  uint8_t bit;
+
+  for (i = 0; i < data_len; i++)
+    {
+      crc ^= (uint16_t) data[i] << 8;
+      for (bit = 0; bit < 8; bit++)
+        crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+
+  return crc;
+}
+
 int
 GetPut::atoh(uint8_t ch)
 {
@@ -84,46 +102,10 @@ GetPut::atoh(uint8_t ch)
 size_t
 GetPut::hex_decode(const char *input, uint8_t *buffer, size_t buffer_len)
 {
-  int len;
-  int i;
-  int pos = 0;
-  int val, v;
-
   if (input[0] == '0' && input[1] == 'x')
     input += 2;
 
-  len = strlen(input);
-
-  if ((len % 2) == 0)
-    {
-      i = 0;
-    }
-  else
-    {
-      i = 1;
-
-      val = atoh(buffer[0]);
-      if (val < 0 || pos >= buffer_len)
-        return pos;
-
-      buffer[pos++] = (uint8_t) val;
-    }
-
-  for (; i < len; i += 2)
-    {
-      val = atoh(input[i]);
-      v = atoh(input[i + 1]);
-
-      if (val < 0 || v < 0 || pos >= buffer_len)
-        return pos;
-
-      val <<= 4;
-      val |= v;
-
-      buffer[pos++] = (uint8_t) val;
-    }
-
-  return pos;
+  return Codec::hex_decode(input, strlen(input), buffer, buffer_len);
 }
 
 void
@@ -138,19 +120,37 @@ GetPut::eeprom_parse_data(const char *val, uint8_t *buf, size_t buflen,
 void
 GetPut::eeprom_read_data(uint8_t *buf, size_t buflen, int eeprom_addr)
 {
-  int i;
-
-  for (i = 0; i < buflen; i++)
-    buf[i] = EEPROM.read(eeprom_addr + i);
+  eeprom_read_block(buf, (const void *) eeprom_addr, buflen);
 }
 
 void
 GetPut::eeprom_write_data(uint8_t *buf, size_t buflen, int eeprom_addr)
 {
-  int i;
+  size_t i;
 
+  /* An EEPROM write takes 3.3 ms and wears the cell; a read is
+     cheap. */
   for (i = 0; i < buflen; i++)
-    EEPROM.write(eeprom_addr + i, buf[i]);
+    if (eeprom_read_byte((const uint8_t *) eeprom_addr + i) != buf[i])
+      EEPROM.write(eeprom_addr + i, buf[i]);
+}
+
+uint16_t
+GetPut::eeprom_crc16(int eeprom_addr, size_t len)
+{
+  uint16_t crc = GETPUT_CRC16_INIT;
+  uint8_t buf[16];
+  size_t n;
+
+  for (; len > 0; eeprom_addr += n, len -= n)
+    {
+      n = len < sizeof(buf) ? len : sizeof(buf);
+
+      eeprom_read_data(buf, n, eeprom_addr);
+      crc = crc16(crc, buf, n);
+    }
+
+  return crc;
 }
 
 void
@@ -168,3 +168,39 @@ GetPut::eeprom_print_ascii(int eeprom_addr, int max_len)
       Serial.write(byte);
     }
 }
+
+EEPROMWriter::EEPROMWriter()
+  : address(0),
+    len(0),
+    max_len(0)
+{
+}
+
+void
+EEPROMWriter::begin(int eeprom_addr, size_t max_len)
+{
+  address = eeprom_addr;
+  len = 0;
+  this->max_len = max_len;
+}
+
+size_t
+EEPROMWriter::write(uint8_t byte)
+{
+  if (len >= max_len)
+    return 0;
+
+  GetPut::eeprom_write_data(&byte, 1, address + len++);
+
+  return 1;
+}
+
+size_t
+EEPROMWriter::end(void)
+{
+  uint8_t zero = 0;
+
+  GetPut::eeprom_write_data(&zero, 1, address + len);
+
+  return len;
+}
@@ -31,6 +31,9 @@
 #include "WProgram.h"
 #endif
 
+/* The initial value of a CRC-16 computation. */
+#define GETPUT_CRC16_INIT 0xffff
+
 class GetPut
 {
 public:
@@ -43,12 +46,17 @@ public:
 
   static void put_32bit(uint8_t *buf, uint32_t val);
 
+  /* Update the CRC-16-CCITT `crc' with the data `data', `data_len'.
+     The method returns the updated CRC.  Start the computation with
+     GETPUT_CRC16_INIT. */
+  static uint16_t crc16(uint16_t crc, const uint8_t *data, size_t data_len);
+
   /* Convert the hex character `ch' to its integer value. */
   static int atoh(uint8_t ch);
 
-  /* Decode hex string `input' into the buffer `buffer' that has space
-     for `buffer_len' bytes.  The method returns the number of bytes
-     stored into the output buffer. */
+  /* Decode hex string `input', with an optional `0x' prefix, into the
+     buffer `buffer' that has space for `buffer_len' bytes.  The method
+     returns the number of bytes stored into the output buffer. */
   static size_t hex_decode(const char *input, uint8_t *buffer,
                            size_t buffer_len);
 
@@ -61,13 +69,48 @@ public:
      the buffer `buf', `buflen'. */
   static void eeprom_read_data(uint8_t *buf, size_t buflen, int eeprom_addr);
 
-  /* Write data `buf', `buflen' to the EEPROM address
-     `eeprom_addr'. */
+  /* Write data `buf', `buflen' to the EEPROM address `eeprom_addr'.
+     Only the bytes that differ from the current EEPROM content are
+     written. */
   static void eeprom_write_data(uint8_t *buf, size_t buflen, int eeprom_addr);
 
+  /* Compute the CRC-16 of `len' bytes of EEPROM data starting from
+     address `eeprom_addr'. */
+  static uint16_t eeprom_crc16(int eeprom_addr, size_t len);
+
   /* Print ASCII data from EEPROM address `eeprom_addr'.  The argument
      `max_len' specifies the maximum length to print. */
   static void eeprom_print_ascii(int eeprom_addr, int max_len);
 };
 
+/* A sink that writes its output to consecutive EEPROM addresses.
+   Only the bytes that differ from the current EEPROM content are
+   written. */
+class EEPROMWriter : public Print
+{
+public:
+
+  EEPROMWriter();
+
+  /* Start writing a null-terminated string of at most `max_len'
+     bytes to the EEPROM address `eeprom_addr'.  The string takes
+     `max_len' + 1 bytes of EEPROM. */
+  void begin(int eeprom_addr, size_t max_len);
+
+  /* Write the byte `byte'.  The method returns 0 if the string is
+     full. */
+  virtual size_t write(uint8_t byte);
+  using Print::write;
+
+  /* Write the null terminator of the string.  The method returns the
+     length of the string. */
+  size_t end(void);
+
+private:
+
+  int address;
+  size_t len;
+  size_t max_len;
+};
+
 #endif /* not GETPUT_H */
@@ -22,6 +22,8 @@
  */
 
 #include "HomeWeather.h"
+#include <sha1.h>
+#include <Codec.h>
 
 void
 HomeWeather::print_label(int indent, const prog_char label[])
@@ -39,12 +41,8 @@ void
 HomeWeather::print_data(int indent, const prog_char label[],
                         uint8_t *data, size_t datalen)
 {
-  int i;
-
   print_label(indent, label);
-
-  for (i = 0; i < datalen; i++)
-    Serial.print(data[i], HEX);
+  Codec::hex_print(&Serial, data, datalen);
 
   newline();
 }
@@ -120,3 +118,13 @@ HomeWeather::newline(Client *client)
   client->write('\r');
   client->write('\n');
 }
+
+void
+HomeWeather::client_secret(const uint8_t *secret, size_t secret_len,
+                           const uint8_t *id, size_t id_len,
+                           uint8_t *key, size_t key_len)
+{
+  Sha1.initHmac(secret, secret_len);
+  Sha1.write(id, id_len);
+  memcpy(key, Sha1.resultHmac(), key_len);
+}
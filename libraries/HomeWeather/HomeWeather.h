@@ -35,6 +35,31 @@
 #define MSG_SEQNUM		1
 #define MSG_SENSOR_ID		2
 #define MSG_SENSOR_VALUE	3
+#define MSG_MAC			4
+
+/* The message types that carry 32-bit values. */
+#define MSG_VALUE_TYPES	((1UL << MSG_SEQNUM) | (1UL << MSG_SENSOR_VALUE))
+
+/* The EEPROM map shared by the sketches.  A board provisioned by one
+   sketch may run another so the areas must not overlap:
+
+     0-255     the configuration record slots (Config)
+     256-383   the legacy OAuth access token string
+     384-511   the legacy OAuth token secret string
+     512-639   the Twitter account record
+     640-895   the wear-levelled key/value log (KVLog)
+
+   The legacy configuration layouts start at 0 and are migrated to the
+   configuration record.  The areas above 511 need the ATmega328: the
+   EEPROM of the ATmega168 ends at 512. */
+#define HOMEWEATHER_EEPROM_CONFIG		0
+#define HOMEWEATHER_EEPROM_CONFIG_SLOT_LEN	128
+#define HOMEWEATHER_EEPROM_ACCESS_TOKEN		256
+#define HOMEWEATHER_EEPROM_TOKEN_SECRET		384
+#define HOMEWEATHER_EEPROM_ACCOUNT		512
+#define HOMEWEATHER_EEPROM_ACCOUNT_LEN		128
+#define HOMEWEATHER_EEPROM_KVLOG		640
+#define HOMEWEATHER_EEPROM_KVLOG_LEN		256
 
 class HomeWeather
 {
@@ -64,4 +89,11 @@ public:
   static void newline(void);
 
   static void newline(Client *client);
+
+  /* Derive the RF link secret of the client `id', `id_len' from the
+     server secret `secret', `secret_len'.  The client secret is the
+     HMAC-SHA-1 of the client ID, truncated to `key_len' bytes. */
+  static void client_secret(const uint8_t *secret, size_t secret_len,
+                            const uint8_t *id, size_t id_len,
+                            uint8_t *key, size_t key_len);
 };
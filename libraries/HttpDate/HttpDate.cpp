@@ -0,0 +1,300 @@
+/*
+ * HttpDate.cpp
+ *
+ * Author: Markku Rossi <mtr@iki.fi>
+ *
+ * Copyright (c) 2012 Markku Rossi
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "HttpDate.h"
+
+/* Header stream states. */
+#define HTTP_DATE_LINE_START	0
+#define HTTP_DATE_NAME		1
+#define HTTP_DATE_VALUE		2
+#define HTTP_DATE_SKIP		3
+#define HTTP_DATE_END		4
+
+/* Pack the lowercase letters `a', `b', `c' into 15 bits. */
+#define HTTP_DATE_PACK(a, b, c) \
+  ((((a) - 'a') << 10) | (((b) - 'a') << 5) | ((c) - 'a'))
+
+const static uint16_t month_hashes[] PROGMEM =
+  {
+    HTTP_DATE_PACK('j', 'a', 'n'), HTTP_DATE_PACK('f', 'e', 'b'),
+    HTTP_DATE_PACK('m', 'a', 'r'), HTTP_DATE_PACK('a', 'p', 'r'),
+    HTTP_DATE_PACK('m', 'a', 'y'), HTTP_DATE_PACK('j', 'u', 'n'),
+    HTTP_DATE_PACK('j', 'u', 'l'), HTTP_DATE_PACK('a', 'u', 'g'),
+    HTTP_DATE_PACK('s', 'e', 'p'), HTTP_DATE_PACK('o', 'c', 't'),
+    HTTP_DATE_PACK('n', 'o', 'v'), HTTP_DATE_PACK('d', 'e', 'c'),
+  };
+
+const static char date_header[] PROGMEM = "date:";
+
+HttpDate::HttpDate()
+  : result(0)
+{
+  reset();
+}
+
+void
+HttpDate::reset(void)
+{
+  state = HTTP_DATE_LINE_START;
+  name_pos = 0;
+}
+
+bool
+HttpDate::input(char ch)
+{
+  char expected;
+
+  if (ch == '\r')
+    return false;
+
+  if (ch == '\n')
+    {
+      switch (state)
+        {
+        case HTTP_DATE_LINE_START:
+          state = HTTP_DATE_END;
+          return false;
+
+        case HTTP_DATE_VALUE:
+          state = HTTP_DATE_LINE_START;
+          name_pos = 0;
+          result = value_end();
+          return result != 0;
+
+        case HTTP_DATE_END:
+          return false;
+
+        default:
+          state = HTTP_DATE_LINE_START;
+          name_pos = 0;
+          return false;
+        }
+    }
+
+  switch (state)
+    {
+    case HTTP_DATE_LINE_START:
+    case HTTP_DATE_NAME:
+      state = HTTP_DATE_NAME;
+
+      expected = pgm_read_byte(date_header + name_pos);
+      if (('A' <= ch && ch <= 'Z' ? ch + 'a' - 'A' : ch) != expected)
+        {
+          state = HTTP_DATE_SKIP;
+        }
+      else if (expected == ':')
+        {
+          state = HTTP_DATE_VALUE;
+          value_start();
+        }
+      else
+        {
+          name_pos++;
+        }
+      break;
+
+    case HTTP_DATE_VALUE:
+      value_input(ch);
+      break;
+
+    default:
+      break;
+    }
+
+  return false;
+}
+
+bool
+HttpDate::end_of_headers(void)
+{
+  return state == HTTP_DATE_END;
+}
+
+unsigned long
+HttpDate::time(void)
+{
+  return result;
+}
+
+unsigned long
+HttpDate::parse(const char *date, size_t date_len)
+{
+  HttpDate parser;
+  size_t i;
+
+  parser.value_start();
+
+  for (i = 0; i < date_len; i++)
+    parser.value_input(date[i]);
+
+  return parser.value_end();
+}
+
+void
+HttpDate::value_start(void)
+{
+  day = 0;
+  month = 0;
+  year = 0;
+  num_hms = 0;
+
+  token = 0;
+  token_len = 0;
+  token_word = false;
+
+  prev_delim = ' ';
+  error = false;
+}
+
+void
+HttpDate::value_input(char ch)
+{
+  if (error)
+    return;
+
+  if ('0' <= ch && ch <= '9')
+    {
+      if (token_word || token_len >= 4)
+        error = true;
+      else
+        token = token * 10 + ch - '0';
+      token_len++;
+    }
+  else if (('a' <= ch && ch <= 'z') || ('A' <= ch && ch <= 'Z'))
+    {
+      if (token_len > 0 && !token_word)
+        {
+          error = true;
+        }
+      else
+        {
+          /* Only the first three letters are significant. */
+          token_word = true;
+          if (token_len < 3)
+            token = (token << 5) | ((ch | 0x20) - 'a');
+          token_len++;
+        }
+    }
+  else if (ch == ' ' || ch == '\t' || ch == ',' || ch == '-' || ch == ':')
+    {
+      token_end(ch);
+    }
+  else
+    {
+      error = true;
+    }
+}
+
+void
+HttpDate::token_end(char delim)
+{
+  uint8_t i;
+
+  if (token_len == 0)
+    {
+      /* Repeated delimiters, e.g. the padding of asctime days. */
+      if (delim != ' ' && delim != '\t')
+        prev_delim = delim;
+      return;
+    }
+
+  if (token_word)
+    {
+      if (token_len == 3)
+        for (i = 0; i < 12; i++)
+          if (pgm_read_word(month_hashes + i) == token)
+            {
+              if (month)
+                error = true;
+              month = i + 1;
+              break;
+            }
+
+      /* Week days and the time zone are ignored. */
+    }
+  else if (delim == ':' || prev_delim == ':')
+    {
+      if (num_hms >= 3 || token_len > 2)
+        error = true;
+      else
+        hms[num_hms++] = token;
+    }
+  else if (day == 0)
+    {
+      if (token_len > 2 || token == 0)
+        error = true;
+      day = token;
+    }
+  else if (year == 0)
+    {
+      if (token_len == 2)
+        /* RFC 850 two digit year. */
+        year = token + (token < 70 ? 2000 : 1900);
+      else if (token_len == 4)
+        year = token;
+      else
+        error = true;
+    }
+  else
+    {
+      error = true;
+    }
+
+  token = 0;
+  token_len = 0;
+  token_word = false;
+  prev_delim = delim;
+}
+
+unsigned long
+HttpDate::value_end(void)
+{
+  tmElements_t tm;
+
+  token_end(' ');
+
+  if (error || month == 0 || day == 0 || num_hms != 3
+      || year < 1970 || year > 2105
+      || hms[0] > 23 || hms[1] > 59 || hms[2] > 60)
+    return 0;
+
+  if (day > 28)
+    {
+      int y;
+
+      /* Reject days past the end of the month. */
+      civilFromDays(daysFromCivil(year, month, day), y, tm.Month, tm.Day);
+      if (tm.Day != day)
+        return 0;
+    }
+
+  tm.Year = CalendarYrToTm(year);
+  tm.Month = month;
+  tm.Day = day;
+  tm.Hour = hms[0];
+  tm.Minute = hms[1];
+  tm.Second = hms[2];
+
+  return makeTime(tm);
+}
@@ -0,0 +1,119 @@
+/* -*- c++ -*-
+ *
+ * HttpDate.h
+ *
+ * Author: Markku Rossi <mtr@iki.fi>
+ *
+ * Copyright (c) 2012 Markku Rossi
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef HTTPDATE_H
+#define HTTPDATE_H
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include <avr/pgmspace.h>
+#include <Time.h>
+
+/* Single pass HTTP date parser.  The parser accepts the IMF-fixdate
+   format of RFC 7231 and the obsolete RFC 850 and asctime formats:
+
+     Sun, 06 Nov 1994 08:49:37 GMT
+     Sunday, 06-Nov-94 08:49:37 GMT
+     Sun Nov  6 08:49:37 1994
+
+   The parser consumes one character at a time so it can parse a date
+   value from a buffer or the `Date' header from a response header
+   stream without buffering the header lines. */
+class HttpDate
+{
+public:
+
+  HttpDate();
+
+  /* Reset the parser to the beginning of a header stream. */
+  void reset(void);
+
+  /* Process the next character `ch' of a response header stream.  The
+     method returns true when a `Date' header line has been parsed.
+     The date is then available from time(). */
+  bool input(char ch);
+
+  /* Tests if the header stream has reached the empty line that
+     terminates the headers. */
+  bool end_of_headers(void);
+
+  /* The Unix time of the last parsed date or 0 if no date has been
+     parsed. */
+  unsigned long time(void);
+
+  /* Parse the date value `date', `date_len'.  The method returns the
+     Unix time or 0 if the value is not a valid date. */
+  static unsigned long parse(const char *date, size_t date_len);
+
+private:
+
+  /* Start parsing a date value. */
+  void value_start(void);
+
+  /* Process the next character `ch' of a date value. */
+  void value_input(char ch);
+
+  /* Complete the number or word token that ended at the delimiter
+     `delim'. */
+  void token_end(char delim);
+
+  /* Complete the date value.  The method returns the Unix time or 0
+     if the value was not a valid date. */
+  unsigned long value_end(void);
+
+  /* Header stream state and the position in the header name. */
+  uint8_t state;
+  uint8_t name_pos;
+
+  /* The date fields.  The year is the full year and 0 for unset
+     fields. */
+  uint8_t day;
+  uint8_t month;
+  uint16_t year;
+  uint8_t hms[3];
+
+  /* The number of time fields parsed. */
+  uint8_t num_hms;
+
+  /* The current token: a number or a word packed 5 bits per
+     letter, and its length. */
+  uint16_t token;
+  uint8_t token_len;
+  bool token_word;
+
+  /* The delimiter before the current token. */
+  char prev_delim;
+
+  /* Has the value been found invalid? */
+  bool error;
+
+  /* The last parsed date. */
+  unsigned long result;
+};
+
+#endif /* not HTTPDATE_H */
@@ -22,208 +22,401 @@
  */
 
 #include "JSON.h"
+#include <Codec.h>
+
+/* Append the string literal `str' without computing its length at
+   runtime. */
+#define APPEND_LITERAL(str) append((str), sizeof(str) - 1, false)
 
 JSON::JSON(char *buffer, size_t buffer_len)
-  : buffer(buffer),
-    buffer_len(buffer_len),
-    buffer_pos(0),
-    stack_pos(0)
+  : sink(0),
+    buffer(buffer),
+    buffer_len(buffer_len)
+{
+  clear();
+}
+
+JSON::JSON(Print *sink)
+  : sink(sink),
+    buffer(0),
+    buffer_len(sizeof(staging))
 {
+  clear();
 }
 
 void
 JSON::clear(void)
 {
+  doc_len = 0;
   buffer_pos = 0;
+  status = JSON_OK;
+  empty = true;
   stack_pos = 0;
 }
 
 bool
 JSON::add_object(void)
 {
-  if (!obj_separator())
-    return false;
-
-  if (!push('o'))
-    return false;
+  obj_separator();
+  push(false);
+  append('{');
 
-  return append("{");
+  return status == JSON_OK;
 }
 
 bool
 JSON::add(const prog_char key[], int32_t value)
 {
-  if (!is_object())
-    return false;
+  add_key(key);
+  append(value);
 
-  if (!obj_separator())
-    return false;
-
-  return append("\"") && append_progstr(key) && append("\":") && append(value);
+  return status == JSON_OK;
 }
 
 bool
 JSON::add(const prog_char key[], const char *value)
 {
-  if (!is_object())
-    return false;
-
-  if (!obj_separator())
-    return false;
+  add_key(key);
+  append('"');
+  append(value);
+  append('"');
 
-  return (append("\"") && append_progstr(key) && append("\":\"")
-          && append(value) && append("\""));
+  return status == JSON_OK;
 }
 
 bool
 JSON::add(const prog_char key[], const uint8_t *data, size_t data_len)
 {
-  size_t i;
-  char buf[4];
+  add_key(key);
+  append('"');
+  append_hex(data, data_len);
+  append('"');
 
-  if (!is_object())
-    return false;
+  return status == JSON_OK;
+}
 
-  if (!obj_separator())
-    return false;
+bool
+JSON::add_array(const prog_char key[])
+{
+  add_key(key);
+  push(true);
+  append('[');
 
-  if (!append("\"") || !append_progstr(key) || !append("\":\""))
-    return false;
+  return status == JSON_OK;
+}
+
+bool
+JSON::add_template(const prog_char tmpl[], ...)
+{
+  va_list ap;
+  const prog_char *start;
+  const uint8_t *data;
+  char last = '\0';
+  char ch;
+
+  va_start(ap, tmpl);
 
-  for (i = 0; i < data_len; i++)
+  while (true)
     {
-      snprintf(buf, sizeof(buf), "%02x", data[i]);
-      if (!append(buf))
-        return false;
+      /* Copy the literal text up to the next directive. */
+      for (start = tmpl; (ch = pgm_read_byte(tmpl)) && ch != '%'; tmpl++)
+        last = ch;
+
+      append(start, tmpl - start, true);
+
+      if (ch == '\0')
+        break;
+
+      switch (pgm_read_byte(++tmpl))
+        {
+        case 'd':
+          append(va_arg(ap, int32_t));
+          break;
+
+        case 'x':
+          data = va_arg(ap, const uint8_t *);
+          append_hex(data, va_arg(ap, int));
+          break;
+
+        case 's':
+          append(va_arg(ap, const char *));
+          break;
+
+        case ',':
+          obj_separator();
+          break;
+
+        case '%':
+          append('%');
+          break;
+
+        default:
+          fail(JSON_ERROR_USAGE);
+          break;
+        }
+      if (status == JSON_ERROR_USAGE)
+        break;
+
+      last = '\0';
+      tmpl++;
     }
 
-  return append("\"");
+  va_end(ap);
+
+  empty = (last == '{' || last == '[');
+
+  return status == JSON_OK;
 }
 
 bool
-JSON::add_array(const char *key)
+JSON::pop(void)
 {
-  if (!obj_separator())
-    return false;
+  if (stack_pos == 0)
+    return fail(JSON_ERROR_NESTING);
 
-  if (!push('a'))
-    return false;
+  stack_pos--;
+  append(is_array(stack_pos) ? ']' : '}');
+
+  /* The parent has at least the popped member. */
+  empty = false;
 
-  return append("\"") && append(key) && append("\":") && append("[");
+  return status == JSON_OK;
 }
 
 bool
-JSON::pop(void)
+JSON::close(void)
 {
-  const char *str = "";
+  while (stack_pos > 0)
+    pop();
 
-  if (stack_pos <= 0)
-    return false;
+  flush();
+
+  return status == JSON_OK;
+}
 
-  switch (stack[--stack_pos])
+char *
+JSON::finish(void)
+{
+  if (sink)
     {
-    case 'o':
-      str = "}";
-      break;
+      fail(JSON_ERROR_USAGE);
+      return 0;
+    }
 
-    case 'a':
-      str = "]";
-      break;
+  close();
 
-    default:
-      return false;
-      break;
-    }
+  /* The null terminator is not a part of the document. */
+  if (status == JSON_OK && buffer_pos >= buffer_len)
+    fail(JSON_ERROR_SPACE);
+
+  if (status != JSON_OK)
+    return 0;
+
+  buffer[buffer_pos] = '\0';
+
+  return buffer;
+}
 
-  return append(str);
+size_t
+JSON::length(void)
+{
+  return doc_len;
+}
+
+uint8_t
+JSON::error(void)
+{
+  return status;
+}
+
+size_t
+JSON::needed(void)
+{
+  return sink ? doc_len : doc_len + 1;
 }
 
 char *
-JSON::finish(void)
+JSON::format_int(char *end, int32_t value)
 {
-  while (stack_pos > 0)
-    if (!pop())
-      return 0;
+  uint32_t uvalue = value < 0 ? -(uint32_t) value : value;
 
-  if (!append("x"))
-    return false;
+  /* Digits from the least significant end. */
+  do
+    {
+      *--end = '0' + uvalue % 10;
+      uvalue /= 10;
+    }
+  while (uvalue);
 
-  buffer[buffer_pos - 1] = '\0';
+  if (value < 0)
+    *--end = '-';
 
-  return buffer;
+  return end;
 }
 
 bool
-JSON::push(char type)
+JSON::fail(uint8_t error)
+{
+  if (status == JSON_OK)
+    status = error;
+
+  return false;
+}
+
+void
+JSON::push(bool array)
 {
+  uint8_t mask;
+
   if (stack_pos >= JSON_STACK_SIZE)
-    return false;
+    {
+      /* Track the depth for the length of the document. */
+      fail(JSON_ERROR_NESTING);
+      if (stack_pos < 0xff)
+        stack_pos++;
+      empty = true;
+      return;
+    }
 
-  stack[stack_pos++] = type;
+  mask = 1 << (stack_pos & 7);
+  if (array)
+    stack[stack_pos >> 3] |= mask;
+  else
+    stack[stack_pos >> 3] &= ~mask;
 
-  return true;
+  stack_pos++;
+  empty = true;
 }
 
 bool
-JSON::append(const char *value)
+JSON::is_array(uint8_t level)
 {
-  size_t len = strlen(value);
-
-  if (buffer_pos + len > buffer_len)
+  /* The levels beyond the stack are only counted. */
+  if (level >= JSON_STACK_SIZE)
     return false;
 
-  memcpy(buffer + buffer_pos, value, len);
-  buffer_pos += len;
+  return (stack[level >> 3] >> (level & 7)) & 1;
+}
+
+void
+JSON::add_key(const prog_char key[])
+{
+  if (stack_pos == 0 || is_array(stack_pos - 1))
+    fail(JSON_ERROR_USAGE);
 
-  return true;
+  obj_separator();
+  append('"');
+  append_progstr(key);
+  APPEND_LITERAL("\":");
 }
 
-bool
-JSON::append_progstr(const prog_char value[])
+void
+JSON::append(const char *value)
 {
-  size_t len = strlen_P(value);
+  append(value, strlen(value), false);
+}
 
-  if (buffer_pos + len > buffer_len)
-    return false;
+void
+JSON::append_progstr(const prog_char value[])
+{
+  append(value, strlen_P(value), true);
+}
 
-  memcpy_P(buffer + buffer_pos, value, len);
-  buffer_pos += len;
+void
+JSON::append(char ch)
+{
+  if (status == JSON_OK && buffer_pos < buffer_len)
+    {
+      (sink ? staging : buffer)[buffer_pos++] = ch;
+      doc_len++;
+      return;
+    }
 
-  return true;
+  append(&ch, 1, false);
 }
 
-bool
+void
 JSON::append(int32_t value)
 {
-  char buf[16];
+  char buf[JSON_INT_LEN];
+  char *cp = format_int(buf + sizeof(buf), value);
+
+  append(cp, buf + sizeof(buf) - cp, false);
+}
 
-  snprintf(buf, sizeof(buf), "%d", value);
+void
+JSON::append_hex(const uint8_t *data, size_t data_len)
+{
+  char buf[17];
+  size_t n;
 
-  return append(buf);
+  for (; data_len > 0; data += n, data_len -= n)
+    {
+      n = data_len < 8 ? data_len : 8;
+      append(buf, Codec::hex_encode(buf, data, n, true) - buf, false);
+    }
 }
 
-bool
-JSON::is_object()
+void
+JSON::append(const char *value, size_t len, bool progmem)
 {
-  return stack_pos > 0 && stack[stack_pos - 1] == 'o';
+  char *buf = sink ? staging : buffer;
+  size_t n;
+
+  /* The document length is counted also after an error so that
+     needed() reports the size of the whole document. */
+  doc_len += len;
+
+  /* In the buffer mode the value must fit into the buffer as a
+     whole. */
+  if (!sink && buffer_pos + len > buffer_len)
+    fail(JSON_ERROR_SPACE);
+
+  if (status != JSON_OK)
+    return;
+
+  while (len > 0)
+    {
+      if (buffer_pos >= buffer_len && !flush())
+        return;
+
+      n = buffer_len - buffer_pos;
+      if (n > len)
+        n = len;
+
+      if (progmem)
+        memcpy_P(buf + buffer_pos, value, n);
+      else
+        memcpy(buf + buffer_pos, value, n);
+
+      buffer_pos += n;
+      value += n;
+      len -= n;
+    }
 }
 
 bool
-JSON::obj_separator()
+JSON::flush(void)
 {
-  if (buffer_pos <= 0)
-    return true;
+  if (!sink || buffer_pos == 0 || status != JSON_OK)
+    return status == JSON_OK;
 
-  switch (buffer[buffer_pos - 1])
-    {
-    case '{':
-    case '[':
-      return true;
-      break;
+  if (sink->write((const uint8_t *) staging, buffer_pos) != buffer_pos)
+    return fail(JSON_ERROR_SINK);
+
+  buffer_pos = 0;
 
-    default:
-      break;
+  return true;
+}
+
+void
+JSON::obj_separator()
+{
+  if (empty)
+    {
+      empty = false;
+      return;
     }
 
-  return append(",");
+  append(',');
 }
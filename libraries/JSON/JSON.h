@@ -32,15 +32,45 @@
 #endif
 
 #include <avr/pgmspace.h>
+#include <stdarg.h>
 
-#define JSON_STACK_SIZE 8
+/* The maximum nesting depth of the documents.  The stack takes one
+   bit per level. */
+#define JSON_STACK_SIZE 64
 
+/* Error codes. */
+#define JSON_OK			0
+#define JSON_ERROR_SPACE	1	/* The buffer is too small */
+#define JSON_ERROR_NESTING	2	/* Too deep or unbalanced nesting */
+#define JSON_ERROR_USAGE	3	/* Invalid call or template */
+#define JSON_ERROR_SINK		4	/* Writing to the sink failed */
+
+/* The maximum length of a formatted int32_t: a sign and 10 digits. */
+#define JSON_INT_LEN 11
+
+/* The size of the staging buffer for the Print sink mode.  The output
+   is written to the sink in chunks of this size. */
+#define JSON_STAGING_LEN 32
+
+/* JSON encoder.  The first error of a document is sticky: after it
+   all methods return false and error() returns its code.  The
+   encoder keeps counting the document length after errors so that
+   needed() tells the buffer size that the whole document requires. */
 class JSON
 {
 public:
 
+  /* Construct a JSON encoder that creates the document into the
+     buffer `buffer', `buffer_len'. */
   JSON(char *buffer, size_t buffer_len);
 
+  /* Construct a JSON encoder that writes the document to `sink'.
+     The document can be of any size.  Encoding the same document to
+     two sinks gives the same output so an encoding to a counting or
+     hashing sink can compute the document's length and digest before
+     it is sent. */
+  JSON(Print *sink);
+
   void clear(void);
 
   bool add_object(void);
@@ -50,24 +80,110 @@ public:
   bool add(const prog_char key[], const uint8_t *data, size_t data_len);
   bool add_array(const prog_char key[]);
 
+  /* Append the output of the template `tmpl' that is stored in the
+     program memory.  The template text is copied as-is except for the
+     following directives that take their values from the arguments:
+
+       %d  an int32_t as a decimal number
+       %x  a const uint8_t * and its length as an int, as hex digits
+       %s  a const char *, as-is
+       %,  a `,' unless this is the first member of the enclosing
+           object or array
+       %%  a `%'
+
+     The template output bypasses the object and array stack so a
+     document is built either with templates or with the add methods.
+     Templates that end with `{' or `[' open a new container for the
+     `%,' directive.  This is intended for fixed-shape documents whose
+     structure is known at compile time. */
+  bool add_template(const prog_char tmpl[], ...);
+
   bool pop(void);
+
+  /* Close all open objects and arrays and write all pending output
+     to the sink. */
+  bool close(void);
+
+  /* Close the document and return it as a null-terminated string.
+     This can only be used with the buffer constructor. */
   char *finish(void);
 
+  /* The number of bytes of the document so far. */
+  size_t length(void);
+
+  /* The first error of the document or JSON_OK. */
+  uint8_t error(void);
+
+  /* Format `value' as decimal digits that end before `end'.  The
+     method returns a pointer to the first character.  The digits and
+     the sign take at most JSON_INT_LEN bytes. */
+  static char *format_int(char *end, int32_t value);
+
+  /* The buffer size that the document so far requires, including
+     the null terminator of finish() in the buffer mode. */
+  size_t needed(void);
+
 private:
 
-  bool push(char type);
-  bool append(const char *value);
-  bool append_progstr(const prog_char value[]);
-  bool append(int32_t value);
-  bool is_object();
-  bool obj_separator();
+  /* Record the error `error' unless an earlier error is recorded.
+     The method returns false. */
+  bool fail(uint8_t error);
+
+  /* Open a new array or object level. */
+  void push(bool array);
 
+  /* Is the nesting level `level' an array? */
+  bool is_array(uint8_t level);
+
+  /* Append the member key `key' of the current object. */
+  void add_key(const prog_char key[]);
+
+  void append(const char *value);
+  void append_progstr(const prog_char value[]);
+
+  /* Append the character `ch'. */
+  void append(char ch);
+
+  /* Append the decimal representation of `value'. */
+  void append(int32_t value);
+
+  /* Append `data', `data_len' as lowercase hex digits. */
+  void append_hex(const uint8_t *data, size_t data_len);
+
+  /* Append `len' bytes from `value' that is in the program memory
+     if `progmem' is true. */
+  void append(const char *value, size_t len, bool progmem);
+
+  bool flush(void);
+  void obj_separator();
+
+  /* The output sink or 0 if the document is created into the
+     buffer. */
+  Print *sink;
+
+  /* The length of the document including the bytes that did not
+     fit. */
+  size_t doc_len;
+
+  /* The document buffer, or 0 in the sink mode, and its length.  In
+     the sink mode `buffer_pos' counts the bytes in `staging'. */
   char *buffer;
   size_t buffer_len;
   size_t buffer_pos;
 
+  /* The first error. */
+  uint8_t status;
+
+  /* Is the current object or array still empty? */
+  bool empty;
+
+  /* The nesting depth and the container types, one bit per level,
+     set for arrays. */
   uint8_t stack_pos;
-  char stack[JSON_STACK_SIZE];
+  uint8_t stack[JSON_STACK_SIZE / 8];
+
+  /* Staging buffer for the sink mode. */
+  char staging[JSON_STAGING_LEN];
 };
 
 #endif /* not JSON_H */
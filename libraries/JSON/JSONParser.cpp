@@ -0,0 +1,457 @@
+/*
+ * JSONParser.cpp
+ *
+ * Author: Markku Rossi <mtr@iki.fi>
+ *
+ * Copyright (c) 2012 Markku Rossi
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "JSONParser.h"
+#include "JSON.h"
+
+/* Parser states. */
+#define JSON_PARSER_VALUE	0	/* Expecting a value */
+#define JSON_PARSER_FIRST_VALUE	1	/* Expecting a value or `]' */
+#define JSON_PARSER_KEY		2	/* Expecting a key */
+#define JSON_PARSER_FIRST_KEY	3	/* Expecting a key or `}' */
+#define JSON_PARSER_COLON	4
+#define JSON_PARSER_STRING	5
+#define JSON_PARSER_ESCAPE	6
+#define JSON_PARSER_UNICODE	7
+#define JSON_PARSER_NUMBER	8
+#define JSON_PARSER_LITERAL	9
+#define JSON_PARSER_AFTER	10	/* Expecting `,' or a container end */
+#define JSON_PARSER_DONE	11
+#define JSON_PARSER_ERROR	12
+
+JSONParser::JSONParser(JSONParserCallback callback, void *context)
+  : callback(callback),
+    context(context)
+{
+  reset();
+}
+
+void
+JSONParser::reset(void)
+{
+  state = JSON_PARSER_VALUE;
+  stack_pos = 0;
+  path[0] = '\0';
+  path_len = 0;
+  token_len = 0;
+}
+
+bool
+JSONParser::input(char ch)
+{
+  uint8_t type;
+
+  switch (state)
+    {
+    case JSON_PARSER_STRING:
+      if (ch == '"')
+        {
+          token[token_len < JSON_PARSER_VALUE_LEN
+                ? token_len : JSON_PARSER_VALUE_LEN - 1] = '\0';
+          if (!key)
+            return value_end(JSON_STRING);
+
+          if (token_len >= JSON_PARSER_VALUE_LEN)
+            path_len = JSON_PARSER_PATH_LEN;
+          else
+            path_append(token);
+
+          state = JSON_PARSER_COLON;
+          return true;
+        }
+      if (ch == '\\')
+        {
+          state = JSON_PARSER_ESCAPE;
+          return true;
+        }
+      if ((uint8_t) ch < 0x20)
+        break;
+
+      token_add(ch);
+      return true;
+
+    case JSON_PARSER_ESCAPE:
+      switch (ch)
+        {
+        case '"':
+        case '\\':
+        case '/':
+          token_add(ch);
+          break;
+
+        case 'b':
+          token_add('\b');
+          break;
+
+        case 'f':
+          token_add('\f');
+          break;
+
+        case 'n':
+          token_add('\n');
+          break;
+
+        case 'r':
+          token_add('\r');
+          break;
+
+        case 't':
+          token_add('\t');
+          break;
+
+        case 'u':
+          escape = 0;
+          escape_len = 0;
+          state = JSON_PARSER_UNICODE;
+          return true;
+
+        default:
+          state = JSON_PARSER_ERROR;
+          return false;
+        }
+      state = JSON_PARSER_STRING;
+      return true;
+
+    case JSON_PARSER_UNICODE:
+      if ('0' <= ch && ch <= '9')
+        escape = (escape << 4) | (ch - '0');
+      else if ('a' <= (ch | 0x20) && (ch | 0x20) <= 'f')
+        escape = (escape << 4) | ((ch | 0x20) - 'a' + 10);
+      else
+        break;
+
+      if (++escape_len < 4)
+        return true;
+
+      /* Encode as UTF-8.  Surrogate pairs are not combined. */
+      if (escape < 0x80)
+        {
+          token_add(escape);
+        }
+      else if (escape < 0x800)
+        {
+          token_add(0xc0 | (escape >> 6));
+          token_add(0x80 | (escape & 0x3f));
+        }
+      else
+        {
+          token_add(0xe0 | (escape >> 12));
+          token_add(0x80 | ((escape >> 6) & 0x3f));
+          token_add(0x80 | (escape & 0x3f));
+        }
+      state = JSON_PARSER_STRING;
+      return true;
+
+    case JSON_PARSER_NUMBER:
+      if (('0' <= ch && ch <= '9') || ch == '-' || ch == '+' || ch == '.'
+          || ch == 'e' || ch == 'E')
+        {
+          token_add(ch);
+          return true;
+        }
+      if (!value_end(JSON_NUMBER))
+        return false;
+
+      /* The character after the number. */
+      return input(ch);
+
+    case JSON_PARSER_LITERAL:
+      if ('a' <= ch && ch <= 'z')
+        {
+          token_add(ch);
+          return true;
+        }
+
+      if (token_len >= JSON_PARSER_VALUE_LEN)
+        break;
+      token[token_len] = '\0';
+
+      if (strcmp_P(token, PSTR("true")) == 0)
+        type = JSON_TRUE;
+      else if (strcmp_P(token, PSTR("false")) == 0)
+        type = JSON_FALSE;
+      else if (strcmp_P(token, PSTR("null")) == 0)
+        type = JSON_NULL;
+      else
+        break;
+
+      if (!value_end(type))
+        return false;
+
+      return input(ch);
+
+    case JSON_PARSER_ERROR:
+      return false;
+
+    default:
+      if (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n')
+        return true;
+
+      switch (state)
+        {
+        case JSON_PARSER_FIRST_VALUE:
+          if (ch == ']')
+            return pop('a');
+          /* FALLTHROUGH */
+
+        case JSON_PARSER_VALUE:
+          return input_value(ch);
+
+        case JSON_PARSER_FIRST_KEY:
+          if (ch == '}')
+            return pop('o');
+          /* FALLTHROUGH */
+
+        case JSON_PARSER_KEY:
+          if (ch != '"')
+            break;
+
+          key = true;
+          token_len = 0;
+          state = JSON_PARSER_STRING;
+          return true;
+
+        case JSON_PARSER_COLON:
+          if (ch != ':')
+            break;
+
+          state = JSON_PARSER_VALUE;
+          return true;
+
+        case JSON_PARSER_AFTER:
+          return input_after_value(ch);
+
+        default:
+          break;
+        }
+      break;
+    }
+
+  state = JSON_PARSER_ERROR;
+  return false;
+}
+
+bool
+JSONParser::parse(Client *client)
+{
+  while (client->connected())
+    {
+      while (client->available() > 0)
+        if (!input(client->read()))
+          return false;
+
+      delay(100);
+    }
+
+  /* A number at the end of the document is complete at its end. */
+  if (state == JSON_PARSER_NUMBER && !value_end(JSON_NUMBER))
+    return false;
+
+  return done();
+}
+
+bool
+JSONParser::done(void)
+{
+  return state == JSON_PARSER_DONE;
+}
+
+bool
+JSONParser::input_value(char ch)
+{
+  if (!value_start())
+    return false;
+
+  switch (ch)
+    {
+    case '{':
+      return push('o');
+
+    case '[':
+      return push('a');
+
+    case '"':
+      key = false;
+      token_len = 0;
+      state = JSON_PARSER_STRING;
+      return true;
+
+    default:
+      token_len = 0;
+      token_add(ch);
+
+      if (ch == '-' || ('0' <= ch && ch <= '9'))
+        {
+          state = JSON_PARSER_NUMBER;
+          return true;
+        }
+      if (ch == 't' || ch == 'f' || ch == 'n')
+        {
+          state = JSON_PARSER_LITERAL;
+          return true;
+        }
+      break;
+    }
+
+  state = JSON_PARSER_ERROR;
+  return false;
+}
+
+bool
+JSONParser::input_after_value(char ch)
+{
+  switch (ch)
+    {
+    case ',':
+      if (stack_type[stack_pos - 1] == 'o')
+        {
+          state = JSON_PARSER_KEY;
+        }
+      else
+        {
+          stack_index[stack_pos - 1]++;
+          state = JSON_PARSER_VALUE;
+        }
+      return true;
+
+    case '}':
+      return pop('o');
+
+    case ']':
+      return pop('a');
+
+    default:
+      break;
+    }
+
+  state = JSON_PARSER_ERROR;
+  return false;
+}
+
+bool
+JSONParser::value_start(void)
+{
+  char buf[6];
+
+  /* The path of an array element is its index. */
+  if (stack_pos > 0 && stack_type[stack_pos - 1] == 'a')
+    {
+      buf[sizeof(buf) - 1] = '\0';
+      path_append(JSON::format_int(buf + sizeof(buf) - 1,
+                                   stack_index[stack_pos - 1]));
+    }
+
+  return true;
+}
+
+bool
+JSONParser::value_end(uint8_t type)
+{
+  if (token_len >= JSON_PARSER_VALUE_LEN)
+    {
+      /* Only strings can be truncated. */
+      if (type != JSON_STRING)
+        {
+          state = JSON_PARSER_ERROR;
+          return false;
+        }
+      token_len = JSON_PARSER_VALUE_LEN - 1;
+    }
+  token[token_len] = '\0';
+
+  if (path_len < JSON_PARSER_PATH_LEN)
+    callback(context, path, type, token);
+
+  state = stack_pos > 0 ? JSON_PARSER_AFTER : JSON_PARSER_DONE;
+
+  return true;
+}
+
+void
+JSONParser::token_add(char ch)
+{
+  if (token_len < JSON_PARSER_VALUE_LEN - 1)
+    token[token_len++] = ch;
+  else
+    token_len = JSON_PARSER_VALUE_LEN;
+}
+
+void
+JSONParser::path_append(const char *name)
+{
+  uint8_t len = stack_path[stack_pos - 1];
+  size_t name_len = strlen(name);
+
+  if (len >= JSON_PARSER_PATH_LEN
+      || len + 1 + name_len >= JSON_PARSER_PATH_LEN)
+    {
+      path_len = JSON_PARSER_PATH_LEN;
+      return;
+    }
+
+  if (len > 0)
+    path[len++] = '.';
+
+  memcpy(path + len, name, name_len);
+  len += name_len;
+  path[len] = '\0';
+
+  path_len = len;
+}
+
+bool
+JSONParser::push(char type)
+{
+  if (stack_pos >= JSON_PARSER_STACK_SIZE)
+    {
+      state = JSON_PARSER_ERROR;
+      return false;
+    }
+
+  stack_type[stack_pos] = type;
+  stack_path[stack_pos] = path_len;
+  stack_index[stack_pos] = 0;
+  stack_pos++;
+
+  state = type == 'o' ? JSON_PARSER_FIRST_KEY : JSON_PARSER_FIRST_VALUE;
+
+  return true;
+}
+
+bool
+JSONParser::pop(char type)
+{
+  if (stack_pos == 0 || stack_type[stack_pos - 1] != type)
+    {
+      state = JSON_PARSER_ERROR;
+      return false;
+    }
+
+  stack_pos--;
+  path_len = stack_path[stack_pos];
+
+  state = stack_pos > 0 ? JSON_PARSER_AFTER : JSON_PARSER_DONE;
+
+  return true;
+}
@@ -0,0 +1,142 @@
+/* -*- c++ -*-
+ *
+ * JSONParser.h
+ *
+ * Author: Markku Rossi <mtr@iki.fi>
+ *
+ * Copyright (c) 2012 Markku Rossi
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef JSONPARSER_H
+#define JSONPARSER_H
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include <Client.h>
+
+/* The maximum nesting depth of the parsed documents. */
+#define JSON_PARSER_STACK_SIZE 8
+
+/* The maximum length of a value path.  Values with longer paths are
+   parsed but not reported. */
+#define JSON_PARSER_PATH_LEN 32
+
+/* The maximum length of a reported value.  Longer strings are
+   truncated. */
+#define JSON_PARSER_VALUE_LEN 24
+
+/* Value types. */
+#define JSON_STRING	0
+#define JSON_NUMBER	1
+#define JSON_TRUE	2
+#define JSON_FALSE	3
+#define JSON_NULL	4
+
+/* Callback for the values of the parsed document.  The argument
+   `path' is the path of the value: the object keys and array indexes
+   from the document root separated by `.', e.g. `cfg.sensors.0'.
+   The argument `type' is the value type and `value' its text; the
+   text of a string value is unescaped. */
+typedef void (*JSONParserCallback)(void *context, const char *path,
+                                   uint8_t type, const char *value);
+
+/* Event-based JSON parser.  The parser consumes the document one
+   character at a time and calls the callback for each scalar value.
+   It uses a fixed amount of memory regardless of the document
+   size. */
+class JSONParser
+{
+public:
+
+  JSONParser(JSONParserCallback callback, void *context);
+
+  /* Reset the parser for a new document. */
+  void reset(void);
+
+  /* Process the next character `ch' of the document.  The method
+     returns false if the document is invalid. */
+  bool input(char ch);
+
+  /* Parse the rest of the document from the connection `client'.
+     The method reads until the connection is closed and returns true
+     if it contained a valid document. */
+  bool parse(Client *client);
+
+  /* Tests if a complete document has been parsed. */
+  bool done(void);
+
+private:
+
+  /* Process the character `ch' in the value states. */
+  bool input_value(char ch);
+
+  /* Process the character `ch' after a value. */
+  bool input_after_value(char ch);
+
+  /* Start a new value of the current container. */
+  bool value_start(void);
+
+  /* Complete the scalar value of type `type'. */
+  bool value_end(uint8_t type);
+
+  /* Add the character `ch' to the current token. */
+  void token_add(char ch);
+
+  /* Append the path component `name' to the path. */
+  void path_append(const char *name);
+
+  /* Open a new container of type `type'. */
+  bool push(char type);
+
+  /* Close the current container of type `type'. */
+  bool pop(char type);
+
+  JSONParserCallback callback;
+  void *context;
+
+  uint8_t state;
+
+  /* Is the current string an object key? */
+  bool key;
+
+  /* The pending \u escape value and the number of its digits. */
+  uint16_t escape;
+  uint8_t escape_len;
+
+  /* The container stack: the container types, the path lengths of
+     the containers, and the array indexes. */
+  uint8_t stack_pos;
+  char stack_type[JSON_PARSER_STACK_SIZE];
+  uint8_t stack_path[JSON_PARSER_STACK_SIZE];
+  uint16_t stack_index[JSON_PARSER_STACK_SIZE];
+
+  /* The value path and its length.  The length is
+     JSON_PARSER_PATH_LEN if the path did not fit. */
+  char path[JSON_PARSER_PATH_LEN];
+  uint8_t path_len;
+
+  /* The current token. */
+  char token[JSON_PARSER_VALUE_LEN];
+  uint8_t token_len;
+};
+
+#endif /* not JSONPARSER_H */
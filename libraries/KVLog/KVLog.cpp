@@ -0,0 +1,180 @@
+/*
+ * KVLog.cpp
+ *
+ * Author: Markku Rossi <mtr@iki.fi>
+ *
+ * Copyright (c) 2012 Markku Rossi
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "KVLog.h"
+
+KVLog::KVLog(int address, int len)
+  : address(address),
+    page_len(len / 2),
+    page(0),
+    generation(0),
+    pos(KVLOG_HEADER_LEN),
+    valid(0)
+{
+}
+
+void
+KVLog::begin(void)
+{
+  uint8_t buf[KVLOG_ENTRY_LEN];
+  uint8_t gen0, gen1;
+  bool valid0, valid1;
+  uint32_t value;
+  int addr;
+
+  valid = 0;
+
+  valid0 = read_header(0, &gen0);
+  valid1 = read_header(1, &gen1);
+
+  if (!valid0 && !valid1)
+    {
+      /* Format the region. */
+      page = 1;
+      generation = 0xff;
+      switch_page();
+      return;
+    }
+
+  /* The newer page is active.  The generations wrap around. */
+  if (valid0 && (!valid1 || (int8_t) (gen0 - gen1) > 0))
+    {
+      page = 0;
+      generation = gen0;
+    }
+  else
+    {
+      page = 1;
+      generation = gen1;
+    }
+
+  /* Scan the entries up to the first invalid one. */
+  addr = page_address(page);
+  for (pos = KVLOG_HEADER_LEN; pos + KVLOG_ENTRY_LEN <= page_len;
+       pos += KVLOG_ENTRY_LEN)
+    {
+      GetPut::eeprom_read_data(buf, sizeof(buf), addr + pos);
+      value = GetPut::get_32bit(buf + 1);
+
+      if (buf[0] >= KVLOG_KEYS
+          || GetPut::get_16bit(buf + 5) != entry_crc(buf[0], value))
+        break;
+
+      values[buf[0]] = value;
+      valid |= 1 << buf[0];
+    }
+}
+
+bool
+KVLog::get(uint8_t key, uint32_t *value_return)
+{
+  if (key >= KVLOG_KEYS || (valid & (1 << key)) == 0)
+    return false;
+
+  *value_return = values[key];
+
+  return true;
+}
+
+bool
+KVLog::set(uint8_t key, uint32_t value)
+{
+  if (key >= KVLOG_KEYS)
+    return false;
+
+  if ((valid & (1 << key)) && values[key] == value)
+    return true;
+
+  values[key] = value;
+  valid |= 1 << key;
+
+  if (pos + KVLOG_ENTRY_LEN > page_len)
+    switch_page();
+  else
+    append(key, value);
+
+  return true;
+}
+
+int
+KVLog::page_address(uint8_t page)
+{
+  return address + page * page_len;
+}
+
+bool
+KVLog::read_header(uint8_t page, uint8_t *generation_return)
+{
+  uint8_t buf[KVLOG_HEADER_LEN];
+
+  GetPut::eeprom_read_data(buf, sizeof(buf), page_address(page));
+  *generation_return = buf[0];
+
+  return buf[0] == (uint8_t) ~buf[1];
+}
+
+uint16_t
+KVLog::entry_crc(uint8_t key, uint32_t value)
+{
+  uint8_t buf[6];
+
+  buf[0] = generation;
+  buf[1] = key;
+  GetPut::put_32bit(buf + 2, value);
+
+  return GetPut::crc16(GETPUT_CRC16_INIT, buf, sizeof(buf));
+}
+
+void
+KVLog::append(uint8_t key, uint32_t value)
+{
+  uint8_t buf[KVLOG_ENTRY_LEN];
+
+  buf[0] = key;
+  GetPut::put_32bit(buf + 1, value);
+  GetPut::put_16bit(buf + 5, entry_crc(key, value));
+
+  GetPut::eeprom_write_data(buf, sizeof(buf), page_address(page) + pos);
+  pos += KVLOG_ENTRY_LEN;
+}
+
+void
+KVLog::switch_page(void)
+{
+  uint8_t buf[KVLOG_HEADER_LEN];
+  uint8_t key;
+
+  page ^= 1;
+  generation++;
+  pos = KVLOG_HEADER_LEN;
+
+  for (key = 0; key < KVLOG_KEYS; key++)
+    if (valid & (1 << key))
+      append(key, values[key]);
+
+  /* The header is written last: until then the old page stays
+     active. */
+  buf[0] = generation;
+  buf[1] = ~generation;
+  GetPut::eeprom_write_data(buf, sizeof(buf), page_address(page));
+}
@@ -0,0 +1,119 @@
+/* -*- c++ -*-
+ *
+ * KVLog.h
+ *
+ * Author: Markku Rossi <mtr@iki.fi>
+ *
+ * Copyright (c) 2012 Markku Rossi
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef KVLOG_H
+#define KVLOG_H
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include <GetPut.h>
+
+/* The number of keys.  The keys are 0 ... KVLOG_KEYS - 1. */
+#define KVLOG_KEYS 8
+
+/* A page starts with the generation and its complement.  An entry is
+   the key, the value, and the CRC-16 of the generation, the key, and
+   the value. */
+#define KVLOG_HEADER_LEN	2
+#define KVLOG_ENTRY_LEN		7
+
+/* The minimum region length: two pages that hold all keys and one
+   more entry. */
+#define KVLOG_MIN_LEN \
+  (2 * (KVLOG_HEADER_LEN + (KVLOG_KEYS + 1) * KVLOG_ENTRY_LEN))
+
+/* Wear-levelled key-value log in an EEPROM region.  The region is
+   split into two pages.  Updates are appended to the active page and
+   when it is full, the current values are copied to the other page
+   which then becomes the active one.  Each EEPROM cell is thus
+   written once per page cycle instead of once per update.  The
+   current values are indexed in RAM so that reads do not touch the
+   EEPROM.
+
+   The pages are never erased.  The entries carry the page's
+   generation in their CRC so the entries of earlier generations end
+   the log.  The new page's header is written last when the pages are
+   switched so an interrupted switch leaves the old page active. */
+class KVLog
+{
+public:
+
+  /* Construct a log over the EEPROM region `address', `len'.  The
+     region must be at least KVLOG_MIN_LEN bytes long. */
+  KVLog(int address, int len);
+
+  /* Scan the region and build the index of the current values.  A
+     region without a valid page is formatted. */
+  void begin(void);
+
+  /* Get the value of the key `key' into `value_return'.  The method
+     returns false if the key has no value. */
+  bool get(uint8_t key, uint32_t *value_return);
+
+  /* Set the value of the key `key' to `value'.  An unchanged value
+     is not written.  The method returns false if the key is
+     invalid. */
+  bool set(uint8_t key, uint32_t value);
+
+private:
+
+  /* The EEPROM address of the page `page'. */
+  int page_address(uint8_t page);
+
+  /* Read the generation of the page `page' into `generation_return'.
+     The method returns false if the page header is invalid. */
+  bool read_header(uint8_t page, uint8_t *generation_return);
+
+  /* The CRC of the entry `key', `value' in the current generation. */
+  uint16_t entry_crc(uint8_t key, uint32_t value);
+
+  /* Append the entry `key', `value' to the active page. */
+  void append(uint8_t key, uint32_t value);
+
+  /* Copy the current values to the other page and make it
+     active. */
+  void switch_page(void);
+
+  /* The EEPROM region: the address of the first page and the page
+     length. */
+  int address;
+  int page_len;
+
+  /* The active page, its generation, and the offset of the next entry
+     in it. */
+  uint8_t page;
+  uint8_t generation;
+  int pos;
+
+  /* The index: the current values and a bitmask of the keys that have
+     a value. */
+  uint32_t values[KVLOG_KEYS];
+  uint8_t valid;
+};
+
+#endif /* not KVLOG_H */
@@ -0,0 +1,282 @@
+/*
+ * SNTP.cpp
+ *
+ * Author: Markku Rossi <mtr@iki.fi>
+ *
+ * Copyright (c) 2012 Markku Rossi
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "SNTP.h"
+#include <GetPut.h>
+
+/* Seconds from the NTP epoch (1900) to the Unix epoch (1970). */
+#define SNTP_UNIX_EPOCH 2208988800UL
+
+/* Message fields. */
+#define SNTP_LI_VN_MODE		0
+#define SNTP_STRATUM		1
+#define SNTP_ORIGINATE		24
+#define SNTP_RECEIVE		32
+#define SNTP_TRANSMIT		40
+
+/* LI 0, version 4, mode 3 (client). */
+#define SNTP_CLIENT_REQUEST	0x23
+
+#define SNTP_MODE_SERVER	4
+#define SNTP_LI_ALARM		3
+
+SNTP *SNTP::instance = 0;
+
+/* Convert the NTP timestamp fraction `frac' to milliseconds. */
+static uint16_t
+frac_to_msec(uint32_t frac)
+{
+  return ((frac >> 16) * 1000UL) >> 16;
+}
+
+SNTP::SNTP()
+  : udp(0),
+    waiting(false),
+    sent_millis(0),
+    nonce(0),
+    backoff(0),
+    failed_millis(0),
+    sample_sec(0),
+    sample_msec(0),
+    sample_millis(0),
+    have_sample(false),
+    fresh(false),
+    rtt(0)
+{
+}
+
+void
+SNTP::begin(IPAddress server, uint16_t local_port)
+{
+  begin(&ethernet_udp, server, local_port);
+}
+
+void
+SNTP::begin(UDP *udp, IPAddress server, uint16_t local_port)
+{
+  this->udp = udp;
+  this->server = server;
+  udp->begin(local_port);
+
+  instance = this;
+}
+
+void
+SNTP::request(void)
+{
+  uint8_t msg[SNTP_MESSAGE_LEN];
+
+  if (waiting)
+    return;
+  if (backoff && millis() - failed_millis < backoff)
+    return;
+
+  /* Drop stale responses. */
+  while (udp->parsePacket() > 0)
+    ;
+
+  memset(msg, 0, sizeof(msg));
+  msg[SNTP_LI_VN_MODE] = SNTP_CLIENT_REQUEST;
+
+  sent_millis = millis();
+  nonce = random();
+
+  GetPut::put_32bit(msg + SNTP_TRANSMIT, sent_millis);
+  GetPut::put_32bit(msg + SNTP_TRANSMIT + 4, nonce);
+
+  if (!udp->beginPacket(server, SNTP_PORT))
+    {
+      failed();
+      return;
+    }
+  udp->write(msg, sizeof(msg));
+  if (!udp->endPacket())
+    {
+      failed();
+      return;
+    }
+
+  waiting = true;
+}
+
+bool
+SNTP::poll(void)
+{
+  uint8_t msg[SNTP_MESSAGE_LEN];
+
+  if (!waiting)
+    return false;
+
+  while (waiting && udp->parsePacket() >= SNTP_MESSAGE_LEN)
+    {
+      if (udp->remotePort() != SNTP_PORT
+          || (uint32_t) udp->remoteIP() != (uint32_t) server)
+        continue;
+
+      if (udp->read(msg, sizeof(msg)) != sizeof(msg))
+        continue;
+
+      if (process(msg))
+        {
+          waiting = false;
+          backoff = 0;
+          have_sample = true;
+          fresh = true;
+          return true;
+        }
+    }
+
+  if (waiting && millis() - sent_millis >= SNTP_TIMEOUT)
+    failed();
+
+  return false;
+}
+
+bool
+SNTP::pending(void)
+{
+  return waiting;
+}
+
+unsigned long
+SNTP::get_time(uint16_t *msec_return)
+{
+  unsigned long ms;
+
+  if (!have_sample)
+    {
+      *msec_return = 0;
+      return 0;
+    }
+
+  ms = sample_msec + (millis() - sample_millis);
+
+  *msec_return = ms % 1000;
+  return sample_sec + ms / 1000;
+}
+
+unsigned long
+SNTP::round_trip(void)
+{
+  return rtt;
+}
+
+time_t
+SNTP::provider(void)
+{
+  uint16_t msec;
+  unsigned long now;
+
+  if (instance == 0)
+    return 0;
+
+  instance->poll();
+
+  if (instance->fresh)
+    {
+      instance->fresh = false;
+
+      /* The Time library counts whole seconds from now on. */
+      now = instance->get_time(&msec);
+      if (msec >= 500)
+        now++;
+
+      return now;
+    }
+
+  instance->request();
+
+  return 0;
+}
+
+void
+SNTP::failed(void)
+{
+  waiting = false;
+
+  if (backoff == 0)
+    backoff = SNTP_MIN_BACKOFF;
+  else if (backoff < SNTP_MAX_BACKOFF)
+    backoff *= 2;
+
+  failed_millis = millis();
+}
+
+bool
+SNTP::process(uint8_t *msg)
+{
+  unsigned long now = millis();
+  uint32_t receive_sec, transmit_sec;
+  uint16_t receive_msec, transmit_msec;
+  unsigned long held;
+  unsigned long ms;
+
+  /* The response must answer our pending request. */
+  if (GetPut::get_32bit(msg + SNTP_ORIGINATE) != sent_millis
+      || GetPut::get_32bit(msg + SNTP_ORIGINATE + 4) != nonce)
+    return false;
+
+  if ((msg[SNTP_LI_VN_MODE] & 0x7) != SNTP_MODE_SERVER)
+    return false;
+
+  if (msg[SNTP_STRATUM] == 0)
+    {
+      /* Kiss-o'-Death: the server asks us to go away. */
+      backoff = SNTP_MAX_BACKOFF;
+      failed_millis = now;
+      waiting = false;
+      return false;
+    }
+
+  if ((msg[SNTP_LI_VN_MODE] >> 6) == SNTP_LI_ALARM
+      || msg[SNTP_STRATUM] > 15)
+    return false;
+
+  transmit_sec = GetPut::get_32bit(msg + SNTP_TRANSMIT);
+  if (transmit_sec == 0)
+    return false;
+
+  transmit_msec = frac_to_msec(GetPut::get_32bit(msg + SNTP_TRANSMIT + 4));
+  receive_sec = GetPut::get_32bit(msg + SNTP_RECEIVE);
+  receive_msec = frac_to_msec(GetPut::get_32bit(msg + SNTP_RECEIVE + 4));
+
+  /* The round trip delay is our elapsed time minus the time the
+     server held the request. */
+  held = (transmit_sec - receive_sec) * 1000UL + transmit_msec - receive_msec;
+  rtt = now - sent_millis;
+  if (held < rtt)
+    rtt -= held;
+  else
+    rtt = 0;
+
+  /* The response left the server at the transmit time and arrived
+     after half of the round trip. */
+  ms = transmit_msec + rtt / 2;
+
+  sample_sec = transmit_sec - SNTP_UNIX_EPOCH + ms / 1000;
+  sample_msec = ms % 1000;
+  sample_millis = now;
+
+  return true;
+}
@@ -0,0 +1,145 @@
+/* -*- c++ -*-
+ *
+ * SNTP.h
+ *
+ * Author: Markku Rossi <mtr@iki.fi>
+ *
+ * Copyright (c) 2012 Markku Rossi
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SNTP_H
+#define SNTP_H
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include <Ethernet.h>
+#include <EthernetUdp.h>
+#include <Time.h>
+
+/* The NTP server port. */
+#define SNTP_PORT 123
+
+/* The length of the NTP message. */
+#define SNTP_MESSAGE_LEN 48
+
+/* The time to wait for the server's response in milliseconds. */
+#define SNTP_TIMEOUT 2000
+
+/* The backoff after failed requests in milliseconds.  The backoff
+   doubles after each failure up to the maximum. */
+#define SNTP_MIN_BACKOFF 4000L
+#define SNTP_MAX_BACKOFF 256000L
+
+/* SNTP (RFC 4330) client.  The client does not block: request()
+   sends a request and poll() processes the response when it
+   arrives.  The response's server timestamps and the local round
+   trip time give the time at the response's arrival with the network
+   delay compensated.  Failed requests back off exponentially. */
+class SNTP
+{
+public:
+
+  SNTP();
+
+  /* Start the client with the NTP server `server'.  The client
+     receives the responses at the UDP port `local_port'.  This
+     instance becomes the instance of provider(). */
+  void begin(IPAddress server, uint16_t local_port);
+
+  /* Start the client with the NTP server `server' on the UDP socket
+     `udp' instead of the client's own Ethernet socket.  This allows
+     running the client over any UDP implementation, e.g. a fake
+     server for testing. */
+  void begin(UDP *udp, IPAddress server, uint16_t local_port);
+
+  /* Send a request to the server unless a request is already pending
+     or the client is backing off after a failure. */
+  void request(void);
+
+  /* Process the server's response.  The method returns true if a new
+     time sample was received. */
+  bool poll(void);
+
+  /* Tests if a request is pending. */
+  bool pending(void);
+
+  /* Gets the current UTC time from the last time sample.  The method
+     returns the time in seconds and its milliseconds in
+     `msec_return', or 0 if no sample has been received. */
+  unsigned long get_time(uint16_t *msec_return);
+
+  /* The network round trip delay of the last sample in
+     milliseconds. */
+  unsigned long round_trip(void);
+
+  /* Time provider for setSyncProvider().  The provider polls the
+     instance of the last begin() and returns the time when a new
+     sample arrives.  Otherwise it starts a request and returns 0 so
+     that the Time library keeps polling. */
+  static time_t provider(void);
+
+private:
+
+  /* Request failed; back off. */
+  void failed(void);
+
+  /* Process the response `msg'.  The method returns true if the
+     response was valid. */
+  bool process(uint8_t *msg);
+
+  /* The socket of the client and the default Ethernet socket. */
+  UDP *udp;
+  EthernetUDP ethernet_udp;
+
+  /* The NTP server. */
+  IPAddress server;
+
+  /* Is a request pending? */
+  bool waiting;
+
+  /* The millis() when the pending request was sent and the random
+     part of its transmit timestamp.  The server returns the transmit
+     timestamp as the originate timestamp of the response. */
+  unsigned long sent_millis;
+  uint32_t nonce;
+
+  /* The current backoff and the millis() of the last failure. */
+  unsigned long backoff;
+  unsigned long failed_millis;
+
+  /* The last time sample and the millis() it was taken. */
+  unsigned long sample_sec;
+  uint16_t sample_msec;
+  unsigned long sample_millis;
+  bool have_sample;
+
+  /* Has provider() returned the last sample? */
+  bool fresh;
+
+  /* The round trip delay of the last sample. */
+  unsigned long rtt;
+
+  /* The instance of provider(). */
+  static SNTP *instance;
+};
+
+#endif /* not SNTP_H */
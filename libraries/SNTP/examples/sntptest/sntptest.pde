@@ -0,0 +1,257 @@
+#include <SPI.h>
+#include <Ethernet.h>
+#include <EthernetUdp.h>
+#include <GetPut.h>
+#include <Time.h>
+#include <SNTP.h>
+
+/* Checks the SNTP client against a fake NTP server that runs in the
+   sketch itself, so no network is needed.  The server answers each
+   request after the configured one-way delays and hold time.  It can
+   also drop the request, forge the originate timestamp, or send a
+   Kiss-o'-Death. */
+
+/* The fake server's clock at millis() 0: 2012-10-12 00:00:00 UTC. */
+#define SERVER_EPOCH 1350000000UL
+
+/* Seconds from the NTP epoch to the Unix epoch. */
+#define NTP_UNIX_EPOCH 2208988800UL
+
+IPAddress server_ip(10, 0, 0, 1);
+
+class FakeNTPServer : public UDP {
+public:
+  /* One-way delays and the server's hold time in milliseconds. */
+  unsigned long delay_out;
+  unsigned long delay_back;
+  unsigned long hold;
+
+  /* Faults for the next request. */
+  bool drop;
+  bool forge;
+  bool kod;
+
+  /* The number of requests received. */
+  int requests;
+
+  FakeNTPServer()
+    : delay_out(0), delay_back(0), hold(0),
+      drop(false), forge(false), kod(false), requests(0),
+      request_len(0), queued(false), response_pos(0) {
+  }
+
+  uint8_t begin(uint16_t port) { return 1; }
+  void stop() {}
+
+  int beginPacket(IPAddress ip, uint16_t port) {
+    request_len = 0;
+    return 1;
+  }
+  int beginPacket(const char *host, uint16_t port) {
+    return 0;
+  }
+
+  size_t write(uint8_t byte) {
+    if (request_len >= sizeof(request))
+      return 0;
+    request[request_len++] = byte;
+    return 1;
+  }
+  size_t write(const uint8_t *buf, size_t size) {
+    size_t i;
+
+    for (i = 0; i < size && write(buf[i]); i++)
+      ;
+    return i;
+  }
+
+  int endPacket() {
+    unsigned long now = millis();
+
+    requests++;
+    if (drop) {
+      drop = false;
+      return 1;
+    }
+
+    memset(response, 0, sizeof(response));
+    response[0] = 0x24;               // LI 0, version 4, server
+    response[1] = kod ? 0 : 2;        // stratum
+    memcpy(response + 24, request + 40, 8);
+    if (forge)
+      response[31] ^= 1;
+    put_timestamp(response + 32, now + delay_out);
+    put_timestamp(response + 40, now + delay_out + hold);
+
+    forge = kod = false;
+
+    arrival = now + delay_out + hold + delay_back;
+    queued = true;
+    return 1;
+  }
+
+  int parsePacket() {
+    response_pos = sizeof(response);
+    if (!queued || (long) (millis() - arrival) < 0)
+      return 0;
+
+    queued = false;
+    response_pos = 0;
+    return sizeof(response);
+  }
+
+  int available() { return sizeof(response) - response_pos; }
+  int read() {
+    if (response_pos >= sizeof(response))
+      return -1;
+    return response[response_pos++];
+  }
+  int read(unsigned char *buf, size_t len) {
+    size_t i;
+
+    for (i = 0; i < len && response_pos < sizeof(response); i++)
+      buf[i] = response[response_pos++];
+    return i;
+  }
+  int read(char *buf, size_t len) {
+    return read((unsigned char *) buf, len);
+  }
+  int peek() {
+    if (response_pos >= sizeof(response))
+      return -1;
+    return response[response_pos];
+  }
+  void flush() {}
+
+  IPAddress remoteIP() { return server_ip; }
+  uint16_t remotePort() { return SNTP_PORT; }
+
+private:
+  /* Store the server's time at millis() `ms' as an NTP timestamp. */
+  void put_timestamp(uint8_t *buf, unsigned long ms) {
+    GetPut::put_32bit(buf, SERVER_EPOCH + NTP_UNIX_EPOCH + ms / 1000);
+    /* 2^32 / 1000 rounded up so that the milliseconds read back
+       exactly. */
+    GetPut::put_32bit(buf + 4, (ms % 1000) * 4294968UL);
+  }
+
+  uint8_t request[SNTP_MESSAGE_LEN];
+  size_t request_len;
+  uint8_t response[SNTP_MESSAGE_LEN];
+  bool queued;
+  size_t response_pos;
+  unsigned long arrival;
+};
+
+FakeNTPServer fake;
+SNTP sntp;
+
+void check(const char *label, bool ok) {
+  Serial.print(label);
+  Serial.println(ok ? " ok" : " FAILED");
+}
+
+/* Poll the client for at most `ms' milliseconds.  Returns true if a
+   time sample was received. */
+bool run(unsigned long ms) {
+  unsigned long start = millis();
+
+  while (millis() - start < ms) {
+    if (sntp.poll())
+      return true;
+    delay(1);
+  }
+  return false;
+}
+
+/* The error of the client's time against the server's clock, in
+   milliseconds. */
+long time_error() {
+  unsigned long now = millis();
+  uint16_t msec;
+  unsigned long sec = sntp.get_time(&msec);
+
+  return (long) (sec - SERVER_EPOCH - now / 1000) * 1000L
+    + (long) msec - (long) (now % 1000);
+}
+
+/* Request a sample over paths of `out' and `back' ms with the server
+   holding the request for `hold' ms. */
+void check_delay(const char *label, unsigned long out, unsigned long back,
+                 unsigned long hold) {
+  long expected = ((long) out - (long) back) / 2;
+  long error;
+  bool ok;
+
+  fake.delay_out = out;
+  fake.delay_back = back;
+  fake.hold = hold;
+
+  sntp.request();
+  ok = run(SNTP_TIMEOUT);
+  error = time_error();
+
+  Serial.print(label);
+  Serial.print(": rtt ");
+  Serial.print(sntp.round_trip());
+  Serial.print(" ms, error ");
+  Serial.print(error);
+  Serial.println(" ms");
+
+  /* The client can not see the path asymmetry; the rest is
+     compensated to a few milliseconds. */
+  check(label, ok && sntp.round_trip() >= out + back - 2
+        && sntp.round_trip() <= out + back + 2
+        && error >= expected - 3 && error <= expected + 3);
+}
+
+void setup() {
+  int requests;
+
+  Serial.begin(9600);
+
+  sntp.begin(&fake, server_ip, 8888);
+
+  check_delay("symmetric", 80, 80, 7);
+  check_delay("asymmetric", 40, 120, 7);
+  check_delay("long hold", 20, 20, 300);
+
+  /* A response that does not echo our transmit timestamp is ignored
+     and the request times out. */
+  fake.delay_out = fake.delay_back = 10;
+  fake.hold = 0;
+  fake.forge = true;
+  sntp.request();
+  check("forged originate", !run(SNTP_TIMEOUT + 100) && !sntp.pending());
+
+  /* The failure backs off 4 seconds. */
+  requests = fake.requests;
+  sntp.request();
+  check("backoff", fake.requests == requests && !sntp.pending());
+  delay(SNTP_MIN_BACKOFF);
+
+  /* A lost request times out and doubles the backoff. */
+  fake.drop = true;
+  sntp.request();
+  check("dropped", !run(SNTP_TIMEOUT + 100) && !sntp.pending());
+  requests = fake.requests;
+  delay(SNTP_MIN_BACKOFF);
+  sntp.request();
+  check("backoff doubled", fake.requests == requests);
+  delay(SNTP_MIN_BACKOFF);
+  sntp.request();
+  check("backoff expired", fake.requests == requests + 1 && sntp.pending());
+  check("recovered", run(SNTP_TIMEOUT));
+
+  /* Kiss-o'-Death stops the requests for the maximum backoff. */
+  fake.kod = true;
+  sntp.request();
+  check("kiss-o'-death", !run(SNTP_TIMEOUT) && !sntp.pending());
+  requests = fake.requests;
+  delay(4 * SNTP_MIN_BACKOFF);
+  sntp.request();
+  check("kiss-o'-death backoff", fake.requests == requests);
+}
+
+void loop() {
+}
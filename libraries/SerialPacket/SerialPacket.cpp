@@ -8,62 +8,110 @@
 #define SP_SEP 0x80
 #define SP_HDR 0x81
 #define SP_TRL 0x82
+#define SP_HDR_FEC 0x83
 #define SP_ESC 0xfe
 
-SerialPacket::SerialPacket(SoftwareSerial *serial)
-  : serial(serial),
-    bufpos(0)
+/* Hamming(7,4) codewords for data nibbles.  The codeword bits 0-6
+   are the positions 1-7 of the code: p1 p2 d1 p3 d2 d3 d4. */
+const static uint8_t hamming_encode[16] PROGMEM =
+  {
+    0x00, 0x07, 0x19, 0x1e, 0x2a, 0x2d, 0x33, 0x34,
+    0x4b, 0x4c, 0x52, 0x55, 0x61, 0x66, 0x78, 0x7f,
+  };
+
+/* Data nibbles for all 7-bit input values.  Any single bit error in
+   a codeword is corrected by this table. */
+const static uint8_t hamming_decode[128] PROGMEM =
+  {
+    0x0, 0x0, 0x0, 0x1, 0x0, 0x1, 0x1, 0x1,
+    0x0, 0x2, 0x4, 0x8, 0x9, 0x5, 0x3, 0x1,
+    0x0, 0x2, 0xa, 0x6, 0x7, 0xb, 0x3, 0x1,
+    0x2, 0x2, 0x3, 0x2, 0x3, 0x2, 0x3, 0x3,
+    0x0, 0xc, 0x4, 0x6, 0x7, 0x5, 0xd, 0x1,
+    0x4, 0x5, 0x4, 0x4, 0x5, 0x5, 0x4, 0x5,
+    0x7, 0x6, 0x6, 0x6, 0x7, 0x7, 0x7, 0x6,
+    0xe, 0x2, 0x4, 0x6, 0x7, 0x5, 0x3, 0xf,
+    0x0, 0xc, 0xa, 0x8, 0x9, 0xb, 0xd, 0x1,
+    0x9, 0x8, 0x8, 0x8, 0x9, 0x9, 0x9, 0x8,
+    0xa, 0xb, 0xa, 0xa, 0xb, 0xb, 0xa, 0xb,
+    0xe, 0x2, 0xa, 0x8, 0x9, 0xb, 0x3, 0xf,
+    0xc, 0xc, 0xd, 0xc, 0xd, 0xc, 0xd, 0xd,
+    0xe, 0xc, 0x4, 0x8, 0x9, 0x5, 0xd, 0xf,
+    0xe, 0xc, 0xa, 0x6, 0x7, 0xb, 0xd, 0xf,
+    0xe, 0xe, 0xe, 0xf, 0xe, 0xf, 0xf, 0xf,
+  };
+
+/* Transmit states. */
+#define TX_IDLE		0
+#define TX_HEADER	1
+#define TX_LENGTH	2
+#define TX_DATA		3
+#define TX_FEC		4
+#define TX_TRAILER	5
+#define TX_CRC		6
+
+static uint32_t
+compute_crc(const uint8_t *data, size_t data_len)
 {
-}
-
-bool
-SerialPacket::send(uint8_t *data, size_t data_len)
-{
-  size_t i;
   uint32_t crc = 0;
+  size_t i;
 
-  if (data_len > sizeof(buffer))
-    return false;
+  for (i = 0; i < data_len; i++)
+    crc = (crc << 8) + data[i] + (crc >> 11);
 
-  /* Write header. */
-  serial->write(SP_SEP);
-  serial->write(SP_SEP);
-  serial->write(SP_SEP);
-  serial->write(SP_HDR);
+  return crc;
+}
 
-  /* Data length. */
-  serial->write((char) data_len);
+/* The usable length of a packet buffer of `len' bytes. */
+static size_t
+buffer_len(size_t len)
+{
+  return len > SERIAL_PACKET_MAX_LEN ? SERIAL_PACKET_MAX_LEN : len;
+}
 
-  /* Write data escaping separators and escape bytes. */
-  for (i = 0; i < data_len; i++)
-    {
-      crc = (crc << 8) + data[i] + (crc >> 11);
+SerialPacket::SerialPacket(SoftwareSerial *serial, uint8_t *rx_buffer,
+                           size_t rx_buffer_len, uint8_t *tx_buffers,
+                           size_t tx_buffer_len)
+  : num_packets(0),
+    num_errors(0),
+    num_corrected(0),
+    num_oversize(0),
+    serial(serial),
+    fec(false),
+    rx_block_pos(0),
+    rx_buffer(rx_buffer),
+    rx_buffer_len(rx_buffer ? buffer_len(rx_buffer_len) : 0),
+    tx_buffers(tx_buffers),
+    tx_buffer_len(tx_buffers ? buffer_len(tx_buffer_len) : 0),
+    tx_build(0),
+    bufpos(0),
+    tx_data(0),
+    tx_len(0),
+    tx_crc(0),
+    tx_state(TX_IDLE),
+    tx_pos(0),
+    tx_escape(0),
+    tx_fec(false),
+    tx_block_pos(0)
+{
+}
 
-      switch (data[i])
-        {
-        case SP_SEP:
-          serial->write(SP_ESC);
-          serial->write(0x1);
-          break;
-
-        case SP_ESC:
-          serial->write(SP_ESC);
-          serial->write(0x2);
-          break;
-
-        default:
-          serial->write(data[i]);
-        }
-    }
+void
+SerialPacket::set_fec(bool enabled)
+{
+  fec = enabled;
+}
 
-  /* Trailer. */
-  serial->write(SP_SEP);
+bool
+SerialPacket::send(uint8_t *data, size_t data_len)
+{
+  /* The length byte does not carry longer packets. */
+  if (data_len > SERIAL_PACKET_MAX_LEN)
+    return false;
 
-  /* CRC. */
-  serial->write((crc >> 24) & 0xff);
-  serial->write((crc >> 16) & 0xff);
-  serial->write((crc >> 8) & 0xff);
-  serial->write(crc & 0xff);
+  flush();
+  start(data, data_len);
+  flush();
 
   return true;
 }
@@ -71,75 +119,120 @@ SerialPacket::send(uint8_t *data, size_t data_len)
 uint8_t *
 SerialPacket::receive(size_t *len_return)
 {
-  uint8_t last = SP_SEP + 1;
+  uint8_t last;
   uint8_t byte;
-  size_t i;
+  size_t i, len;
+  uint32_t crc, val;
+
+  if (rx_buffer == 0)
+    return 0;
 
   /* Read until we find a valid packet. */
   while (true)
     {
-      uint32_t crc = 0;
+      crc = 0;
 
       /* Read until we find the header. */
+      last = SP_SEP + 1;
       while (true)
         {
-          byte = serial->read();
-          if (last == SP_SEP && byte == SP_HDR)
+          byte = read_byte();
+          if (last == SP_SEP && (byte == SP_HDR || byte == SP_HDR_FEC))
             break;
 
           last = byte;
         }
 
-      /* Read data length. */
-      last = serial->read();
-
-      /* Read data. */
-      for (i = 0; i < last; i++)
+      if (byte == SP_HDR_FEC)
         {
-          byte = serial->read();
-          if (byte == SP_ESC)
+          /* Start from an empty FEC block. */
+          rx_block_pos = SERIAL_PACKET_FEC_BLOCK;
+
+          len = fec_read();
+          if (len > rx_buffer_len)
             {
-              byte = serial->read();
-              switch (byte)
-                {
-                case 0x1:
-                  byte = SP_SEP;
-                  break;
+              num_oversize++;
+              continue;
+            }
 
-                case 0x2:
-                  byte = SP_ESC;
-                  break;
-                }
+          for (i = 0; i < len; i++)
+            {
+              byte = fec_read();
+              crc = (crc << 8) + byte + (crc >> 11);
+              rx_buffer[i] = byte;
             }
 
-          crc = (crc << 8) + byte + (crc >> 11);
+          val = fec_read();
+          val <<= 8;
+          val |= fec_read();
+          val <<= 8;
+          val |= fec_read();
+          val <<= 8;
+          val |= fec_read();
 
-          buffer[i] = byte;
+          /* Read trailer. */
+          if (read_byte() != SP_SEP || read_byte() != SP_TRL)
+            {
+              num_errors++;
+              continue;
+            }
         }
+      else
+        {
+          /* Read data length. */
+          len = read_byte();
+          if (len > rx_buffer_len)
+            {
+              num_oversize++;
+              continue;
+            }
 
-      /* Read trailer. */
+          /* Read data. */
+          for (i = 0; i < len; i++)
+            {
+              byte = read_byte();
+              if (byte == SP_ESC)
+                {
+                  byte = read_byte();
+                  switch (byte)
+                    {
+                    case 0x1:
+                      byte = SP_SEP;
+                      break;
+
+                    case 0x2:
+                      byte = SP_ESC;
+                      break;
+                    }
+                }
 
-      if (serial->read() != SP_SEP)
-        {
-          num_errors++;
-          continue;
-        }
-      if (serial->read() != SP_TRL)
-        {
-          num_errors++;
-          continue;
-        }
+              crc = (crc << 8) + byte + (crc >> 11);
+
+              rx_buffer[i] = byte;
+            }
 
-      /* Read crc. */
-      uint32_t val;
+          /* Read trailer. */
+
+          if (read_byte() != SP_SEP)
+            {
+              num_errors++;
+              continue;
+            }
+          if (read_byte() != SP_TRL)
+            {
+              num_errors++;
+              continue;
+            }
 
-      val = serial->read();
-      val <<= 8;
-      val |= serial->read();
-      val <<= 8;
-      val |= serial->read();
-      val <<= 8;
-      val |= serial->read();
+          /* Read crc. */
+          val = read_byte();
+          val <<= 8;
+          val |= read_byte();
+          val <<= 8;
+          val |= read_byte();
+          val <<= 8;
+          val |= read_byte();
+        }
 
       if (val != crc)
         {
@@ -147,11 +240,11 @@ SerialPacket::receive(size_t *len_return)
           continue;
         }
 
-      *len_return = (size_t) last;
+      *len_return = len;
 
       num_packets++;
 
-      return buffer;
+      return rx_buffer;
     }
 }
 
@@ -164,7 +257,9 @@ SerialPacket::clear(void)
 bool
 SerialPacket::add_message(uint8_t type, const uint8_t *data, size_t data_len)
 {
-  if (bufpos + 2 + data_len > sizeof(buffer))
+  uint8_t *buffer = tx_buffers + tx_build * tx_buffer_len;
+
+  if (bufpos + 2 + data_len > tx_buffer_len)
     return false;
   if (data_len > 0xff)
     return false;
@@ -181,7 +276,9 @@ SerialPacket::add_message(uint8_t type, const uint8_t *data, size_t data_len)
 bool
 SerialPacket::add_message(uint8_t type, uint32_t value)
 {
-  if (bufpos + 6 > sizeof(buffer))
+  uint8_t *buffer = tx_buffers + tx_build * tx_buffer_len;
+
+  if (bufpos + 6 > tx_buffer_len)
     return false;
 
   buffer[bufpos++] = type;
@@ -193,10 +290,84 @@ SerialPacket::add_message(uint8_t type, uint32_t value)
   return true;
 }
 
+bool
+SerialPacket::add_mac(uint8_t type, const uint8_t *hmac_state)
+{
+  uint8_t *buffer = tx_buffers + tx_build * tx_buffer_len;
+
+  if (bufpos + 2 + SERIAL_PACKET_MAC_LEN > tx_buffer_len)
+    return false;
+
+  Sha1.initHmac(hmac_state);
+  Sha1.write(buffer, bufpos);
+
+  return add_message(type, Sha1.resultHmac(), SERIAL_PACKET_MAC_LEN);
+}
+
 bool
 SerialPacket::send(void)
 {
-  return send(buffer, bufpos);
+  if (tx_buffers == 0)
+    return false;
+
+  flush();
+  start(tx_buffers + tx_build * tx_buffer_len, bufpos);
+
+  /* Construct the next message in the other buffer. */
+  tx_build ^= 1;
+  bufpos = 0;
+
+  return true;
+}
+
+bool
+SerialPacket::transmit(size_t count)
+{
+  while (count-- > 0 && tx_state != TX_IDLE)
+    serial->write(next_byte());
+
+  return tx_state != TX_IDLE;
+}
+
+void
+SerialPacket::flush(void)
+{
+  while (tx_state != TX_IDLE)
+    serial->write(next_byte());
+}
+
+bool
+SerialPacket::sending(void)
+{
+  return tx_state != TX_IDLE;
+}
+
+bool
+SerialPacket::verify_mac(const uint8_t *data, size_t data_len, uint8_t type,
+                         const uint8_t *hmac_state)
+{
+  size_t len;
+  uint8_t *mac;
+  uint8_t diff = 0;
+  int i;
+
+  if (data_len < 2 + SERIAL_PACKET_MAC_LEN)
+    return false;
+
+  len = data_len - 2 - SERIAL_PACKET_MAC_LEN;
+  if (data[len] != type || data[len + 1] != SERIAL_PACKET_MAC_LEN)
+    return false;
+
+  Sha1.initHmac(hmac_state);
+  Sha1.write(data, len);
+  mac = Sha1.resultHmac();
+
+  /* Compare all bytes so that the timing does not tell how much of
+     the MAC matched. */
+  for (i = 0; i < SERIAL_PACKET_MAC_LEN; i++)
+    diff |= mac[i] ^ data[len + 2 + i];
+
+  return diff == 0;
 }
 
 bool
@@ -230,3 +401,257 @@ SerialPacket::parse_message(uint8_t *type_return, uint8_t **msg_return,
 
   return true;
 }
+
+SerialPacketIterator::SerialPacketIterator(const uint8_t *data,
+                                           size_t data_len,
+                                           uint32_t value_types)
+  : valid(false),
+    type(0),
+    data(0),
+    len(0),
+    pos(data),
+    end(data)
+{
+  const uint8_t *cp = data;
+  const uint8_t *data_end = data + data_len;
+  uint8_t msg_type, msg_len;
+
+  while (cp < data_end)
+    {
+      if (data_end - cp < 2)
+        return;
+
+      msg_type = cp[0];
+      msg_len = cp[1];
+      cp += 2;
+
+      if (msg_len > data_end - cp)
+        return;
+
+      if (msg_type < 32 && (value_types & (1UL << msg_type)) && msg_len != 4)
+        return;
+
+      cp += msg_len;
+    }
+
+  valid = true;
+  end = data_end;
+}
+
+bool
+SerialPacketIterator::next(void)
+{
+  if (pos >= end)
+    return false;
+
+  type = pos[0];
+  len = pos[1];
+  data = pos + 2;
+
+  pos = data + len;
+
+  return true;
+}
+
+uint32_t
+SerialPacketIterator::value(void)
+{
+  return GetPut::get_32bit((uint8_t *) data);
+}
+
+uint8_t
+SerialPacket::read_byte(void)
+{
+  int byte;
+
+  while ((byte = serial->read()) < 0)
+    ;
+
+  return (uint8_t) byte;
+}
+
+void
+SerialPacket::start(const uint8_t *data, size_t data_len)
+{
+  tx_data = data;
+  tx_len = (uint8_t) data_len;
+  tx_crc = compute_crc(data, data_len);
+
+  tx_fec = fec;
+  tx_state = TX_HEADER;
+  tx_pos = 0;
+  tx_escape = 0;
+}
+
+uint8_t
+SerialPacket::next_byte(void)
+{
+  uint8_t byte;
+  uint8_t i;
+
+  switch (tx_state)
+    {
+    case TX_HEADER:
+      if (tx_pos < 3)
+        {
+          tx_pos++;
+          return SP_SEP;
+        }
+
+      tx_pos = 0;
+
+      if (tx_fec)
+        {
+          /* The length, data, and CRC are all protected by the FEC
+             code.  The coded bytes never have their high bit set so
+             they need no escaping. */
+          tx_state = TX_FEC;
+          tx_block_pos = 7;
+          return SP_HDR_FEC;
+        }
+
+      tx_state = TX_LENGTH;
+      return SP_HDR;
+
+    case TX_LENGTH:
+      tx_state = tx_len ? TX_DATA : TX_TRAILER;
+      return tx_len;
+
+    case TX_DATA:
+      /* Escape separators and escape bytes. */
+      if (tx_escape)
+        {
+          byte = tx_escape;
+          tx_escape = 0;
+        }
+      else
+        {
+          byte = tx_data[tx_pos++];
+          switch (byte)
+            {
+            case SP_SEP:
+              tx_escape = 0x1;
+              byte = SP_ESC;
+              break;
+
+            case SP_ESC:
+              tx_escape = 0x2;
+              byte = SP_ESC;
+              break;
+            }
+        }
+
+      if (tx_pos >= tx_len && !tx_escape)
+        {
+          tx_state = TX_TRAILER;
+          tx_pos = 0;
+        }
+      return byte;
+
+    case TX_FEC:
+      if (tx_block_pos >= 7)
+        {
+          /* Encode the next block.  The unused codewords of the last
+             block are padded with zero nibbles. */
+          for (i = 0; i < SERIAL_PACKET_FEC_BLOCK; i++)
+            tx_block[i] = pgm_read_byte(hamming_encode + tx_nibble(tx_pos++));
+
+          tx_block_pos = 0;
+        }
+
+      /* Interleave: the line byte `n' of the block carries the bit
+         `n' of each codeword. */
+      byte = 0;
+      for (i = 0; i < SERIAL_PACKET_FEC_BLOCK; i++)
+        byte |= ((tx_block[i] >> tx_block_pos) & 1) << i;
+
+      if (++tx_block_pos >= 7 && tx_pos >= 2 * (tx_len + 5))
+        {
+          tx_state = TX_TRAILER;
+          tx_pos = 0;
+        }
+      return byte;
+
+    case TX_TRAILER:
+      if (tx_pos == 0)
+        {
+          tx_pos++;
+          return SP_SEP;
+        }
+
+      /* The CRC of an FEC packet was sent inside the coded data. */
+      tx_state = tx_fec ? TX_IDLE : TX_CRC;
+      tx_pos = 0;
+      return SP_TRL;
+
+    case TX_CRC:
+      byte = (tx_crc >> (24 - 8 * tx_pos)) & 0xff;
+      if (++tx_pos >= 4)
+        tx_state = TX_IDLE;
+      return byte;
+    }
+
+  return 0;
+}
+
+uint8_t
+SerialPacket::tx_nibble(size_t index)
+{
+  size_t pos = index / 2;
+  uint8_t byte;
+
+  /* The coded data is the length byte, data, and 32-bit CRC. */
+  if (pos == 0)
+    byte = tx_len;
+  else if (pos <= tx_len)
+    byte = tx_data[pos - 1];
+  else if (pos < tx_len + 5U)
+    byte = (tx_crc >> (24 - 8 * (pos - tx_len - 1))) & 0xff;
+  else
+    return 0;
+
+  if (index & 1)
+    return byte & 0x0f;
+
+  return byte >> 4;
+}
+
+uint8_t
+SerialPacket::fec_read(void)
+{
+  uint8_t val = fec_get() << 4;
+
+  return val | fec_get();
+}
+
+uint8_t
+SerialPacket::fec_get(void)
+{
+  uint8_t line[7];
+  uint8_t i, j;
+  uint8_t codeword, nibble;
+
+  if (rx_block_pos >= SERIAL_PACKET_FEC_BLOCK)
+    {
+      for (i = 0; i < 7; i++)
+        line[i] = read_byte();
+
+      /* De-interleave and correct the codewords. */
+      for (j = 0; j < SERIAL_PACKET_FEC_BLOCK; j++)
+        {
+          codeword = 0;
+          for (i = 0; i < 7; i++)
+            codeword |= ((line[i] >> j) & 1) << i;
+
+          nibble = pgm_read_byte(hamming_decode + codeword);
+          if (pgm_read_byte(hamming_encode + nibble) != codeword)
+            num_corrected++;
+
+          rx_block[j] = nibble;
+        }
+
+      rx_block_pos = 0;
+    }
+
+  return rx_block[rx_block_pos++];
+}
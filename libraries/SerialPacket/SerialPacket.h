@@ -32,18 +32,57 @@
 #endif
 
 #include <SoftwareSerial.h>
+#include <avr/pgmspace.h>
+#include <sha1.h>
+
+/* The number of Hamming(7,4) codewords in one interleaved FEC
+   block. */
+#define SERIAL_PACKET_FEC_BLOCK 7
+
+/* The maximum packet data length that the line format carries in
+   its length byte. */
+#define SERIAL_PACKET_MAX_LEN 255
+
+/* The length of the truncated packet MAC. */
+#define SERIAL_PACKET_MAC_LEN 4
 
 class SerialPacket
 {
  public:
 
-  SerialPacket(SoftwareSerial *serial);
-
-  /* Sends the packet `data', `data_len'.  The method returns true if
-     the packet was sent and false on error. */
+  /* Create a packet channel on `serial'.  The receive buffer
+     `rx_buffer', `rx_buffer_len' is the maximum data length of the
+     received packets; longer packets are dropped and counted in
+     `num_oversize'.  The two transmit buffers `tx_buffers', each
+     `tx_buffer_len' bytes long, limit the packets constructed with
+     add_message().  The buffers are given by the caller so that a
+     receive-only user can pass 0 transmit buffers and a
+     transmit-only user 0 receive buffer and neither pays RAM for the
+     direction it does not use.  At most SERIAL_PACKET_MAX_LEN bytes
+     of each buffer are used. */
+  SerialPacket(SoftwareSerial *serial, uint8_t *rx_buffer,
+               size_t rx_buffer_len, uint8_t *tx_buffers,
+               size_t tx_buffer_len);
+
+  /* Enable or disable forward error correction for the packets sent
+     with this instance.  With FEC enabled, the packet length, data,
+     and CRC are encoded with a Hamming(7,4) code and interleaved so
+     that any single bit error, and any burst that damages at most
+     one line byte of each 7 byte block, is corrected at the
+     receiver.  FEC roughly doubles the packet's airtime.  The
+     receive() method accepts both coded and uncoded packets
+     regardless of this setting. */
+  void set_fec(bool enabled);
+
+  /* Sends the packet `data', `data_len'.  The method completes any
+     pending transmission and then writes the whole packet before it
+     returns.  The method returns true if the packet was sent and
+     false if it is longer than SERIAL_PACKET_MAX_LEN. */
   bool send(uint8_t *data, size_t data_len);
 
-  /* Receives a packet from the serial port. */
+  /* Receives a packet from the serial port.  The packets longer
+     than the receive buffer are skipped.  The method returns 0 if
+     the instance has no receive buffer. */
   uint8_t *receive(size_t *len_return);
 
   /* Clears the packet's buffer and prepare for new message
@@ -54,10 +93,47 @@ class SerialPacket
 
   bool add_message(uint8_t type, uint32_t value);
 
-  /* Sends the message that has been currenlty constructed using the
-     clear() and add_message() methods. */
+  /* Add a message of type `type' that carries the truncated
+     HMAC-SHA-1 of all messages constructed so far.  The HMAC key is
+     given as a precomputed key state `hmac_state' (see
+     Sha1Class::computeHmacState()).  This must be the last message of
+     the packet. */
+  bool add_mac(uint8_t type, const uint8_t *hmac_state);
+
+  /* Queues the message that has been currenlty constructed using the
+     clear() and add_message() methods for transmission.  The message
+     buffers are double-buffered: the queued message is written out
+     by transmit() while the next message is constructed in the other
+     buffer.  If the previous message is still being sent, the method
+     completes it first. */
   bool send(void);
 
+  /* Write at most `count' bytes of the queued packet to the serial
+     port.  SoftwareSerial writes each byte with interrupts disabled
+     so the transmission is driven from the caller's loop in small
+     chunks instead of from an interrupt handler.  The method returns
+     true if the packet has more bytes to send. */
+  bool transmit(size_t count);
+
+  /* Write all remaining bytes of the queued packet. */
+  void flush(void);
+
+  /* Tests if a packet is being sent. */
+  bool sending(void);
+
+  /* Verify the MAC of the packet `data', `data_len'.  The last
+     message of the packet must be a `type' message that holds the
+     truncated HMAC-SHA-1 of the preceding messages with the key state
+     `hmac_state'.  The method returns false if the packet has no MAC
+     or if the MAC does not match. */
+  static bool verify_mac(const uint8_t *data, size_t data_len, uint8_t type,
+                         const uint8_t *hmac_state);
+
+  /* Parse the next message from the data `datap', `data_lenp'.  The
+     method returns the message type in `type_return' and its data in
+     `msg_return', `msg_len_return', and advances `datap',
+     `data_lenp' over the message.  See also SerialPacketIterator
+     which validates the whole packet once. */
   static bool parse_message(uint8_t *type_return, uint8_t **msg_return,
                             size_t *msg_len_return,
                             uint8_t **datap, size_t *data_lenp);
@@ -68,12 +144,112 @@ class SerialPacket
   /* The number of errors received. */
   uint32_t num_errors;
 
+  /* The number of bit errors corrected by FEC. */
+  uint32_t num_corrected;
+
+  /* The number of packets dropped because they were longer than
+     the receive buffer. */
+  uint32_t num_oversize;
+
  private:
 
+  /* Start sending the packet `data', `data_len'. */
+  void start(const uint8_t *data, size_t data_len);
+
+  /* Get the next line byte of the packet being sent. */
+  uint8_t next_byte(void);
+
+  /* Get the `index'th nibble of the FEC coded part of the packet
+     being sent. */
+  uint8_t tx_nibble(size_t index);
+
+  /* Read the next byte from the serial port.  The method blocks
+     until a byte is available. */
+  uint8_t read_byte(void);
+
+  /* Read the next data byte from the FEC coded input stream. */
+  uint8_t fec_read(void);
+
+  /* Read the next data nibble from the FEC coded input stream. */
+  uint8_t fec_get(void);
+
   SoftwareSerial *serial;
 
-  uint8_t buffer[256];
+  /* Send packets with FEC? */
+  bool fec;
+
+  /* The decoded nibbles of the current received FEC block and the
+     position in the block. */
+  uint8_t rx_block[SERIAL_PACKET_FEC_BLOCK];
+  uint8_t rx_block_pos;
+
+  uint8_t *rx_buffer;
+  size_t rx_buffer_len;
+
+  /* Transmit buffers: `tx_build' is the index of the buffer for
+     message construction and `bufpos' its length. */
+  uint8_t *tx_buffers;
+  size_t tx_buffer_len;
+  uint8_t tx_build;
   size_t bufpos;
+
+  /* The packet being sent. */
+  const uint8_t *tx_data;
+  uint8_t tx_len;
+  uint32_t tx_crc;
+
+  /* Transmit state, position in the state, and pending escaped
+     byte. */
+  uint8_t tx_state;
+  size_t tx_pos;
+  uint8_t tx_escape;
+
+  /* Send with FEC?  This is latched from `fec' when a packet is
+     started. */
+  bool tx_fec;
+
+  /* The codewords of the current FEC block being sent and the index
+     of the next line byte of the block. */
+  uint8_t tx_block[SERIAL_PACKET_FEC_BLOCK];
+  uint8_t tx_block_pos;
+};
+
+/* Iterator over the messages of a received packet.  The iterator
+   points into the packet data and does not copy the messages. */
+class SerialPacketIterator
+{
+ public:
+
+  /* Construct an iterator over the packet `data', `data_len'.  The
+     constructor validates the whole packet: the message lengths must
+     add up to the packet length, and the messages whose type bit `1
+     << type' is set in `value_types' must have 4 byte values.  The
+     result is stored in `valid'.  The iterator of an invalid packet
+     returns no messages. */
+  SerialPacketIterator(const uint8_t *data, size_t data_len,
+                       uint32_t value_types);
+
+  /* Move to the next message.  The method returns false if there are
+     no more messages. */
+  bool next(void);
+
+  /* Get the 32-bit value of the current message.  This must only be
+     called for the message types of `value_types'. */
+  uint32_t value(void);
+
+  /* Is the packet well-formed? */
+  bool valid;
+
+  /* The type, data, and data length of the current message. */
+  uint8_t type;
+  const uint8_t *data;
+  uint8_t len;
+
+ private:
+
+  /* The next message and the end of the packet. */
+  const uint8_t *pos;
+  const uint8_t *end;
 };
 
 #endif /* not SERIALPACKET_H */
@@ -138,6 +138,7 @@ void Sha1Class::initHmac(const uint8_t* key, int keyLength) {
     memcpy(keyBuffer,key,keyLength);
   }
   //for (i=0; i<BLOCK_LENGTH; i++) debugHH(keyBuffer[i]);
+  precomputedKey = false;
   // Start inner hash
   init();
   for (i=0; i<BLOCK_LENGTH; i++) {
@@ -145,6 +146,28 @@ void Sha1Class::initHmac(const uint8_t* key, int keyLength) {
   }
 }
 
+void Sha1Class::computeHmacState(const uint8_t* key, int keyLength,
+                                 uint8_t* hmacState) {
+  uint8_t i;
+  // The inner state is the state after the ipad block
+  initHmac(key,keyLength);
+  memcpy(hmacState,state.b,HASH_LENGTH);
+  // The outer state is the state after the opad block
+  init();
+  for (i=0; i<BLOCK_LENGTH; i++) write(keyBuffer[i] ^ HMAC_OPAD);
+  memcpy(hmacState+HASH_LENGTH,state.b,HASH_LENGTH);
+}
+
+void Sha1Class::initHmac(const uint8_t* hmacState) {
+  // Resume inner hash after the ipad block, keep the outer state
+  // for resultHmac()
+  memcpy(state.b,hmacState,HASH_LENGTH);
+  byteCount = BLOCK_LENGTH;
+  bufferOffset = 0;
+  memcpy(keyBuffer,hmacState+HASH_LENGTH,HASH_LENGTH);
+  precomputedKey = true;
+}
+
 uint8_t* Sha1Class::resultHmac(void) {
   uint8_t i;
     // Complete inner hash
@@ -152,8 +175,14 @@ uint8_t* Sha1Class::resultHmac(void) {
   // now innerHash[] contains H((K0 xor ipad)||text)
 
   // Calculate outer hash
-  init();
-  for (i=0; i<BLOCK_LENGTH; i++) write(keyBuffer[i] ^ HMAC_OPAD);
+  if (precomputedKey) {
+    memcpy(state.b,keyBuffer,HASH_LENGTH);
+    byteCount = BLOCK_LENGTH;
+    bufferOffset = 0;
+  } else {
+    init();
+    for (i=0; i<BLOCK_LENGTH; i++) write(keyBuffer[i] ^ HMAC_OPAD);
+  }
   for (i=0; i<HASH_LENGTH; i++) write(innerHash[i]);
   return result();
 }
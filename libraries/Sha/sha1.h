@@ -7,6 +7,10 @@
 #define HASH_LENGTH 20
 #define BLOCK_LENGTH 64
 
+// Precomputed HMAC key state: the inner and outer hash states after
+// the key blocks
+#define HMAC_STATE_LENGTH (2*HASH_LENGTH)
+
 union _buffer {
   uint8_t b[BLOCK_LENGTH];
   uint32_t w[BLOCK_LENGTH/4];
@@ -21,6 +25,9 @@ class Sha1Class : public Print
   public:
     void init(void);
     void initHmac(const uint8_t* secret, int secretLength);
+    void computeHmacState(const uint8_t* secret, int secretLength,
+                          uint8_t* hmacState);
+    void initHmac(const uint8_t* hmacState);
     uint8_t* result(void);
     uint8_t* resultHmac(void);
     virtual size_t write(uint8_t);
@@ -36,6 +43,7 @@ class Sha1Class : public Print
     uint32_t byteCount;
     uint8_t keyBuffer[BLOCK_LENGTH];
     uint8_t innerHash[HASH_LENGTH];
+    bool precomputedKey;
 
 };
 extern Sha1Class Sha1;
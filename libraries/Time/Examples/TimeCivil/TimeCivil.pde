@@ -0,0 +1,144 @@
+/*
+ * TimeCivil.pde
+ * checks the constant time date conversions against the original
+ * loop based breakTime() and makeTime() for every day of the time_t range.
+ *
+ * The check takes a few minutes; the result is printed to the serial port.
+ */
+
+#include <Time.h>
+
+// leap year calulator expects year argument as years offset from 1970
+#define LEAP_YEAR(Y)     ( ((1970+Y)>0) && !((1970+Y)%4) && ( ((1970+Y)%100) || !((1970+Y)%400) ) )
+
+static  const uint8_t monthDays[]={31,28,31,30,31,30,31,31,30,31,30,31}; // API starts months from 1, this array starts from 0
+
+void oldBreakTime(time_t time, tmElements_t &tm){
+// the original breakTime() that loops over the years and months
+  uint8_t year;
+  uint8_t month, monthLength;
+  unsigned long days;
+
+  tm.Second = time % 60;
+  time /= 60; // now it is minutes
+  tm.Minute = time % 60;
+  time /= 60; // now it is hours
+  tm.Hour = time % 24;
+  time /= 24; // now it is days
+  tm.Wday = ((time + 4) % 7) + 1;  // Sunday is day 1
+
+  year = 0;
+  days = 0;
+  while((unsigned)(days += (LEAP_YEAR(year) ? 366 : 365)) <= time) {
+    year++;
+  }
+  tm.Year = year; // year is offset from 1970
+
+  days -= LEAP_YEAR(year) ? 366 : 365;
+  time  -= days; // now it is days in this year, starting at 0
+
+  for (month=0; month<12; month++) {
+    if (month==1) { // february
+      monthLength = LEAP_YEAR(year) ? 29 : 28;
+    } else {
+      monthLength = monthDays[month];
+    }
+
+    if (time >= monthLength) {
+      time -= monthLength;
+    } else {
+      break;
+    }
+  }
+  tm.Month = month + 1;  // jan is month 1
+  tm.Day = time + 1;     // day of month
+}
+
+time_t oldMakeTime(tmElements_t &tm){
+// the original makeTime() that loops over the years and months
+  int i;
+  time_t seconds;
+
+  // seconds from 1970 till 1 jan 00:00:00 of the given year
+  seconds= tm.Year*(SECS_PER_DAY * 365);
+  for (i = 0; i < tm.Year; i++) {
+    if (LEAP_YEAR(i)) {
+      seconds +=  SECS_PER_DAY;   // add extra days for leap years
+    }
+  }
+
+  // add days for this year, months start from 1
+  for (i = 1; i < tm.Month; i++) {
+    if ( (i == 2) && LEAP_YEAR(tm.Year)) {
+      seconds += SECS_PER_DAY * 29;
+    } else {
+      seconds += SECS_PER_DAY * monthDays[i-1];  //monthDay array starts from 0
+    }
+  }
+  seconds+= (tm.Day-1) * SECS_PER_DAY;
+  seconds+= tm.Hour * SECS_PER_HOUR;
+  seconds+= tm.Minute * SECS_PER_MIN;
+  seconds+= tm.Second;
+  return seconds;
+}
+
+unsigned long failures = 0;
+
+void fail(const char *what, time_t t){
+  if (failures++ < 10) {
+    Serial.print(what);
+    Serial.print(" failed at ");
+    Serial.println(t);
+  }
+}
+
+// check the time t against the original implementation
+void check(time_t t){
+  tmElements_t tm, oldTm;
+  int y;
+  uint8_t m, d;
+
+  breakTime(t, tm);
+  oldBreakTime(t, oldTm);
+  if (memcmp(&tm, &oldTm, sizeof(tm)) != 0)
+    fail("breakTime", t);
+  if (makeTime(tm) != t || oldMakeTime(oldTm) != t)
+    fail("makeTime", t);
+
+  civilFromDays(elapsedDays(t), y, m, d);
+  if (y != tmYearToCalendar(oldTm.Year) || m != oldTm.Month || d != oldTm.Day)
+    fail("civilFromDays", t);
+  if (daysFromCivil(y, m, d) != elapsedDays(t))
+    fail("daysFromCivil", t);
+}
+
+void setup()  {
+  unsigned long days;
+  unsigned long lastDay = 0xffffffffUL / SECS_PER_DAY;
+  time_t t;
+
+  Serial.begin(9600);
+  Serial.println("Checking every day from 1970 to 2106");
+
+  for (days = 0; days <= lastDay; days++) {
+    t = days * SECS_PER_DAY;
+
+    // the first and the last second of the day and a time between
+    check(t);
+    check(t + (days * 7919UL) % SECS_PER_DAY);
+    if (days < lastDay)
+      check(t + SECS_PER_DAY - 1);
+
+    if (days % 3653 == 0) {
+      Serial.print(year(t));
+      Serial.println("...");
+    }
+  }
+  check(0xffffffffUL);
+
+  Serial.print(failures);
+  Serial.println(" failures");
+}
+
+void loop(){
+}
@@ -31,14 +31,63 @@
 
 static tmElements_t tm;          // a cache of time elements
 static time_t       cacheTime;   // the time the cache was updated
+static uint8_t      cacheValid;  // has the cache been set
 static time_t       syncInterval = 300;  // time sync will be attempted after this many seconds
 
+static uint8_t monthLength(uint8_t year, uint8_t month){
+// the number of days in the month, year is offset from 1970
+  int y = tmYearToCalendar(year);
+
+  if (month == 2)
+    return (y % 4 == 0 && (y % 100 != 0 || y % 400 == 0)) ? 29 : 28;
+  return 30 + ((month + (month >> 3)) & 1);
+}
+
 void refreshCache( time_t t){
-  if( t != cacheTime)
+  unsigned int secs;
+  unsigned int mins;
+
+  if (cacheValid && t == cacheTime)
+    return;
+
+  if (cacheValid && t > cacheTime && t - cacheTime < SECS_PER_HOUR)
+  {
+    // roll the cached fields forward, this carries at most one
+    // hour, day, month, and year
+    secs = tm.Second + (unsigned int) (t - cacheTime);
+    mins = tm.Minute + secs / 60;
+    tm.Second = secs % 60;
+    if (mins >= 60) {
+      mins -= 60;
+      if (++tm.Hour >= 24) {
+        tm.Hour = 0;
+        tm.Wday = tm.Wday % 7 + 1;
+        if (++tm.Day > monthLength(tm.Year, tm.Month)) {
+          tm.Day = 1;
+          if (++tm.Month > 12) {
+            tm.Month = 1;
+            tm.Year++;
+          }
+        }
+      }
+    }
+    tm.Minute = mins;
+  }
+  else
   {
     breakTime(t, tm);
-    cacheTime = t;
   }
+  cacheTime = t;
+  cacheValid = true;
+}
+
+void snapshot(tmElements_t &elements){ // all time elements now
+  snapshot(now(), elements);
+}
+
+void snapshot(time_t t, tmElements_t &elements){ // all time elements for the given time
+  refreshCache(t);
+  elements = tm;
 }
 
 int hour() { // the hour now
@@ -138,60 +187,66 @@ int year(time_t t) { // the year for the given time
 /* functions to convert to and from system time */
 /* These are for interfacing with time serivces and are not normally needed in a sketch */
 
-// leap year calulator expects year argument as years offset from 1970
-#define LEAP_YEAR(Y)     ( ((1970+Y)>0) && !((1970+Y)%4) && ( ((1970+Y)%100) || !((1970+Y)%400) ) )
+// The civil date conversions count days from 1 March so that the leap
+// day is the last day of the year, and split the years into 400 year
+// eras of 146097 days.  Both conversions take constant time.
+
+// days from 1970-01-01 to 0000-03-01
+#define DAYS_TO_EPOCH 719468UL
+#define DAYS_PER_ERA  146097UL
+
+unsigned long daysFromCivil(int y, uint8_t m, uint8_t d){
+// days since 1 Jan 1970 of the date y-m-d, y >= 1970 (full year), jan is month 1
+  unsigned int era, yoe, doy;
+  unsigned long doe;
 
-static  const uint8_t monthDays[]={31,28,31,30,31,30,31,31,30,31,30,31}; // API starts months from 1, this array starts from 0
+  if (m <= 2)
+    y--;
+  era = y / 400;
+  yoe = y - era * 400;                                  // [0, 399]
+  doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1; // [0, 365]
+  doe = yoe * 365UL + yoe / 4 - yoe / 100 + doy;        // [0, 146096]
+
+  return era * DAYS_PER_ERA + doe - DAYS_TO_EPOCH;
+}
+
+void civilFromDays(unsigned long days, int &y, uint8_t &m, uint8_t &d){
+// the date y-m-d of the given days since 1 Jan 1970
+  unsigned int era, yoe, doy, mp;
+  unsigned long doe;
+
+  days += DAYS_TO_EPOCH;
+  era = days / DAYS_PER_ERA;
+  doe = days - era * DAYS_PER_ERA;                      // [0, 146096]
+  yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365; // [0, 399]
+  doy = doe - (yoe * 365UL + yoe / 4 - yoe / 100);      // [0, 365]
+  mp = (5 * doy + 2) / 153;                             // [0, 11], march is 0
+  d = doy - (153 * mp + 2) / 5 + 1;
+  m = mp < 10 ? mp + 3 : mp - 9;
+  y = era * 400 + yoe + (m <= 2);
+}
 
 void breakTime(time_t time, tmElements_t &tm){
 // break the given time_t into time components
 // this is a more compact version of the C library localtime function
 // note that year is offset from 1970 !!!
 
-  uint8_t year;
-  uint8_t month, monthLength;
   unsigned long days;
+  unsigned long secs;
+  unsigned int rest;
+  int year;
 
-  tm.Second = time % 60;
-  time /= 60; // now it is minutes
-  tm.Minute = time % 60;
-  time /= 60; // now it is hours
-  tm.Hour = time % 24;
-  time /= 24; // now it is days
-  tm.Wday = ((time + 4) % 7) + 1;  // Sunday is day 1
-
-  year = 0;
-  days = 0;
-  while((unsigned)(days += (LEAP_YEAR(year) ? 366 : 365)) <= time) {
-    year++;
-  }
-  tm.Year = year; // year is offset from 1970
-
-  days -= LEAP_YEAR(year) ? 366 : 365;
-  time  -= days; // now it is days in this year, starting at 0
-
-  days=0;
-  month=0;
-  monthLength=0;
-  for (month=0; month<12; month++) {
-    if (month==1) { // february
-      if (LEAP_YEAR(year)) {
-        monthLength=29;
-      } else {
-        monthLength=28;
-      }
-    } else {
-      monthLength = monthDays[month];
-    }
+  days = time / SECS_PER_DAY;
+  secs = time - days * SECS_PER_DAY;
 
-    if (time >= monthLength) {
-      time -= monthLength;
-    } else {
-        break;
-    }
-  }
-  tm.Month = month + 1;  // jan is month 1
-  tm.Day = time + 1;     // day of month
+  tm.Hour = secs / SECS_PER_HOUR;
+  rest = secs - tm.Hour * SECS_PER_HOUR; // seconds in the hour fit in 16 bits
+  tm.Minute = rest / 60;
+  tm.Second = rest - tm.Minute * 60;
+  tm.Wday = ((days + 4) % 7) + 1;  // Sunday is day 1
+
+  civilFromDays(days, year, tm.Month, tm.Day);
+  tm.Year = CalendarYrToTm(year); // year is offset from 1970
 }
 
 time_t makeTime(tmElements_t &tm){
@@ -199,26 +254,10 @@ time_t makeTime(tmElements_t &tm){
 // note year argument is offset from 1970 (see macros in time.h to convert to other formats)
 // previous version used full four digit year (or digits since 2000),i.e. 2009 was 2009 or 9
 
-  int i;
   time_t seconds;
 
-  // seconds from 1970 till 1 jan 00:00:00 of the given year
-  seconds= tm.Year*(SECS_PER_DAY * 365);
-  for (i = 0; i < tm.Year; i++) {
-    if (LEAP_YEAR(i)) {
-      seconds +=  SECS_PER_DAY;   // add extra days for leap years
-    }
-  }
-
-  // add days for this year, months start from 1
-  for (i = 1; i < tm.Month; i++) {
-    if ( (i == 2) && LEAP_YEAR(tm.Year)) {
-      seconds += SECS_PER_DAY * 29;
-    } else {
-      seconds += SECS_PER_DAY * monthDays[i-1];  //monthDay array starts from 0
-    }
-  }
-  seconds+= (tm.Day-1) * SECS_PER_DAY;
+  seconds = daysFromCivil(tmYearToCalendar(tm.Year), tm.Month, tm.Day)
+    * SECS_PER_DAY;
   seconds+= tm.Hour * SECS_PER_HOUR;
   seconds+= tm.Minute * SECS_PER_MIN;
   seconds+= tm.Second;
@@ -275,17 +314,19 @@ void setTime(time_t t){
 void  setTime(int hr,int min,int sec,int dy, int mnth, int yr){
  // year can be given as full four digit year or two digts (2010 or 10 for 2010);
  //it is converted to years since 1970
+  tmElements_t elements; // do not clobber the cache
+
   if( yr > 99)
       yr = yr - 1970;
   else
       yr += 30;
-  tm.Year = yr;
-  tm.Month = mnth;
-  tm.Day = dy;
-  tm.Hour = hr;
-  tm.Minute = min;
-  tm.Second = sec;
-  setTime(makeTime(tm));
+  elements.Year = yr;
+  elements.Month = mnth;
+  elements.Day = dy;
+  elements.Hour = hr;
+  elements.Minute = min;
+  elements.Second = sec;
+  setTime(makeTime(elements));
 }
 
 void adjustTime(long adjustment){
@@ -89,6 +89,8 @@ int     month();           // the month now  (Jan is month 1)
 int     month(time_t t);   // the month for the given time
 int     year();            // the full four digit year: (2009, 2010 etc) 
 int     year(time_t t);    // the year for the given time
+void    snapshot(tmElements_t &tm);           // all time elements now from one decomposition
+void    snapshot(time_t t, tmElements_t &tm); // all time elements for the given time
 
 time_t now();              // return the current time as seconds since Jan 1 1970 
 void    setTime(time_t t);
@@ -110,6 +112,8 @@ void    setSyncInterval(time_t interval); // set the number of seconds between r
 /* low level functions to convert to and from system time                     */
 void breakTime(time_t time, tmElements_t &tm);  // break time_t into elements
 time_t makeTime(tmElements_t &tm);  // convert time elements into time_t
+unsigned long daysFromCivil(int y, uint8_t m, uint8_t d); // days since 1 Jan 1970 of the date (full year, jan is 1)
+void civilFromDays(unsigned long days, int &y, uint8_t &m, uint8_t &d); // the date of the days since 1 Jan 1970
 
 
 #endif /* _Time_h */
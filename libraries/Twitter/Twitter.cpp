@@ -23,32 +23,69 @@
 
 #include "Twitter.h"
 
-const static char hex_table[] PROGMEM = "0123456789ABCDEF";
-const static char base64_table[] PROGMEM
-= "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-
-const static char s_jan[] PROGMEM = "Jan";
-const static char s_feb[] PROGMEM = "Feb";
-const static char s_mar[] PROGMEM = "Mar";
-const static char s_apr[] PROGMEM = "Apr";
-const static char s_may[] PROGMEM = "May";
-const static char s_jun[] PROGMEM = "Jun";
-const static char s_jul[] PROGMEM = "Jul";
-const static char s_aug[] PROGMEM = "Aug";
-const static char s_sep[] PROGMEM = "Sep";
-const static char s_oct[] PROGMEM = "Oct";
-const static char s_nov[] PROGMEM = "Nov";
-const static char s_dec[] PROGMEM = "Dec";
-
-const static char *months[] PROGMEM =
-  {
-    s_jan, s_feb, s_mar, s_apr, s_may, s_jun,
-    s_jul, s_aug, s_sep, s_oct, s_nov, s_dec,
-  };
+/* The hash of a lowercase header name: djb2 with xor, 16 bits. */
+#define HEADER_HASH_INIT	5381U
+#define HEADER_HASH(h, ch)	((uint16_t) (((h) * 33U) ^ (uint8_t) (ch)))
+
+/* The dispatched response headers by their name hash and length. */
+struct TwitterHeader
+{
+  uint16_t hash;
+  uint8_t len;
+  uint8_t header;
+};
+
+const static TwitterHeader header_table[] PROGMEM =
+{
+  {0xdc11, 4, TWITTER_HEADER_DATE},			/* date */
+  {0xd15d, 14, TWITTER_HEADER_CONTENT_LENGTH},		/* content-length */
+  {0xd280, 17, TWITTER_HEADER_TRANSFER_ENCODING},	/* transfer-encoding */
+  {0xa3f3, 10, TWITTER_HEADER_CONNECTION},		/* connection */
+  {0x3c16, 21, TWITTER_HEADER_RATELIMIT_REMAINING},	/* x-ratelimit-remaining */
+  {0x9a9f, 17, TWITTER_HEADER_RATELIMIT_RESET},		/* x-ratelimit-reset */
+  {0x12e4, 11, TWITTER_HEADER_RETRY_AFTER},		/* retry-after */
+};
+
+/* Header parser states. */
+#define HEADER_NAME		0	/* Reading the header name */
+#define HEADER_VALUE_START	1	/* Skipping whitespace before value */
+#define HEADER_VALUE		2	/* Reading a dispatched value */
+#define HEADER_SKIP		3	/* Skipping the rest of the line */
+
+/* Chunked body decoder states. */
+#define CHUNK_SIZE		0	/* Reading the chunk size */
+#define CHUNK_EXTENSION		1	/* Skipping to the end of size line */
+#define CHUNK_DATA		2
+#define CHUNK_DATA_END		3	/* Skipping CRLF after chunk data */
+#define CHUNK_TRAILER		4	/* Reading the trailer lines */
+
+/* The unreserved characters of RFC 3986 that are not URL encoded:
+   bit `ch & 7' of byte `ch >> 3' is set for the character `ch'. */
+const static uint8_t url_unreserved[32] PROGMEM =
+{
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x60, 0xff, 0x03,
+  0xfe, 0xff, 0xff, 0x87, 0xfe, 0xff, 0xff, 0x47,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+#define URL_UNRESERVED(ch) \
+  (pgm_read_byte(url_unreserved + ((uint8_t) (ch) >> 3)) \
+   & (1 << ((uint8_t) (ch) & 7)))
 
 Twitter::Twitter(char *buffer, size_t buffer_len)
-  : basetime(0L),
-    last_millis(0L),
+  : queue_len(0),
+    next_attempt(0),
+    retry_delay(TWITTER_RETRY_MIN),
+    header_handler(0),
+    body_handler(0),
+    handler_context(0),
+    rate_remaining(-1),
+    rate_reset(0),
+    retry_after(0),
+    access_token_pgm(0),
+    account_record(0),
+    account_address(0),
     timestamp(0),
     buffer(buffer),
     buffer_len(buffer_len),
@@ -86,6 +123,7 @@ Twitter::set_account_id(const prog_char access_token[],
   this->token_secret.pgm = token_secret;
 
   this->access_token_pgm = 1;
+  this->account_record = 0;
 }
 
 void
@@ -95,29 +133,154 @@ Twitter::set_account_id(int access_token, int token_secret)
   this->token_secret.eeprom = token_secret;
 
   this->access_token_pgm = 0;
+  this->account_record = 0;
+}
+
+bool
+Twitter::store_account(int address, const char *access_token,
+                       const char *token_secret)
+{
+  char *cp;
+  size_t key_len;
+
+  if (url_encoded_length_pgm(consumer_secret) + 1
+      + url_encoded_length(token_secret) + url_encoded_length(access_token)
+      >= buffer_len)
+    return false;
+
+  cp = url_encode_pgm(buffer, consumer_secret);
+  *cp++ = '&';
+  cp = url_encode(cp, token_secret);
+  key_len = cp - buffer;
+
+  cp = url_encode(cp, access_token);
+
+  return write_account(address, key_len, cp - buffer - key_len);
+}
+
+bool
+Twitter::migrate_account(int address, int access_token, int token_secret)
+{
+  char *cp;
+  size_t key_len;
+  int token_len;
+  int secret_len;
+  uint8_t byte;
+
+  /* The lengths of the legacy strings. */
+  for (token_len = 0;
+       (byte = EEPROM.read(access_token + token_len)) && byte != 0xff;
+       token_len++)
+    ;
+  for (secret_len = 0;
+       (byte = EEPROM.read(token_secret + secret_len)) && byte != 0xff;
+       secret_len++)
+    ;
+
+  if (token_len == 0 || secret_len == 0
+      || 3 * (strlen_P(consumer_secret) + secret_len + token_len) + 1
+      >= buffer_len)
+    return false;
+
+  cp = url_encode_pgm(buffer, consumer_secret);
+  *cp++ = '&';
+  cp = url_encode_eeprom(cp, token_secret);
+  key_len = cp - buffer;
+
+  cp = url_encode_eeprom(cp, access_token);
+
+  return write_account(address, key_len, cp - buffer - key_len);
+}
+
+bool
+Twitter::write_account(int address, size_t key_len, size_t token_len)
+{
+  uint8_t buf[TWITTER_ACCOUNT_HEADER_LEN];
+  uint8_t state[HMAC_STATE_LENGTH];
+  int start = address;
+
+  if (token_len >= TWITTER_TOKEN_LEN)
+    return false;
+
+  Sha1.computeHmacState((uint8_t *) buffer, key_len, state);
+
+  buf[0] = TWITTER_ACCOUNT_MAGIC;
+  buf[1] = TWITTER_ACCOUNT_VERSION;
+  buf[2] = token_len;
+
+  GetPut::eeprom_write_data(buf, sizeof(buf), address);
+  address += sizeof(buf);
+
+  GetPut::eeprom_write_data((uint8_t *) buffer + key_len, token_len, address);
+  address += token_len;
+
+  GetPut::eeprom_write_data(state, sizeof(state), address);
+  address += sizeof(state);
+
+  GetPut::put_16bit(buf, GetPut::eeprom_crc16(start, address - start));
+  GetPut::eeprom_write_data(buf, 2, address);
+
+  return true;
+}
+
+bool
+Twitter::load_account(int address)
+{
+  uint8_t buf[TWITTER_ACCOUNT_HEADER_LEN];
+  uint16_t crc;
+  uint8_t token_len;
+  int start = address;
+
+  account_record = 0;
+
+  GetPut::eeprom_read_data(buf, sizeof(buf), address);
+  token_len = buf[2];
+
+  if (buf[0] != TWITTER_ACCOUNT_MAGIC || buf[1] != TWITTER_ACCOUNT_VERSION
+      || token_len >= TWITTER_TOKEN_LEN)
+    return false;
+
+  crc = GetPut::crc16(GETPUT_CRC16_INIT, buf, sizeof(buf));
+  address += sizeof(buf);
+
+  GetPut::eeprom_read_data((uint8_t *) token, token_len, address);
+  token[token_len] = '\0';
+  crc = GetPut::crc16(crc, (uint8_t *) token, token_len);
+  address += token_len;
+
+  GetPut::eeprom_read_data(key_state, sizeof(key_state), address);
+  crc = GetPut::crc16(crc, key_state, sizeof(key_state));
+  address += sizeof(key_state);
+
+  GetPut::eeprom_read_data(buf, 2, address);
+  if (GetPut::get_16bit(buf) != crc)
+    return false;
+
+  account_record = 1;
+  account_address = start;
+
+  return true;
 }
 
 bool
 Twitter::is_ready(void)
 {
-  if (basetime)
-    return true;
+  if (clock.sync_due() && !query_time())
+    clock.sync_failed();
 
-  return query_time();
+  return clock.is_set();
 }
 
 unsigned long
 Twitter::get_time(void)
 {
-  unsigned long now = millis();
-
-  if (now < last_millis)
-    /* Our internal clock wrapped around. */
-    basetime += 0xffffffffL / 1000L;
-
-  last_millis = now;
+  return clock.now();
+}
 
-  return basetime + now / 1000L;
+unsigned long
+Twitter::get_time(uint16_t *msec_return)
+{
+  return clock.now(msec_return);
 }
 
 bool
@@ -149,304 +312,398 @@ Twitter::query_time(void)
 
   http_newline(&http);
 
-  while (http.connected())
-    {
-      if (!read_line(&http, buffer, buffer_len))
-        break;
+  read_response(&http, true);
 
-      if (buffer[0] == '\0')
-        break;
+  http.stop();
 
-      if (process_date_header(buffer))
-        break;
-    }
+  return clock.is_set();
+}
 
-  http.stop();
+bool
+Twitter::post_status(const char *message)
+{
+  int code = post(message);
 
-  return basetime != 0L;
+  return 200 <= code && code < 300;
 }
 
 bool
-Twitter::process_date_header(char *buffer)
+Twitter::queue_status(uint8_t tag, const char *message)
 {
-  if ((buffer[0] != 'D' && buffer[0] != 'd')
-      || (buffer[1] != 'A' && buffer[1] != 'a')
-      || (buffer[2] != 'T' && buffer[2] != 't')
-      || (buffer[3] != 'E' && buffer[3] != 'e')
-      || (buffer[4] != ':'))
+  uint8_t i;
+
+  if (strlen(message) >= TWITTER_STATUS_LEN)
     return false;
 
-  unsigned long now = parse_date(buffer + 5);
+  if (tag)
+    for (i = 0; i < queue_len; i++)
+      if (queue[i].tag == tag)
+        {
+          strcpy(queue[i].message, message);
+          return true;
+        }
 
-  if (now != 0)
-    {
-      /* We managed to parse the date header, now update system
-         basetime. */
-      last_millis = millis();
-      basetime = now - last_millis / 1000L;
-    }
+  if (queue_len >= TWITTER_QUEUE_SIZE)
+    return false;
+
+  queue[queue_len].tag = tag;
+  strcpy(queue[queue_len].message, message);
+  queue_len++;
 
   return true;
 }
 
-long
-Twitter::parse_date(char *date)
+uint8_t
+Twitter::queued(void)
 {
-  tmElements_t tm;
-  char *cp;
-  char *end;
+  return queue_len;
+}
 
-  memset(&tm, 0, sizeof(tm));
+bool
+Twitter::post_queued(void)
+{
+  unsigned long now;
+  int code;
 
-  /* We could use sscanf to parse the date string but it adds 26 bytes
-     to our SRAM consumption so let's use this adhoc parser. */
+  if (queue_len == 0 || !clock.is_set())
+    return false;
 
-  for (cp = date; *cp && *cp != ','; cp++)
-    ;
+  now = get_time();
+  if ((long) (now - next_attempt) < 0)
+    return false;
 
-  if (*cp != ',')
-    return 0;
+  code = post(queue[0].message);
 
-  tm.Day = strtol(++cp, &end, 10);
+  if (200 <= code && code < 300)
+    {
+      dequeue();
+      retry_delay = TWITTER_RETRY_MIN;
+      next_attempt = now;
+    }
+  else if (code == 400 || code == 403)
+    {
+      /* Invalid or duplicate status; retrying would not help. */
+      println(PSTR("Status rejected"));
+      dequeue();
+      next_attempt = now;
+    }
+  else
+    {
+      next_attempt = now + retry_delay;
 
-  if (end == cp)
-    return 0;
+      retry_delay *= 2;
+      if (retry_delay > TWITTER_RETRY_MAX)
+        retry_delay = TWITTER_RETRY_MAX;
+    }
 
-  cp = end;
+  /* Honor the server's rate limit, within reason. */
+  if (retry_after > 0 && now + retry_after > next_attempt)
+    next_attempt = now + retry_after;
 
-  for (; *cp && *cp == ' '; cp++)
-    ;
-  if (!*cp)
-    return 0;
+  if (rate_remaining == 0 && (long) (rate_reset - next_attempt) > 0)
+    next_attempt = rate_reset;
 
-  tm.Month = parse_month(cp, &end);
-  if (tm.Month <= 0)
-    return 0;
+  if ((long) (next_attempt - (now + TWITTER_RETRY_MAX)) > 0)
+    next_attempt = now + TWITTER_RETRY_MAX;
 
-  cp = end + 1;
+  return 200 <= code && code < 300;
+}
 
-  tm.Year = strtol(cp, &end, 10) - 1970;
+void
+Twitter::dequeue(void)
+{
+  uint8_t i;
 
-  if (end == cp)
-    return 0;
+  for (i = 1; i < queue_len; i++)
+    queue[i - 1] = queue[i];
 
-  cp = end + 1;
+  queue_len--;
+}
 
-  tm.Hour = strtol(cp, &end, 10);
+uint8_t
+Twitter::post_status(const char *message, const TwitterTarget targets[],
+                     uint8_t count, int codes[])
+{
+  const prog_char *saved_server = server;
+  const prog_char *saved_uri = uri;
+  IPAddress saved_ip = ip;
+  uint16_t saved_port = port;
+  uint8_t saved_proxy = proxy;
+  uint8_t saved_record = account_record;
+  int saved_address = account_address;
+  EthernetClient http;
+  bool connected = false;
+  IPAddress connected_ip;
+  uint16_t connected_port = 0;
+  const char *body = buffer;
+  size_t body_len;
+  uint8_t posted = 0;
+  IPAddress next_ip;
+  uint8_t i;
+  bool reuse;
+  int code;
+
+  body_len = encode_status(message);
+  if (body_len == 0)
+    {
+      println(PSTR("Status message too long"));
+      return 0;
+    }
 
-  if (end == cp)
-    return 0;
+  timestamp = get_time();
 
-  cp = end + 1;
+  for (i = 0; i < count; i++)
+    {
+      code = 0;
 
-  tm.Minute = strtol(cp, &end, 10);
+      if (load_account(targets[i].account))
+        {
+          set_twitter_endpoint(targets[i].server, targets[i].uri,
+                               targets[i].ip, targets[i].port,
+                               targets[i].proxy);
+
+          /* A connection kept open for a skipped target may be to
+             another end point. */
+          if (connected && ((uint32_t) connected_ip != (uint32_t) ip
+                            || connected_port != port))
+            {
+              http.stop();
+              connected = false;
+            }
 
-  if (end == cp)
-    return 0;
+          if (!connected)
+            {
+              connected = http.connect(ip, port);
+              connected_ip = ip;
+              connected_port = port;
+            }
 
-  cp = end + 1;
+          if (connected)
+            {
+              /* Keep the connection for the next target if it uses
+                 the same end point. */
+              reuse = false;
+              if (i + 1 < count)
+                {
+                  next_ip = targets[i + 1].ip;
+                  reuse = ((uint32_t) next_ip == (uint32_t) ip
+                           && targets[i + 1].port == port);
+                }
 
-  tm.Second = strtol(cp, &end, 10);
+              code = request(&http, key_state, body, body_len, reuse);
 
-  if (end == cp)
-    return 0;
+              if (code == 0 || !reuse || !keep_alive || !http.connected())
+                {
+                  http.stop();
+                  connected = false;
+                }
+            }
+          else
+            {
+              println(PSTR("Could not connect to server"));
+            }
+        }
+      else
+        {
+          println(PSTR("Invalid account record"));
+        }
+
+      if (codes)
+        codes[i] = code;
+      if (200 <= code && code < 300)
+        posted++;
+    }
+
+  if (connected)
+    http.stop();
 
-  return makeTime(tm);
+  release_status(body_len);
+
+  /* Restore this instance's own end point and account. */
+  set_twitter_endpoint(saved_server, saved_uri, saved_ip, saved_port,
+                       saved_proxy);
+  if (!saved_record || !load_account(saved_address))
+    account_record = 0;
+
+  return posted;
 }
 
 int
-Twitter::parse_month(char *str, char **end)
+Twitter::post(const char *message)
 {
-  char *cp;
-  int i;
+  EthernetClient http;
+  uint8_t state[HMAC_STATE_LENGTH];
+  const uint8_t *key;
+  const char *body = buffer;
+  size_t body_len;
+  int code = 0;
+
+  /* The key derivation needs the work buffer before the body
+     reserves it. */
+  key = signing_key(state);
+
+  body_len = encode_status(message);
+  if (body_len == 0)
+    {
+      println(PSTR("Status message too long"));
+      return 0;
+    }
 
-  for (cp = str; *cp && *cp != ' '; cp++)
-    ;
+  timestamp = get_time();
 
-  if (!*cp)
-    return 0;
+  if (http.connect(ip, port))
+    {
+      code = request(&http, key, body, body_len, false);
+      http.stop();
+    }
+  else
+    {
+      println(PSTR("Could not connect to server"));
+    }
 
-  *cp = '\0';
+  release_status(body_len);
 
-  *end = cp;
+  return code;
+}
 
-  for (i = 0; i < 12; i++)
-    if (strcmp_P(str, (char *) pgm_read_word(&(months[i]))) == 0)
-      return i + 1;
+const uint8_t *
+Twitter::signing_key(uint8_t *state)
+{
+  char *cp;
 
-  return 0;
+  if (account_record)
+    return key_state;
+
+  cp = url_encode_pgm(buffer, consumer_secret);
+  *cp++ = '&';
+
+  if (access_token_pgm)
+    cp = url_encode_pgm(cp, token_secret.pgm);
+  else
+    cp = url_encode_eeprom(cp, token_secret.eeprom);
+
+  Sha1.computeHmacState((uint8_t *) buffer, cp - buffer, state);
+
+  return state;
 }
 
-bool
-Twitter::post_status(const char *message)
+size_t
+Twitter::encode_status(const char *message)
 {
+  size_t body_len;
   char *cp;
-  int i;
 
-  timestamp = get_time();
-  create_nonce();
+  body_len = sizeof("status=") - 1 + url_encoded_length(message);
+  if (body_len + 1 + TWITTER_WORK_LEN > buffer_len)
+    return 0;
 
-  compute_authorization(message);
+  strcpy_P(buffer, PSTR("status="));
+  cp = url_encode(buffer + sizeof("status=") - 1, message);
 
-  /* Post message to twitter. */
+  buffer = cp + 1;
+  buffer_len -= body_len + 1;
 
-  EthernetClient http;
+  return body_len;
+}
 
-  if (!http.connect(ip, port))
-    {
-      println(PSTR("Could not connect to server"));
-      return false;
-    }
+void
+Twitter::release_status(size_t body_len)
+{
+  buffer -= body_len + 1;
+  buffer_len += body_len + 1;
+}
+
+int
+Twitter::request(Client *http, const uint8_t *key, const char *body,
+                 size_t body_len, bool keep_alive)
+{
+  create_nonce();
 
-  http_print(&http, PSTR("POST "));
+  compute_authorization(key, body + sizeof("status=") - 1);
+
+  http_print(http, PSTR("POST "));
 
   if (proxy)
     {
-      http_print(&http, PSTR("http://"));
-      http_print(&http, server);
+      http_print(http, PSTR("http://"));
+      http_print(http, server);
     }
 
-  http_print(&http, uri);
-  http_println(&http, PSTR(" HTTP/1.1"));
+  http_print(http, uri);
+  http_println(http, PSTR(" HTTP/1.1"));
 
-  http_print(&http, PSTR("Host: "));
-  http_print(&http, server);
-  http_newline(&http);
+  http_print(http, PSTR("Host: "));
+  http_print(http, server);
+  http_newline(http);
 
-  http_println(&http,
+  http_println(http,
                PSTR("Content-Type: application/x-www-form-urlencoded"));
-  http_println(&http, PSTR("Connection: close"));
+  if (keep_alive)
+    http_println(http, PSTR("Connection: keep-alive"));
+  else
+    http_println(http, PSTR("Connection: close"));
 
   /* Authorization header. */
-  http_print(&http, PSTR("Authorization: OAuth oauth_consumer_key=\""));
+  http_print(http, PSTR("Authorization: OAuth oauth_consumer_key=\""));
 
-  url_encode_pgm(buffer, consumer_key);
-  http.write(buffer);
+  print_url_encoded_pgm(http, consumer_key);
 
-  http_print(&http, PSTR("\",oauth_signature_method=\"HMAC-SHA1"));
-  http_print(&http, PSTR("\",oauth_timestamp=\""));
+  http_print(http, PSTR("\",oauth_signature_method=\"HMAC-SHA1"));
+  http_print(http, PSTR("\",oauth_timestamp=\""));
 
   sprintf(buffer, "%ld", timestamp);
-  http.write(buffer);
+  http->write(buffer);
 
-  http_print(&http, PSTR("\",oauth_nonce=\""));
+  http_print(http, PSTR("\",oauth_nonce=\""));
 
-  hex_encode(buffer, nonce, sizeof(nonce));
-  http.write(buffer);
+  Codec::hex_print(http, nonce, sizeof(nonce));
 
-  http_print(&http, PSTR("\",oauth_version=\"1.0\",oauth_token=\""));
+  http_print(http, PSTR("\",oauth_version=\"1.0\",oauth_token=\""));
 
-  if (access_token_pgm)
-    url_encode_pgm(buffer, access_token.pgm);
+  if (account_record)
+    http->write(token);
+  else if (access_token_pgm)
+    print_url_encoded_pgm(http, access_token.pgm);
   else
-    url_encode_eeprom(buffer, access_token.eeprom);
-
-  http.write(buffer);
-
-  http_print(&http, PSTR("\",oauth_signature=\""));
-
-  cp = base64_encode(buffer, signature, HASH_LENGTH);
-  url_encode(cp + 1, buffer);
+    print_url_encoded_eeprom(http, access_token.eeprom);
 
-  http.write(cp + 1);
+  http_print(http, PSTR("\",oauth_signature=\""));
 
-  http_println(&http, PSTR("\""));
+  Codec::base64_encode(buffer, signature, HASH_LENGTH);
+  print_url_encoded(http, buffer);
 
-  /* Encode content. */
-  cp = url_encode(buffer, "status");
-  *cp++ = '=';
-  cp = url_encode(cp, message);
+  http_println(http, PSTR("\""));
 
-  int content_length = cp - buffer;
-  sprintf(cp + 1, "%d", content_length);
-
-  http_print(&http, PSTR("Content-Length: "));
-  http.write(cp + 1);
-  http_newline(&http);
+  http_print(http, PSTR("Content-Length: "));
+  sprintf(buffer, "%u", (unsigned int) body_len);
+  http->write(buffer);
+  http_newline(http);
 
   /* Header-body separator. */
-  http_newline(&http);
+  http_newline(http);
 
   /* And finally content. */
-  http.write(buffer);
-
-  /* Read response status line. */
-  if (!read_line(&http, buffer, buffer_len) || buffer[0] == '\0')
-    {
-      http.stop();
-      return false;
-    }
-
-  int response_code;
-
-  /* HTTP/1.1 200 Success */
-  for (i = 0; buffer[i] && buffer[i] != ' '; i++)
-    ;
-  if (buffer[i])
-    response_code = atoi(buffer + i + 1);
-  else
-    response_code = 0;
-
-  bool success = (200 <= response_code && response_code < 300);
-
-  if (!success)
-    Serial.println(buffer);
-
-  /* Skip header. */
-  while (true)
-    {
-      if (!read_line(&http, buffer, buffer_len))
-        {
-          http.stop();
-          return false;
-        }
-
-      if (buffer[0] == '\0')
-        break;
-
-      /* Update our system basetime from the response `Date'
-         header. */
-      process_date_header(buffer);
-    }
-
-  /* Handle content. */
-  while (http.connected())
-    {
-      while (http.available() > 0)
-        {
-          uint8_t byte = http.read();
-
-          if (!success)
-            Serial.write(byte);
-        }
-      delay(100);
-    }
+  http->write((const uint8_t *) body, body_len);
 
-  http.stop();
+  if (!read_response(http, false))
+    return 0;
 
-  if (!success)
-    println(PSTR(""));
+  return response_code;
+}
 
-  return success;
+void
+Twitter::set_response_handler(TwitterHeaderCallback header, Print *body,
+                              void *context)
+{
+  header_handler = header;
+  body_handler = body;
+  handler_context = context;
 }
 
 char *
 Twitter::url_encode(char *buffer, char ch)
 {
-  if ('0' <= ch && ch <= '9'
-      || 'a' <= ch && ch <= 'z' || 'A' <= ch && ch <= 'Z'
-      || ch == '-' || ch == '.' || ch == '_' || ch == '~')
-    {
-      *buffer++ = ch;
-    }
-  else
-    {
-      int val = ((int) ch) & 0xff;
-
-      snprintf(buffer, 4, "%%%02X", val);
-      buffer += 3;
-    }
-
+  buffer = url_encode_char(buffer, ch);
   *buffer = '\0';
 
   return buffer;
@@ -458,7 +715,9 @@ Twitter::url_encode(char *buffer, const char *data)
   char ch;
 
   while ((ch = *data++))
-    buffer = url_encode(buffer, ch);
+    buffer = url_encode_char(buffer, ch);
+
+  *buffer = '\0';
 
   return buffer;
 }
@@ -469,32 +728,44 @@ Twitter::url_encode_pgm(char *buffer, const prog_char data[])
   char ch;
 
   while ((ch = pgm_read_byte(data++)))
-    buffer = url_encode(buffer, ch);
+    buffer = url_encode_char(buffer, ch);
+
+  *buffer = '\0';
 
   return buffer;
 }
 
-char *
-Twitter::url_encode_eeprom(char *buffer, int address)
+size_t
+Twitter::url_encoded_length(const char *data)
 {
+  size_t len = 0;
   char ch;
 
-  while ((ch = EEPROM.read(address++)))
-    buffer = url_encode(buffer, ch);
+  while ((ch = *data++))
+    len += URL_UNRESERVED(ch) ? 1 : 3;
 
-  return buffer;
+  return len;
+}
+
+size_t
+Twitter::url_encoded_length_pgm(const prog_char data[])
+{
+  size_t len = 0;
+  char ch;
+
+  while ((ch = pgm_read_byte(data++)))
+    len += URL_UNRESERVED(ch) ? 1 : 3;
+
+  return len;
 }
 
 char *
-Twitter::hex_encode(char *buffer, const uint8_t *data, size_t data_len)
+Twitter::url_encode_eeprom(char *buffer, int address)
 {
-  size_t i;
+  char ch;
 
-  for (i = 0; i < data_len; i++)
-    {
-      *buffer++ = (char) pgm_read_byte(hex_table + (data[i] >> 4));
-      *buffer++ = (char) pgm_read_byte(hex_table + (data[i] & 0x0f));
-    }
+  while ((ch = EEPROM.read(address++)))
+    buffer = url_encode_char(buffer, ch);
 
   *buffer = '\0';
 
@@ -502,100 +773,102 @@ Twitter::hex_encode(char *buffer, const uint8_t *data, size_t data_len)
 }
 
 char *
-Twitter::base64_encode(char *buffer, const uint8_t *data, size_t data_len)
+Twitter::url_encode_char(char *buffer, char ch)
 {
-  int i, len;
-
-  for (i = 0, len = data_len; len > 0; i += 3, len -= 3)
+  if (URL_UNRESERVED(ch))
     {
-      unsigned long val;
-
-      val = (unsigned long) data[i] << 16;
-      if (len > 1)
-        val |= (unsigned long) data[i + 1] << 8;
-      if (len > 2)
-        val |= data[i + 2];
-
-      *buffer++ = (char) pgm_read_byte(base64_table + (val >> 18));
-      *buffer++ = (char) pgm_read_byte(base64_table + ((val >> 12) & 0x3f));
-      *buffer++ = (char) pgm_read_byte(base64_table + ((val >> 6) & 0x3f));
-      *buffer++ = (char) pgm_read_byte(base64_table + (val & 0x3f));
+      *buffer++ = ch;
+    }
+  else
+    {
+      *buffer++ = '%';
+      buffer = Codec::hex_byte(buffer, ch);
     }
-
-  for (; len < 0; len++)
-    buffer[len] = '=';
-
-  *buffer = '\0';
 
   return buffer;
 }
 
 void
-Twitter::create_nonce(void)
+Twitter::print_url_encoded(Print *out, char ch)
 {
-  int i;
+  char buf[3];
 
-  /* Nonce must be unique for the request timestamp value, so let's
-     use the timestamp as our random seed. */
-  srandom(timestamp);
+  out->write((const uint8_t *) buf, url_encode_char(buf, ch) - buf);
+}
+
+void
+Twitter::print_url_encoded(Print *out, const char *data)
+{
+  char ch;
 
-  for (i = 0; i < sizeof(nonce); i++)
-    nonce[i] = (uint8_t) random();
+  while ((ch = *data++))
+    print_url_encoded(out, ch);
 }
 
 void
-Twitter::compute_authorization(const char *message)
+Twitter::print_url_encoded_pgm(Print *out, const prog_char data[])
 {
-  char *cp = buffer;
+  char ch;
 
-  /* Compute key and init HMAC. */
+  while ((ch = pgm_read_byte(data++)))
+    print_url_encoded(out, ch);
+}
 
-  cp = url_encode_pgm(buffer, consumer_secret);
-  *cp++ = '&';
+void
+Twitter::print_url_encoded_eeprom(Print *out, int address)
+{
+  char ch;
 
-  if (access_token_pgm)
-    cp = url_encode_pgm(cp, token_secret.pgm);
-  else
-    cp = url_encode_eeprom(cp, token_secret.eeprom);
+  while ((ch = EEPROM.read(address++)))
+    print_url_encoded(out, ch);
+}
+
+void
+Twitter::create_nonce(void)
+{
+  Entropy.generate(nonce, sizeof(nonce));
+}
 
-  Sha1.initHmac((uint8_t *) buffer, cp - buffer);
+void
+Twitter::compute_authorization(const uint8_t *key, const char *status)
+{
+  Sha1.initHmac(key);
 
   auth_add_pgm(PSTR("POST&http%3A%2F%2F"));
   auth_add_pgm(server);
 
-  url_encode_pgm(buffer, uri);
-  auth_add(buffer);
+  print_url_encoded_pgm(&Sha1, uri);
 
   auth_add('&');
 
   auth_add_pgm(PSTR("oauth_consumer_key"));
   auth_add_value_separator();
-  url_encode_pgm(buffer, consumer_key);
-  auth_add(buffer);
-
-  cp = hex_encode(buffer, nonce, sizeof(nonce));
+  print_url_encoded_pgm(&Sha1, consumer_key);
 
-  auth_add_param(PSTR("oauth_nonce"), buffer, cp + 1);
+  Codec::hex_encode(buffer, nonce, sizeof(nonce));
+  auth_add_param(PSTR("oauth_nonce"), buffer);
 
-  auth_add_param(PSTR("oauth_signature_method"), "HMAC-SHA1", buffer);
+  auth_add_param(PSTR("oauth_signature_method"), "HMAC-SHA1");
 
   sprintf(buffer, "%ld", timestamp);
-  auth_add_param(PSTR("oauth_timestamp"), buffer, cp + 1);
+  auth_add_param(PSTR("oauth_timestamp"), buffer);
 
   auth_add_param_separator();
 
   auth_add_pgm(PSTR("oauth_token"));
   auth_add_value_separator();
-  if (access_token_pgm)
-    url_encode_pgm(buffer, access_token.pgm);
+  if (account_record)
+    auth_add(token);
+  else if (access_token_pgm)
+    print_url_encoded_pgm(&Sha1, access_token.pgm);
   else
-    url_encode_eeprom(buffer, access_token.eeprom);
-  auth_add(buffer);
+    print_url_encoded_eeprom(&Sha1, access_token.eeprom);
 
-  auth_add_param(PSTR("oauth_version"), "1.0", buffer);
+  auth_add_param(PSTR("oauth_version"), "1.0");
 
-  cp = url_encode(buffer, message);
-  auth_add_param(PSTR("status"), buffer, cp + 1);
+  /* The status is URL encoded again as a part of the signature base
+     string. */
+  auth_add_param(PSTR("status"), status);
 
   signature = Sha1.resultHmac();
 }
@@ -622,7 +895,7 @@ Twitter::auth_add_pgm(const prog_char str[])
 }
 
 void
-Twitter::auth_add_param(const prog_char key[], const char *value, char *workbuf)
+Twitter::auth_add_param(const prog_char key[], const char *value)
 {
   /* Add separator.  We know that this method is not used to add the
      first parameter. */
@@ -632,8 +905,7 @@ Twitter::auth_add_param(const prog_char key[], const char *value, char *workbuf)
 
   auth_add_value_separator();
 
-  url_encode(workbuf, value);
-  auth_add(workbuf);
+  print_url_encoded(&Sha1, value);
 }
 
 void
@@ -727,3 +999,299 @@ Twitter::read_line(Client *client, char *buffer, size_t buflen)
 
   return false;
 }
+
+bool
+Twitter::read_response(Client *client, bool head)
+{
+  Print *sink = body_handler;
+  int i;
+
+  response_code = 0;
+  content_length = -1;
+  chunked = false;
+  keep_alive = true;
+  rate_remaining = -1;
+  retry_after = 0;
+
+  /* HTTP/1.1 200 Success */
+  if (!read_line(client, buffer, buffer_len) || buffer[0] == '\0')
+    return false;
+
+  for (i = 0; buffer[i] && buffer[i] != ' '; i++)
+    ;
+  if (buffer[i])
+    response_code = atoi(buffer + i + 1);
+
+  /* HTTP/1.0 closes the connection by default. */
+  if (strncmp_P(buffer, PSTR("HTTP/1.0"), 8) == 0)
+    keep_alive = false;
+
+  if (response_code < 200 || response_code >= 300)
+    {
+      Serial.println(buffer);
+      if (sink == 0)
+        sink = &Serial;
+    }
+
+  if (!read_headers(client))
+    return false;
+
+  /* Responses to HEAD and the 1xx, 204, and 304 responses have no
+     body. */
+  if (head || response_code < 200 || response_code == 204
+      || response_code == 304)
+    return true;
+
+  if (!read_body(client, sink))
+    return false;
+
+  if (sink == &Serial && body_handler == 0)
+    println(PSTR(""));
+
+  return true;
+}
+
+bool
+Twitter::read_headers(Client *client)
+{
+  char *value = buffer;
+  size_t value_max = buffer_len < TWITTER_HEADER_VALUE_LEN
+    ? buffer_len : TWITTER_HEADER_VALUE_LEN;
+  uint8_t state = HEADER_NAME;
+  uint16_t hash = HEADER_HASH_INIT;
+  uint8_t len = 0;
+  uint8_t header = 0;
+  uint8_t i;
+  char ch;
+
+  while (client->connected() || client->available() > 0)
+    {
+      if (client->available() <= 0)
+        {
+          delay(10);
+          continue;
+        }
+
+      ch = client->read();
+
+      if (ch == '\r')
+        continue;
+
+      if (ch == '\n')
+        {
+          /* An empty line ends the headers. */
+          if (state == HEADER_NAME && len == 0)
+            return true;
+
+          if (state == HEADER_VALUE || state == HEADER_VALUE_START)
+            {
+              value[state == HEADER_VALUE ? len : 0] = '\0';
+
+              process_header(header, value);
+              if (header_handler)
+                header_handler(handler_context, header, value);
+            }
+
+          state = HEADER_NAME;
+          hash = HEADER_HASH_INIT;
+          len = 0;
+          continue;
+        }
+
+      switch (state)
+        {
+        case HEADER_NAME:
+          if (ch != ':')
+            {
+              if ('A' <= ch && ch <= 'Z')
+                ch += 'a' - 'A';
+
+              hash = HEADER_HASH(hash, ch);
+              if (len < 0xff)
+                len++;
+              break;
+            }
+
+          state = HEADER_SKIP;
+          for (i = 0; i < sizeof(header_table) / sizeof(header_table[0]); i++)
+            if (pgm_read_word(&header_table[i].hash) == hash
+                && pgm_read_byte(&header_table[i].len) == len)
+              {
+                header = pgm_read_byte(&header_table[i].header);
+                state = HEADER_VALUE_START;
+                break;
+              }
+          len = 0;
+          break;
+
+        case HEADER_VALUE_START:
+          if (ch == ' ' || ch == '\t')
+            break;
+
+          state = HEADER_VALUE;
+          /* FALLTHROUGH */
+
+        case HEADER_VALUE:
+          if (len < value_max - 1)
+            value[len++] = ch;
+          break;
+
+        case HEADER_SKIP:
+          break;
+        }
+    }
+
+  return false;
+}
+
+bool
+Twitter::read_body(Client *client, Print *sink)
+{
+  uint8_t *data = (uint8_t *) buffer;
+  unsigned long remaining = chunked ? 0 : content_length;
+  uint8_t state = CHUNK_SIZE;
+  uint8_t line_len = 0;
+  size_t i, n, len;
+  uint8_t ch;
+
+  if (!chunked && content_length == 0)
+    return true;
+
+  while (client->connected() || client->available() > 0)
+    {
+      n = client->available();
+      if (n == 0)
+        {
+          delay(10);
+          continue;
+        }
+
+      if (n > buffer_len)
+        n = buffer_len;
+
+      /* Do not read past the body of a known length. */
+      if (!chunked && content_length >= 0 && n > remaining)
+        n = remaining;
+
+      n = client->read(data, n);
+
+      if (!chunked)
+        {
+          if (sink)
+            sink->write(data, n);
+
+          if (content_length >= 0)
+            {
+              remaining -= n;
+              if (remaining == 0)
+                return true;
+            }
+          continue;
+        }
+
+      for (i = 0; i < n; i++)
+        {
+          ch = data[i];
+
+          switch (state)
+            {
+            case CHUNK_SIZE:
+              if ('0' <= ch && ch <= '9')
+                remaining = (remaining << 4) | (ch - '0');
+              else if ('a' <= (ch | 0x20) && (ch | 0x20) <= 'f')
+                remaining = (remaining << 4) | ((ch | 0x20) - 'a' + 10);
+              else
+                state = CHUNK_EXTENSION;
+
+              if (state != CHUNK_EXTENSION)
+                break;
+              /* FALLTHROUGH */
+
+            case CHUNK_EXTENSION:
+              if (ch == '\n')
+                state = remaining ? CHUNK_DATA : CHUNK_TRAILER;
+              break;
+
+            case CHUNK_DATA:
+              len = n - i;
+              if (len > remaining)
+                len = remaining;
+
+              if (sink)
+                sink->write(data + i, len);
+
+              remaining -= len;
+              i += len - 1;
+
+              if (remaining == 0)
+                state = CHUNK_DATA_END;
+              break;
+
+            case CHUNK_DATA_END:
+              if (ch == '\n')
+                state = CHUNK_SIZE;
+              break;
+
+            case CHUNK_TRAILER:
+              if (ch == '\n')
+                {
+                  if (line_len == 0)
+                    return true;
+                  line_len = 0;
+                }
+              else if (ch != '\r')
+                {
+                  line_len = 1;
+                }
+              break;
+            }
+        }
+    }
+
+  /* Without a length the body ends when the connection closes. */
+  return !chunked && content_length < 0;
+}
+
+void
+Twitter::process_header(uint8_t header, const char *value)
+{
+  unsigned long time;
+
+  switch (header)
+    {
+    case TWITTER_HEADER_DATE:
+      /* The header is truncated to seconds so the middle of the
+         second is the best estimate. */
+      time = HttpDate::parse(value, strlen(value));
+      if (time)
+        clock.sync(time, 500);
+      break;
+
+    case TWITTER_HEADER_CONTENT_LENGTH:
+      content_length = atol(value);
+      break;
+
+    case TWITTER_HEADER_TRANSFER_ENCODING:
+      chunked = strcasecmp_P(value, PSTR("chunked")) == 0;
+      break;
+
+    case TWITTER_HEADER_CONNECTION:
+      if (strcasecmp_P(value, PSTR("close")) == 0)
+        keep_alive = false;
+      else if (strcasecmp_P(value, PSTR("keep-alive")) == 0)
+        keep_alive = true;
+      break;
+
+    case TWITTER_HEADER_RATELIMIT_REMAINING:
+      rate_remaining = atol(value);
+      break;
+
+    case TWITTER_HEADER_RATELIMIT_RESET:
+      rate_reset = strtoul(value, 0, 10);
+      break;
+
+    case TWITTER_HEADER_RETRY_AFTER:
+      retry_after = strtoul(value, 0, 10);
+      break;
+    }
+}
@@ -36,6 +36,89 @@
 #include <sha1.h>
 #include <Ethernet.h>
 #include <Time.h>
+#include <Clock.h>
+#include <HttpDate.h>
+#include <GetPut.h>
+#include <Entropy.h>
+#include <Codec.h>
+
+/* The number of status messages in the outbound queue. */
+#ifndef TWITTER_QUEUE_SIZE
+#define TWITTER_QUEUE_SIZE 2
+#endif
+
+/* The maximum length of a queued status message, including the null
+   terminator. */
+#ifndef TWITTER_STATUS_LEN
+#define TWITTER_STATUS_LEN 48
+#endif
+
+/* The first and the maximum retry delay in seconds.  The delay is
+   doubled after each failed attempt. */
+#define TWITTER_RETRY_MIN 60L
+#define TWITTER_RETRY_MAX (60L * 60L)
+
+/* The maximum length of the URL encoded access token of an account
+   record, including the null terminator. */
+#ifndef TWITTER_TOKEN_LEN
+#define TWITTER_TOKEN_LEN 56
+#endif
+
+/* The minimum size of the work buffer that is left for the request
+   after the URL encoded status message. */
+#define TWITTER_WORK_LEN 32
+
+/* The EEPROM account record: magic, version, the length of the URL
+   encoded access token, the token, the HMAC key state of the OAuth
+   signing key, and the CRC-16 of the preceding bytes. */
+#define TWITTER_ACCOUNT_MAGIC	0x54
+#define TWITTER_ACCOUNT_VERSION	1
+#define TWITTER_ACCOUNT_HEADER_LEN 3
+#define TWITTER_ACCOUNT_LEN(token_len) \
+  (TWITTER_ACCOUNT_HEADER_LEN + (token_len) + HMAC_STATE_LENGTH + 2)
+
+/* The response headers that Twitter dispatches to the response
+   handlers. */
+#define TWITTER_HEADER_DATE			1
+#define TWITTER_HEADER_CONTENT_LENGTH		2
+#define TWITTER_HEADER_TRANSFER_ENCODING	3
+#define TWITTER_HEADER_CONNECTION		4
+#define TWITTER_HEADER_RATELIMIT_REMAINING	5
+#define TWITTER_HEADER_RATELIMIT_RESET		6
+#define TWITTER_HEADER_RETRY_AFTER		7
+
+/* The maximum length of a dispatched header value, including the
+   null terminator.  Longer values are truncated. */
+#define TWITTER_HEADER_VALUE_LEN 32
+
+/* Callback for the response headers.  The argument `header' is one
+   of the TWITTER_HEADER_* values and `value' is the header value
+   without leading whitespace. */
+typedef void (*TwitterHeaderCallback)(void *context, uint8_t header,
+                                      const char *value);
+
+/* A queued status message. */
+struct TwitterStatus
+{
+  /* The coalescing tag or 0. */
+  uint8_t tag;
+
+  char message[TWITTER_STATUS_LEN];
+};
+
+/* A fan-out target: a Twitter API endpoint and the account to post
+   as.  The fields `server', `uri', `ip', `port', and `proxy' are as in
+   Twitter::set_twitter_endpoint() and `account' is the EEPROM address
+   of the account record. */
+struct TwitterTarget
+{
+  const prog_char *server;
+  const prog_char *uri;
+  IPAddress ip;
+  uint16_t port;
+  bool proxy;
+  int account;
+};
 
 class Twitter
 {
@@ -75,11 +158,36 @@ public:
      `access_token', `token_secret'. */
   void set_account_id(int access_token, int token_secret);
 
+  /* Provision the twitter account identification `access_token',
+     `token_secret' into the EEPROM account record at the address
+     `address'.  The record holds the URL encoded access token and the
+     precomputed HMAC key state of the OAuth signing key so this
+     requires that the client identification has been set with
+     set_client_id().  The record must be re-provisioned if the
+     consumer secret changes.  The method returns false if the values
+     are too long. */
+  bool store_account(int address, const char *access_token,
+                     const char *token_secret);
+
+  /* Provision the EEPROM account record at the address `address'
+     from the legacy EEPROM strings `access_token', `token_secret'.
+     The method returns false if the legacy strings are not set or are
+     too long. */
+  bool migrate_account(int address, int access_token, int token_secret);
+
+  /* Set the twitter account identification from the EEPROM account
+     record at the address `address'.  The record is read once and
+     its CRC is verified.  The method returns false if the record is
+     missing or corrupted. */
+  bool load_account(int address);
+
   /* Tests if this twitter instance is ready for twitter
      communication.  The method returns true if twitter messages can
      be sent and false if the twitter instance is still initializing.
      You should keep calling this method from your loop() and do your
-     twitter interactions when this method returns true. */
+     twitter interactions when this method returns true.  The method
+     also re-syncs the clock with the server when the clock's sync
+     interval has passed. */
   bool is_ready(void);
 
   /* Gets the current UTC time.  The twitter module queries and
@@ -89,11 +197,57 @@ public:
      non-zero value after init() has returned true. */
   unsigned long get_time(void);
 
+  /* Gets the current UTC time in seconds and the milliseconds of the
+     second in `msec_return'. */
+  unsigned long get_time(uint16_t *msec_return);
+
   /* Post status message `message' to twitter.  The message must be
      UTF-8 encoded.  The method returns true if the status message was
      posted and false on error. */
   bool post_status(const char *message);
 
+  /* Post status message `message' to each of the `count' targets
+     `targets'.  The message is URL encoded and timestamped once and
+     each request is signed with the cached key state of the target's
+     account record.  Consecutive targets with the same IP address and
+     port share one keep-alive connection.  If `codes' is not 0, it
+     receives the HTTP status code of each target, or 0 if the request
+     failed.  The endpoint and the account identification of this
+     instance are restored afterwards.  The method returns the number
+     of targets the message was posted to. */
+  uint8_t post_status(const char *message, const TwitterTarget targets[],
+                      uint8_t count, int codes[] = 0);
+
+  /* Queue the status message `message' for posting with
+     post_queued().  If `tag' is non-zero and a message with the same
+     tag is already queued, the new message replaces the queued one
+     but keeps its place in the queue.  This way a queue of sensor
+     readings holds only the latest reading of each sensor.  The
+     method returns false if the message is too long or if the queue
+     is full. */
+  bool queue_status(uint8_t tag, const char *message);
+
+  /* The number of queued status messages. */
+  uint8_t queued(void);
+
+  /* Post the first queued status message if its attempt is due.
+     Failed attempts are retried with exponential backoff, and the
+     next attempt is postponed until the end of the rate limit window
+     if the server reports the rate limit exhausted.  Messages the
+     server rejects as invalid are dropped.  You should call this from
+     your loop() after is_ready() has returned true.  The method
+     returns true if a status message was posted. */
+  bool post_queued(void);
+
+  /* Set the response handlers for the following requests.  The
+     callback `header' is called with `context' for each known
+     response header after Twitter has processed it.  The response
+     body is written to `body'.  If `body' is 0, the body is discarded
+     on success and written to the serial port on error.  Either
+     handler can be 0. */
+  void set_response_handler(TwitterHeaderCallback header, Print *body,
+                            void *context);
+
   /* URL encode character `ch' into the buffer `buffer'.  The method
      returns a pointer to the next byte after the encoded value. */
   static char *url_encode(char *buffer, char ch);
@@ -112,31 +266,85 @@ public:
      to the next byte after the encoded value. */
   static char *url_encode_eeprom(char *buffer, int address);
 
-  /* Hex encode binary data `data', `data_len' into the buffer
-     `buffer'.  The method returns a pointer to the next byte after
-     the encoded value. */
-  static char *hex_encode(char *buffer, const uint8_t *data, size_t data_len);
+  /* The length of the URL encoding of the c-string `data'.  This can
+     be used to size the output buffer of url_encode(). */
+  static size_t url_encoded_length(const char *data);
 
-  /* Base64 encode binary data `data', `data_len' into the buffer
-     `buffer'.  The method returns a pointer to the next byte after
-     the encoded value. */
-  static char *base64_encode(char *buffer, const uint8_t *data,
-                             size_t data_len);
+  /* The length of the URL encoding of the program memory c-string
+     `data'. */
+  static size_t url_encoded_length_pgm(const prog_char data[]);
 
 private:
 
-  /* Create a random nonce into the member `nonce.  The method uses
-     `timestamp' as its random seed so you must set it before calling
-     this method. */
+  /* URL encode character `ch' into the buffer `buffer' without null
+     termination.  The method returns a pointer to the next byte after
+     the encoded value. */
+  static char *url_encode_char(char *buffer, char ch);
+
+  /* URL encode character `ch' to the output stream `out'. */
+  static void print_url_encoded(Print *out, char ch);
+
+  /* URL encode c-string `data' to the output stream `out'. */
+  static void print_url_encoded(Print *out, const char *data);
+
+  /* URL encode program memory c-string `data' to the output stream
+     `out'. */
+  static void print_url_encoded_pgm(Print *out, const prog_char data[]);
+
+  /* URL encode EEPROM memory c-string that starts from address
+     `address' to the output stream `out'. */
+  static void print_url_encoded_eeprom(Print *out, int address);
+
+  /* Post status message `message'.  The method returns the HTTP
+     status code of the response or 0 if the request failed. */
+  int post(const char *message);
+
+  /* The HMAC key state of the current account.  For an account record
+     this is the cached `key_state'.  Otherwise the method derives the
+     state from the consumer and token secrets into `state', using the
+     whole work buffer. */
+  const uint8_t *signing_key(uint8_t *state);
+
+  /* Store the request body for the status message `message' to the
+     beginning of the work buffer and reserve it by advancing the work
+     buffer past it.  The method returns the length of the body or 0
+     if the message does not fit. */
+  size_t encode_status(const char *message);
+
+  /* Release the request body of length `body_len' that
+     encode_status() reserved. */
+  void release_status(size_t body_len);
+
+  /* Send the status update request with the body `body', `body_len'
+     over the connection `http' and read its response.  The request is
+     signed with the HMAC key state `key'.  If `keep_alive' is true,
+     the request asks the server to keep the connection open.  The
+     method returns the HTTP status code of the response or 0 if the
+     request failed. */
+  int request(Client *http, const uint8_t *key, const char *body,
+              size_t body_len, bool keep_alive);
+
+  /* Remove the first message from the queue. */
+  void dequeue(void);
+
+  /* Store the account record to the address `address'.  The work
+     buffer holds the OAuth signing key, `key_len' bytes, followed by
+     the URL encoded access token, `token_len' bytes. */
+  bool write_account(int address, size_t key_len, size_t token_len);
+
+  /* Create a random nonce into the member `nonce'.  The nonce is
+     generated with the global Entropy instance that the sketch should
+     initialize with Entropy.begin(). */
   void create_nonce(void);
 
-  /* Compute OAuth signature for the status message `message'.  The
-     method uses the current state from consumer and access tokens and
-     from `timestamp' and `nonce' member.  The computed signature will
+  /* Compute OAuth signature for the URL encoded status message
+     `status' with the HMAC key state `key'.  The method uses the
+     current state from consumer and access tokens and from `timestamp'
+     and `nonce' member.  The computed signature will
      remain in the global `Sha1' instance and is pointed by
      `signature'.  You must not use the `Sha1' instance before you
      have consumed value. */
-  void compute_authorization(const char *message);
+  void compute_authorization(const uint8_t *key, const char *status);
 
   /* Add character `ch' into the authorization signature hmac. */
   void auth_add(char ch);
@@ -149,9 +357,8 @@ private:
   void auth_add_pgm(const prog_char str[]);
 
   /* Add request parameter `key', `value' into the authorization
-     signature hmac.  The argument `workbuf' specifies a working
-     buffer for the method. */
-  void auth_add_param(const char *key, const char *value, char *workbuf);
+     signature hmac. */
+  void auth_add_param(const prog_char key[], const char *value);
 
   /* Add authorization parameter separator into the authorization
      signature hmac. */
@@ -186,27 +393,58 @@ private:
      error. */
   bool query_time(void);
 
-  /* Process the response header line `buffer' and update the system
-     `basetime' if the header is a HTTP Date header.  The method
-     returns true if the header line was a `Date' header and false
-     otherwise. */
-  bool process_date_header(char *buffer);
-
-  /* Parse the value of the HTTP Date header `date'.  The method
-     returns the Unix time value in seconds or 0 if the header could
-     not be parsed. */
-  long parse_date(char *date);
-
-  /* Parse month name `str' and return its number (1-12).  The method
-     returns a pointer to the end of the parsed month in `end'.  The
-     method returns 0 if the month could not be parsed. */
-  int parse_month(char *str, char **end);
-
-  /* The base timestamp for current time computation. */
-  unsigned long basetime;
+  /* Read the response from the connection `client'.  The method
+     reads the status line into `response_code', dispatches the
+     headers to process_header() and the response handler, and writes
+     the body to the body handler.  If `head' is true, the response
+     has no body.  The method returns true if the response was read
+     and false on error. */
+  bool read_response(Client *client, bool head);
 
-  /* Last milliseconds from the system clock. */
-  unsigned long last_millis;
+  /* Read the response headers from the connection `client'.  The
+     method returns true if the headers were read and false on
+     error. */
+  bool read_headers(Client *client);
+
+  /* Read the response body from the connection `client' and write
+     it to `sink', or discard it if `sink' is 0.  The method returns
+     true if the body was read and false on error. */
+  bool read_body(Client *client, Print *sink);
+
+  /* Process the response header `header', `value'. */
+  void process_header(uint8_t header, const char *value);
+
+  /* The UTC clock, disciplined by the server Date headers. */
+  Clock clock;
+
+  /* The outbound status queue and the number of queued messages. */
+  TwitterStatus queue[TWITTER_QUEUE_SIZE];
+  uint8_t queue_len;
+
+  /* The time of the next post attempt and the current retry
+     delay. */
+  unsigned long next_attempt;
+  unsigned long retry_delay;
+
+  /* The response handlers and their context. */
+  TwitterHeaderCallback header_handler;
+  Print *body_handler;
+  void *handler_context;
+
+  /* The state of the last response: the HTTP status code, the
+     content length or -1 if not known, is the body chunked, and can
+     the connection be reused. */
+  int response_code;
+  long content_length;
+  bool chunked;
+  bool keep_alive;
+
+  /* The rate limit headers of the last response: the remaining
+     requests or -1 if not known, the Unix time when the limit resets,
+     and the Retry-After delay in seconds. */
+  long rate_remaining;
+  unsigned long rate_reset;
+  unsigned long retry_after;
 
   /* Flags. */
 
@@ -217,6 +455,17 @@ private:
   /* Is access token in PGM or in EEPROM? */
   unsigned int access_token_pgm : 1;
 
+  /* Is the account identification from an account record? */
+  unsigned int account_record : 1;
+
+  /* The URL encoded access token and the HMAC key state of the OAuth
+     signing key from the account record. */
+  char token[TWITTER_TOKEN_LEN];
+  uint8_t key_state[HMAC_STATE_LENGTH];
+
+  /* The EEPROM address of the loaded account record. */
+  int account_address;
+
   /* Random nonce for the OAuth request. */
   uint8_t nonce[8];
 
@@ -0,0 +1,99 @@
+/*
+ * TxScheduler.cpp
+ *
+ * Author: Markku Rossi <mtr@iki.fi>
+ *
+ * Copyright (c) 2012 Markku Rossi
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "TxScheduler.h"
+
+TxScheduler::TxScheduler(unsigned long interval, unsigned long heartbeat)
+  : interval(interval),
+    heartbeat(heartbeat),
+    last_sent(0),
+    hold_start(0),
+    hold_time(0),
+    backoff(0),
+    started(false)
+{
+}
+
+void
+TxScheduler::set_interval(unsigned long interval)
+{
+  this->interval = interval;
+}
+
+void
+TxScheduler::set_heartbeat(unsigned long heartbeat)
+{
+  this->heartbeat = heartbeat;
+}
+
+bool
+TxScheduler::should_send(bool changed)
+{
+  unsigned long now = millis();
+
+  /* The differences are computed with unsigned arithmetic so they
+     are valid over the millis() wraparound. */
+
+  if (now - hold_start < hold_time)
+    return false;
+
+  if (changed || !started)
+    return true;
+
+  return now - last_sent >= heartbeat;
+}
+
+void
+TxScheduler::busy(void)
+{
+  if (backoff < TX_SCHEDULER_MAX_BACKOFF)
+    backoff++;
+
+  hold(random(1, (1L << backoff) + 1) * TX_SCHEDULER_SLOT);
+}
+
+void
+TxScheduler::sent(void)
+{
+  last_sent = millis();
+  started = true;
+  backoff = 0;
+
+  hold(interval + random(interval + 1));
+}
+
+bool
+TxScheduler::exceeds(int32_t value, int32_t reference, uint16_t deadband)
+{
+  if (value > reference)
+    return value - reference > deadband;
+
+  return reference - value > deadband;
+}
+
+void
+TxScheduler::hold(unsigned long wait)
+{
+  hold_start = millis();
+  hold_time = wait;
+}
@@ -0,0 +1,110 @@
+/* -*- c++ -*-
+ *
+ * TxScheduler.h
+ *
+ * Author: Markku Rossi <mtr@iki.fi>
+ *
+ * Copyright (c) 2012 Markku Rossi
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TXSCHEDULER_H
+#define TXSCHEDULER_H
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+/* The backoff slot time in milliseconds.  This should be about the
+   airtime of one packet. */
+#define TX_SCHEDULER_SLOT 250
+
+/* The maximum backoff exponent.  The backoff window is 2^n slots
+   after `n' consecutive busy channel detections. */
+#define TX_SCHEDULER_MAX_BACKOFF 5
+
+/* Transmit scheduler for clients sharing one radio channel.  The
+   scheduler spaces transmissions at least `interval' milliseconds
+   apart, adds a random jitter so that clients do not stay in sync,
+   backs off randomly when the channel is busy, and suppresses
+   transmissions until the data changes or the heartbeat interval
+   expires. */
+class TxScheduler
+{
+public:
+
+  /* Construct a scheduler with the minimum transmit interval
+     `interval' and the heartbeat interval `heartbeat', both in
+     milliseconds. */
+  TxScheduler(unsigned long interval, unsigned long heartbeat);
+
+  /* Set the minimum transmit interval to `interval' milliseconds.
+     Each transmission is followed by a hold-off time that is random
+     between `interval' and 2 * `interval'. */
+  void set_interval(unsigned long interval);
+
+  /* Set the heartbeat interval to `heartbeat' milliseconds.  An
+     unchanged reading is sent when the heartbeat interval has passed
+     since the last transmission. */
+  void set_heartbeat(unsigned long heartbeat);
+
+  /* Tests if a packet should be sent now.  The argument `changed'
+     specifies whether the data has changed since the last
+     transmission.  The method returns true if the caller should
+     transmit now. */
+  bool should_send(bool changed);
+
+  /* Notify the scheduler that the channel was found busy when
+     transmission was attempted.  The next attempt is delayed by a
+     random number of slots from an exponentially growing window. */
+  void busy(void);
+
+  /* Notify the scheduler that a packet was sent. */
+  void sent(void);
+
+  /* Tests if `value' differs from `reference' by more than
+     `deadband'. */
+  static bool exceeds(int32_t value, int32_t reference, uint16_t deadband);
+
+private:
+
+  /* Hold off for `wait' milliseconds from now. */
+  void hold(unsigned long wait);
+
+  /* The minimum transmit interval. */
+  unsigned long interval;
+
+  /* The heartbeat interval. */
+  unsigned long heartbeat;
+
+  /* The time of the last transmission. */
+  unsigned long last_sent;
+
+  /* The start and the length of the current hold-off time. */
+  unsigned long hold_start;
+  unsigned long hold_time;
+
+  /* The current backoff exponent. */
+  uint8_t backoff;
+
+  /* Has anything been sent yet? */
+  bool started;
+};
+
+#endif /* not TXSCHEDULER_H */